@@ -0,0 +1,163 @@
+// Check of the SIMD versions of the beam model kernel against the portable version, on random data
+//
+// For every precision (double, float, 16-bit fixed point) and every instruction set that the CPU supports, the
+// beam likelihood of random sensor and model ranges is compared with calculateBeamLikelihoodScalar. The data
+// includes max-range beams, beams without a model range, and beam counts that are not a multiple of the vector
+// width. Fails if any version differs more than the tolerance (relative) from the portable version.
+//
+// Usage:
+//
+//     ed_localization_beam_kernel_check
+
+#include "beam_kernel.h"
+#include "random.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+const double RANGE_MAX = 10;
+const double SIGMA_HIT = 0.2;
+const double LAMBDA_SHORT = 0.1;
+
+const unsigned int NUM_BEAMS[] = { 0, 1, 3, 4, 7, 8, 9, 15, 17, 100, 1001 };
+const unsigned int NUM_RUNS = 20;
+
+const BeamInstructionSet INSTRUCTION_SETS[] = { BEAM_SSE2, BEAM_NEON, BEAM_AVX2 };
+
+// ----------------------------------------------------------------------------------------------------
+
+// Lookup tables and parameters like LaserModel::configure
+template<typename T>
+struct Model
+{
+    typedef typename BeamPrecision<T>::Table Table;
+
+    Model()
+    {
+        int resolution = 1000;
+        int table_size = std::ceil(RANGE_MAX * resolution) + 2;
+
+        exp_hit.resize(table_size);
+        exp_short.resize(table_size);
+        for(int i = 0; i < table_size; ++i)
+        {
+            double z = (double)i / resolution;
+            exp_hit[i] = BeamPrecision<T>::toTable(std::exp(-(z * z) / (2 * SIGMA_HIT * SIGMA_HIT)));
+            exp_short[i] = BeamPrecision<T>::toTable(std::exp(-LAMBDA_SHORT * z));
+        }
+
+        params.z_hit = 0.95;
+        params.z_short_lambda = 0.1 * LAMBDA_SHORT;
+        params.z_max = 0.05;
+        params.z_rand_term = 0.05 / RANGE_MAX;
+        params.range_max = BeamPrecision<T>::fromMeters(RANGE_MAX);
+        params.exp_hit = exp_hit.data();
+        params.exp_short = exp_short.data();
+    }
+
+    std::vector<Table> exp_hit;
+    std::vector<Table> exp_short;
+    BeamKernelParams<T> params;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Random range: mostly within the sensor range, some at or beyond range_max, and some 0 (no range)
+double randomRange(Random& rng)
+{
+    double u = rng.uniform();
+    if (u < 0.05)
+        return 0;
+    if (u < 0.1)
+        return RANGE_MAX;
+    if (u < 0.15)
+        return RANGE_MAX * (1 + rng.uniform());
+    return RANGE_MAX * rng.uniform();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Returns the largest relative difference of the instruction set from the portable version
+template<typename T>
+double maxDifference(BeamInstructionSet set)
+{
+    Model<T> model;
+
+    Random rng;
+    rng.setSeed(1);
+
+    double max_diff = 0;
+    for(unsigned int n = 0; n < sizeof(NUM_BEAMS) / sizeof(NUM_BEAMS[0]); ++n)
+    {
+        unsigned int num_beams = NUM_BEAMS[n];
+
+        for(unsigned int run = 0; run < NUM_RUNS; ++run)
+        {
+            std::vector<T> sensor_ranges(num_beams), model_ranges(num_beams);
+            for(unsigned int i = 0; i < num_beams; ++i)
+            {
+                double sensor_range = randomRange(rng);
+
+                // Half of the model ranges close to the sensor range (hits), the rest random
+                double model_range = rng.uniform() < 0.5 ? std::max(0.0, sensor_range + 0.3 * (rng.uniform() - 0.5)) : randomRange(rng);
+
+                sensor_ranges[i] = BeamPrecision<T>::fromMeters(sensor_range);
+                model_ranges[i] = BeamPrecision<T>::fromMeters(model_range);
+            }
+
+            double expected = calculateBeamLikelihoodScalar(sensor_ranges.data(), model_ranges.data(), num_beams, model.params);
+            double p = calculateBeamLikelihood(sensor_ranges.data(), model_ranges.data(), num_beams, model.params, set);
+
+            max_diff = std::max(max_diff, std::abs(p - expected) / expected);
+        }
+    }
+
+    return max_diff;
+}
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+int main()
+{
+    bool failed = false;
+
+    printf("\n%-8s %12s %12s %12s\n", "", "double", "float", "fixed16");
+
+    for(unsigned int s = 0; s < sizeof(INSTRUCTION_SETS) / sizeof(INSTRUCTION_SETS[0]); ++s)
+    {
+        BeamInstructionSet set = INSTRUCTION_SETS[s];
+        if (!beamInstructionSetAvailable(set))
+        {
+            printf("%-8s %12s %12s %12s\n", beamInstructionSetName(set), "-", "-", "-");
+            continue;
+        }
+
+        // The double version only differs in the order of the sum, the others also sum in single precision
+        double diff_double = maxDifference<double>(set);
+        double diff_float = maxDifference<float>(set);
+        double diff_fixed16 = maxDifference<uint16_t>(set);
+
+        failed = failed || diff_double > 1e-12 || diff_float > 1e-5 || diff_fixed16 > 1e-5;
+
+        printf("%-8s %12.3g %12.3g %12.3g\n", beamInstructionSetName(set), diff_double, diff_float, diff_fixed16);
+    }
+
+    printf("\ncalculateBeamLikelihood uses %s\n", beamInstructionSetName(bestBeamInstructionSet()));
+
+    if (failed)
+    {
+        printf("\nA SIMD version of the beam model differs from the portable version\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,372 @@
+// Microbenchmarks of the hot loops of the particle filter and the sensor models, on synthetic data
+//
+// Run with (from the build tree):
+//
+//     make run_benchmarks_ed_localization
+//
+// or run the ed_localization_microbenchmarks executable directly, e.g. with --benchmark_filter=Resample.
+
+#include "cross_section_cache.h"
+#include "laser_model.h"
+#include "odom_model.h"
+#include "particle_filter.h"
+#include "stage_profiler.h"
+#include "synthetic_world.h"
+
+#include <benchmark/benchmark.h>
+
+#include <sensor_msgs/LaserScan.h>
+
+#include <tue/config/configuration.h>
+
+#include <cmath>
+#include <string>
+#include <vector>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+// Fills the filter with n samples, uniformly distributed in a box of 'spread' (m) around 'center'
+// and +/- 'rot_spread' (rad) around 0, with random (normalized) weights
+void initSamples(ParticleFilter& pf, unsigned int n, double spread, double rot_spread,
+                 const geo::Vec2& center = geo::Vec2(1, 1))
+{
+    Random rng;
+    rng.setSeed(1);
+
+    SampleSet& samples = pf.sampleSet();
+    samples.resize(n);
+    for(unsigned int i = 0; i < n; ++i)
+    {
+        samples.setPose(i, center.x + spread * (rng.uniform() - 0.5), center.y + spread * (rng.uniform() - 0.5),
+                        rot_spread * (2 * rng.uniform() - 1));
+        samples.weight[i] = rng.uniform();
+    }
+
+    pf.normalize();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void configureLaserModel(LaserModel& laser_model, const std::string& type, int num_beams,
+                         double min_particle_distance, double min_particle_rotation_distance,
+                         const std::string& beam_selection = "uniform")
+{
+    tue::Configuration config;
+    config.setValue("type", type);
+    config.setValue("num_beams", num_beams);
+    config.setValue("beam_selection", beam_selection);
+    config.setValue("z_hit", 0.95);
+    config.setValue("sigma_hit", 0.2);
+    config.setValue("z_short", 0.1);
+    config.setValue("z_max", 0.05);
+    config.setValue("z_rand", 0.05);
+    config.setValue("lambda_short", 0.1);
+    config.setValue("range_max", 10.0);
+    config.setValue("min_particle_distance", min_particle_distance);
+    config.setValue("min_particle_rotation_distance", min_particle_rotation_distance);
+
+    laser_model.configure(config);
+    laser_model.setLaserOffset(geo::Transform2::identity(), LASER_HEIGHT, false);
+}
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+//                                          PARTICLE FILTER
+// ----------------------------------------------------------------------------------------------------
+
+void BM_Resample(benchmark::State& state, ParticleFilter::ResampleMethod method)
+{
+    unsigned int n = state.range(0);
+
+    ParticleFilter pf;
+    pf.setResampleMethod(method);
+    initSamples(pf, n, 2, 1);
+
+    // Resampling replaces the weights, so restore the original set before every iteration
+    SampleSet original = pf.sampleSet();
+
+    while (state.KeepRunning())
+    {
+        state.PauseTiming();
+        pf.sampleSet() = original;
+        state.ResumeTiming();
+
+        pf.resample(n);
+    }
+
+    state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK_CAPTURE(BM_Resample, deterministic, ParticleFilter::RESAMPLE_DETERMINISTIC)->Range(1000, 100000);
+BENCHMARK_CAPTURE(BM_Resample, systematic, ParticleFilter::RESAMPLE_SYSTEMATIC)->Range(1000, 100000);
+BENCHMARK_CAPTURE(BM_Resample, stratified, ParticleFilter::RESAMPLE_STRATIFIED)->Range(1000, 100000);
+BENCHMARK_CAPTURE(BM_Resample, residual, ParticleFilter::RESAMPLE_RESIDUAL)->Range(1000, 100000);
+
+// ----------------------------------------------------------------------------------------------------
+
+void BM_Normalize(benchmark::State& state)
+{
+    unsigned int n = state.range(0);
+
+    ParticleFilter pf;
+    initSamples(pf, n, 2, 1);
+
+    while (state.KeepRunning())
+        pf.normalize();
+
+    state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_Normalize)->Range(1000, 100000);
+
+// ----------------------------------------------------------------------------------------------------
+
+void BM_CalculateMeanPose(benchmark::State& state)
+{
+    unsigned int n = state.range(0);
+
+    ParticleFilter pf;
+    initSamples(pf, n, 2, 1);
+
+    while (state.KeepRunning())
+        benchmark::DoNotOptimize(pf.calculateMeanPose());
+
+    state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_CalculateMeanPose)->Range(1000, 100000);
+
+// ----------------------------------------------------------------------------------------------------
+
+void BM_BestSample(benchmark::State& state)
+{
+    unsigned int n = state.range(0);
+
+    ParticleFilter pf;
+    initSamples(pf, n, 2, 1);
+
+    while (state.KeepRunning())
+        benchmark::DoNotOptimize(pf.bestSampleIndex());
+
+    state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_BestSample)->Range(1000, 100000);
+
+// ----------------------------------------------------------------------------------------------------
+
+void BM_Clusters(benchmark::State& state)
+{
+    unsigned int n = state.range(0);
+
+    ParticleFilter pf;
+    initSamples(pf, n, 2, 1);
+
+    while (state.KeepRunning())
+    {
+        pf.sampleSet();  // Invalidates the clusters
+        benchmark::DoNotOptimize(pf.clusters().size());
+    }
+
+    state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_Clusters)->Range(1000, 100000);
+
+// ----------------------------------------------------------------------------------------------------
+//                                             ODOM MODEL
+// ----------------------------------------------------------------------------------------------------
+
+void BM_OdomModelUpdatePoses(benchmark::State& state)
+{
+    unsigned int n = state.range(0);
+
+    ParticleFilter pf;
+    initSamples(pf, n, 2, 1);
+
+    tue::Configuration config;
+    config.setValue("alpha1", 0.2);
+    config.setValue("alpha2", 0.2);
+    config.setValue("alpha3", 0.2);
+    config.setValue("alpha4", 0.2);
+    config.setValue("alpha5", 0.1);
+
+    OdomModel odom_model;
+    odom_model.configure(config);
+
+    Transform movement;
+    movement.set(geo::Transform2(0.05, 0.01, 0.02));
+
+    while (state.KeepRunning())
+        odom_model.updatePoses(movement, 0, pf);
+
+    state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_OdomModelUpdatePoses)->Range(1000, 100000);
+
+// ----------------------------------------------------------------------------------------------------
+//                                             LASER MODEL
+// ----------------------------------------------------------------------------------------------------
+
+// Unique sample detection, for samples in a 1 x 1 m, +/- 0.5 rad area (i.e., a converged filter) and
+// in a 10 x 10 m, +/- pi area (i.e., after a wide initial pose or kidnapping)
+void BM_FindUniqueSamples(benchmark::State& state, double spread, double rot_spread)
+{
+    unsigned int n = state.range(0);
+
+    ParticleFilter pf;
+    initSamples(pf, n, spread, rot_spread);
+
+    LaserModel laser_model;
+    configureLaserModel(laser_model, "beam", 100, 0.05, 0.05);
+
+    std::vector<unsigned int> unique_samples, sample_to_unique;
+
+    while (state.KeepRunning())
+        laser_model.findUniqueSamples(pf.sampleSet(), unique_samples, sample_to_unique);
+
+    state.SetItemsProcessed(state.iterations() * n);
+    state.SetLabel(std::to_string(unique_samples.size()) + " unique");
+}
+BENCHMARK_CAPTURE(BM_FindUniqueSamples, converged, 1.0, 0.5)->Range(1000, 100000);
+BENCHMARK_CAPTURE(BM_FindUniqueSamples, global, 10.0, M_PI)->Range(1000, 100000);
+
+// ----------------------------------------------------------------------------------------------------
+
+// Scoring of the unique samples against the scan (the weight update stage of LaserModel::updateWeights,
+// without the unique sample detection and cross section selection). Arguments: number of samples and
+// number of beams. Nearly all samples are unique.
+void BM_LaserModelScoring(benchmark::State& state, const std::string& type)
+{
+    unsigned int n = state.range(0);
+    int num_beams = state.range(1);
+
+    std::vector<geo::Vec2> lines_start, lines_end;
+    createWorld(lines_start, lines_end);
+
+    CrossSectionCache cross_section;
+    cross_section.setLines("world", lines_start, lines_end, LASER_HEIGHT);
+
+    sensor_msgs::LaserScan scan = createScan(geo::Transform2(1, 1, 0), 1000, lines_start, lines_end);
+
+    ParticleFilter pf;
+    initSamples(pf, n, 1, 0.5);
+
+    StageProfiler profiler;
+
+    LaserModel laser_model;
+    configureLaserModel(laser_model, type, num_beams, 0.001, 0.001);
+    laser_model.setProfiler(&profiler);
+
+    // Builds the lookup tables (and the likelihood field)
+    laser_model.updateWeights(cross_section, scan, pf);
+
+    std::vector<DurationHistogram> stages;
+    std::vector<CounterStatistics> counters;
+
+    while (state.KeepRunning())
+    {
+        profiler.takeSnapshot(stages, counters);
+        laser_model.updateWeights(cross_section, scan, pf);
+        profiler.takeSnapshot(stages, counters);
+
+        state.SetIterationTime(stages[StageProfiler::WEIGHT_UPDATE].mean());
+    }
+
+    state.SetItemsProcessed(state.iterations() * (int64_t)counters[StageProfiler::NUM_UNIQUE_SAMPLES].mean());
+}
+
+void scoringArguments(benchmark::internal::Benchmark* b)
+{
+    for(int n = 1000; n <= 10000; n *= 10)
+        for(int num_beams : { 100, 360, 1000 })
+            b->Args({ n, num_beams });
+}
+BENCHMARK_CAPTURE(BM_LaserModelScoring, beam, std::string("beam"))->Apply(scoringArguments)->UseManualTime();
+BENCHMARK_CAPTURE(BM_LaserModelScoring, likelihood_field, std::string("likelihood_field"))->Apply(scoringArguments)->UseManualTime();
+
+// ----------------------------------------------------------------------------------------------------
+
+// Beam selection with 250 of 1000 beams, in the pillar room with unmodeled clutter (three 0.3 x 0.3 m boxes,
+// e.g., people) in front of the robot. Besides the duration of the update, reports:
+//
+//     clutter:         the fraction of the selected beams that hit the clutter (about 8% of all beams do)
+//     discrimination:  the weight of the samples within 0.1 m and 0.05 rad of the true pose after one
+//                      update from a uniform cloud of 1 x 1 m and +/- 0.5 rad
+void BM_BeamSelection(benchmark::State& state, const std::string& type, const std::string& selection)
+{
+    const unsigned int num_ranges = 1000;
+    const geo::Transform2 true_pose(0, 0, 0);
+
+    std::vector<geo::Vec2> lines_start, lines_end;
+    createWorld(lines_start, lines_end);
+
+    CrossSectionCache cross_section;
+    cross_section.setLines("world", lines_start, lines_end, LASER_HEIGHT);
+
+    // The scan also sees the clutter, which is not in the world model
+    std::vector<geo::Vec2> clutter_start = lines_start, clutter_end = lines_end;
+    const double clutter[3][2] = { { 1.5, 0.0 }, { 2.5, -0.7 }, { 3.0, 0.9 } };
+    for(unsigned int k = 0; k < 3; ++k)
+    {
+        geo::Vec2 c[4] = { geo::Vec2(clutter[k][0] - 0.15, clutter[k][1] - 0.15), geo::Vec2(clutter[k][0] + 0.15, clutter[k][1] - 0.15),
+                           geo::Vec2(clutter[k][0] + 0.15, clutter[k][1] + 0.15), geo::Vec2(clutter[k][0] - 0.15, clutter[k][1] + 0.15) };
+        for(unsigned int i = 0; i < 4; ++i)
+        {
+            clutter_start.push_back(c[i]);
+            clutter_end.push_back(c[(i + 1) % 4]);
+        }
+    }
+
+    sensor_msgs::LaserScan map_scan = createScan(true_pose, num_ranges, lines_start, lines_end);
+    sensor_msgs::LaserScan scan = createScan(true_pose, num_ranges, clutter_start, clutter_end);
+
+    ParticleFilter pf;
+    initSamples(pf, 2000, 1, 0.5, true_pose.t);
+
+    SampleSet& initial_samples = pf.sampleSet();
+    for(unsigned int i = 0; i < initial_samples.size(); ++i)
+        initial_samples.weight[i] = 1.0 / initial_samples.size();
+    SampleSet original = initial_samples;
+
+    LaserModel laser_model;
+    configureLaserModel(laser_model, type, 250, 0.001, 0.001, selection);
+
+    while (state.KeepRunning())
+    {
+        state.PauseTiming();
+        pf.sampleSet() = original;
+        state.ResumeTiming();
+
+        laser_model.updateWeights(cross_section, scan, pf);
+    }
+
+    // Which of the selected beams hit the clutter (identified by their direction)
+    const std::vector<double>& sensor_ranges = laser_model.sensor_ranges();
+    const std::vector<geo::Vec2>& beam_dirs = laser_model.beam_dirs();
+    unsigned int num_clutter = 0;
+    for(unsigned int k = 0; k < beam_dirs.size(); ++k)
+    {
+        int i = std::lround((std::atan2(beam_dirs[k].y, beam_dirs[k].x) - scan.angle_min) / scan.angle_increment);
+        if (i >= 0 && i < (int)num_ranges && scan.ranges[i] + 0.01 < map_scan.ranges[i])
+            ++num_clutter;
+    }
+
+    const SampleSet& samples = static_cast<const ParticleFilter&>(pf).sampleSet();
+    double near_weight = 0;
+    for(unsigned int i = 0; i < samples.size(); ++i)
+    {
+        if ((geo::Vec2(samples.x[i], samples.y[i]) - true_pose.t).length() < 0.1 && std::abs(samples.theta[i]) < 0.05)
+            near_weight += samples.weight[i];
+    }
+
+    state.counters["clutter"] = (double)num_clutter / std::max<std::size_t>(1, sensor_ranges.size());
+    state.counters["discrimination"] = near_weight;
+}
+BENCHMARK_CAPTURE(BM_BeamSelection, beam_uniform, std::string("beam"), std::string("uniform"));
+BENCHMARK_CAPTURE(BM_BeamSelection, beam_adaptive, std::string("beam"), std::string("adaptive"));
+BENCHMARK_CAPTURE(BM_BeamSelection, likelihood_field_uniform, std::string("likelihood_field"), std::string("uniform"));
+BENCHMARK_CAPTURE(BM_BeamSelection, likelihood_field_adaptive, std::string("likelihood_field"), std::string("adaptive"));
+
+// ----------------------------------------------------------------------------------------------------
+
+BENCHMARK_MAIN();
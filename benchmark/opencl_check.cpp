@@ -0,0 +1,235 @@
+// Check of the OpenCL beam model against the CPU beam model, on synthetic data
+//
+// Scores the same sample poses with the CPU model, with the OpenCL kernel run on the host, and (if built with
+// ED_LOCALIZATION_OPENCL and a device is available) with the kernel on the device, and reports the largest
+// differences of the log likelihoods. A difference d of the log likelihood scales the weight of the sample
+// by exp(d) relative to the CPU. Fails if the kernel differs more than the tolerance from the CPU model.
+//
+// Usage:
+//
+//     ed_localization_opencl_check [--tolerance D] [--require-device 0|1]
+//
+// The host run shows the error of the kernel itself (single precision, exact exponentials instead of the lookup
+// tables). Only the device run includes the error of the device and of -cl-fast-relaxed-math.
+
+#include "cross_section_cache.h"
+#include "laser_model.h"
+#include "particle_filter.h"
+#include "random.h"
+#include "synthetic_world.h"
+
+#include <sensor_msgs/LaserScan.h>
+
+#include <tue/config/configuration.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+struct Scenario
+{
+    const char* name;
+    unsigned int num_samples;
+    int num_beams;
+    double spread;      // Samples are uniformly distributed in a box of 'spread' (m) around the true pose
+    double rot_spread;  // and +/- 'rot_spread' (rad) around its rotation
+};
+
+const Scenario SCENARIOS[] =
+{
+    { "tracking", 500, 300, 0.5, 0.2 },
+    { "tracking", 500, 1000, 0.5, 0.2 },
+    { "global", 2000, 300, 18, M_PI },
+};
+
+// Largest and mean absolute difference of the log likelihoods b from a
+struct Difference
+{
+    Difference() : max(0), mean(0) {}
+
+    double max;
+    double mean;
+
+    void set(const std::vector<double>& a, const std::vector<double>& b)
+    {
+        double sum = 0;
+        for(unsigned int i = 0; i < a.size(); ++i)
+        {
+            double d = std::abs(b[i] - a[i]);
+            max = std::max(max, d);
+            sum += d;
+        }
+
+        mean = a.empty() ? 0 : sum / a.size();
+    }
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+void usage()
+{
+    std::cout << "Usage: ed_localization_opencl_check [--tolerance D] [--require-device 0|1]" << std::endl;
+}
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+    double tolerance = 0.02;
+    bool require_device = false;
+
+    for(int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (i + 1 >= argc)
+        {
+            usage();
+            return 1;
+        }
+
+        std::string value = argv[++i];
+
+        bool ok = true;
+        if (arg == "--tolerance")
+        {
+            tolerance = std::atof(value.c_str());
+            ok = tolerance > 0;
+        }
+        else if (arg == "--require-device")
+            require_device = (value == "1");
+        else
+            ok = false;
+
+        if (!ok)
+        {
+            std::cout << "Invalid argument: " << arg << " " << value << std::endl;
+            usage();
+            return 1;
+        }
+    }
+
+    std::vector<geo::Vec2> lines_start, lines_end;
+    createWorld(lines_start, lines_end);
+
+    CrossSectionCache cross_section;
+    cross_section.setLines("world", lines_start, lines_end, LASER_HEIGHT);
+
+    // In between the pillars
+    geo::Transform2 true_pose(0, 0, 0.3);
+
+    bool device_available = true;
+    std::string device_error;
+    bool failed = false;
+
+    printf("\n%-10s %8s %6s %12s %12s %12s %12s\n", "scenario", "samples", "beams", "host max", "host mean",
+           "device max", "device mean");
+
+    for(unsigned int s = 0; s < sizeof(SCENARIOS) / sizeof(SCENARIOS[0]); ++s)
+    {
+        const Scenario& scenario = SCENARIOS[s];
+
+        sensor_msgs::LaserScan scan = createScan(true_pose, 1000, lines_start, lines_end);
+
+        tue::Configuration config;
+        config.setValue("type", "beam");
+        config.setValue("num_beams", scenario.num_beams);
+        config.setValue("z_hit", 0.95);
+        config.setValue("sigma_hit", 0.2);
+        config.setValue("z_short", 0.1);
+        config.setValue("z_max", 0.05);
+        config.setValue("z_rand", 0.05);
+        config.setValue("lambda_short", 0.1);
+        config.setValue("range_max", 10.0);
+        config.setValue("min_particle_distance", 0.001);
+        config.setValue("min_particle_rotation_distance", 0.001);
+
+        LaserModel laser_model;
+        laser_model.configure(config);
+        laser_model.setLaserOffset(geo::Transform2::identity(), LASER_HEIGHT, false);
+
+        if (config.hasError())
+        {
+            std::cout << "Invalid configuration: " << config.error() << std::endl;
+            return 1;
+        }
+
+        Random rng;
+        rng.setSeed(s + 1);
+
+        ParticleFilter pf;
+        SampleSet& samples = pf.sampleSet();
+        samples.resize(scenario.num_samples);
+        for(unsigned int i = 0; i < scenario.num_samples; ++i)
+        {
+            samples.setPose(i, true_pose.t.x + scenario.spread * (rng.uniform() - 0.5),
+                            true_pose.t.y + scenario.spread * (rng.uniform() - 0.5),
+                            true_pose.rotation() + scenario.rot_spread * (2 * rng.uniform() - 1));
+            samples.weight[i] = 1;
+        }
+        pf.normalize();
+
+        // Selects the beams and the lines
+        laser_model.updateWeights(cross_section, scan, pf);
+
+        const SampleSet& updated_samples = static_cast<const ParticleFilter&>(pf).sampleSet();
+        std::vector<geo::Transform2> poses(updated_samples.size());
+        for(unsigned int i = 0; i < updated_samples.size(); ++i)
+            poses[i] = updated_samples.transform(i);
+
+        std::vector<double> cpu, host, device;
+        std::string error;
+
+        if (!laser_model.calculateLogLikelihoods(poses, LaserModel::CPU_BACKEND, cpu, error)
+                || !laser_model.calculateLogLikelihoods(poses, LaserModel::OPENCL_HOST_BACKEND, host, error))
+        {
+            std::cout << "Could not calculate the log likelihoods: " << error << std::endl;
+            return 1;
+        }
+
+        Difference host_diff;
+        host_diff.set(cpu, host);
+        failed = failed || host_diff.max > tolerance;
+
+        printf("%-10s %8u %6d %12.6f %12.6f", scenario.name, scenario.num_samples, scenario.num_beams,
+               host_diff.max, host_diff.mean);
+
+        if (device_available && laser_model.calculateLogLikelihoods(poses, LaserModel::OPENCL_BACKEND, device, device_error))
+        {
+            Difference device_diff;
+            device_diff.set(cpu, device);
+            failed = failed || device_diff.max > tolerance;
+
+            printf(" %12.6f %12.6f\n", device_diff.max, device_diff.mean);
+        }
+        else
+        {
+            printf(" %12s %12s\n", "-", "-");
+            device_available = false;
+        }
+    }
+
+    if (!device_available)
+        std::cout << "\nOpenCL device not available (" << device_error << "): only the host run is checked" << std::endl;
+
+    if (failed)
+    {
+        std::cout << "\nThe OpenCL beam model differs more than " << tolerance << " (log likelihood) from the CPU" << std::endl;
+        return 1;
+    }
+
+    if (require_device && !device_available)
+        return 1;
+
+    return 0;
+}
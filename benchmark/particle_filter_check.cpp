@@ -0,0 +1,134 @@
+// Check of the caching in the particle filter
+//
+// The effective sample size is calculated in the weight update pass, and the clusters while resampling. This checks
+// that a resample that is skipped (resample threshold) leaves them cached and the samples unchanged, and that the
+// clusters accumulated while resampling are equal to the ones calculated from the resampled set.
+//
+// Usage:
+//
+//     ed_localization_particle_filter_check
+
+#include "particle_filter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+const unsigned int NUM_SAMPLES = 2000;
+
+bool failed = false;
+
+void check(bool ok, const char* description)
+{
+    printf("%-70s %s\n", description, ok ? "ok" : "FAILED");
+    failed = failed || !ok;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool equal(const SampleSet& a, const SampleSet& b)
+{
+    return a.x == b.x && a.y == b.y && a.theta == b.theta && a.weight == b.weight;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool equal(const std::vector<PoseCluster>& a, const std::vector<PoseCluster>& b)
+{
+    if (a.size() != b.size())
+        return false;
+
+    // The accumulation order differs, so the sums differ in rounding
+    const double eps = 1e-9;
+    for(unsigned int i = 0; i < a.size(); ++i)
+    {
+        const PoseCluster& ca = a[i];
+        const PoseCluster& cb = b[i];
+        if (ca.num_samples != cb.num_samples || std::abs(ca.weight - cb.weight) > eps
+                || std::abs(ca.mean.t.x - cb.mean.t.x) > eps || std::abs(ca.mean.t.y - cb.mean.t.y) > eps
+                || std::abs(ca.mean_rotation - cb.mean_rotation) > eps || std::abs(ca.cov_xx - cb.cov_xx) > eps
+                || std::abs(ca.cov_xy - cb.cov_xy) > eps || std::abs(ca.cov_yy - cb.cov_yy) > eps
+                || std::abs(ca.cov_rotation - cb.cov_rotation) > eps)
+            return false;
+    }
+
+    return true;
+}
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+int main()
+{
+    ParticleFilter pf;
+    const ParticleFilter& const_pf = pf;
+    pf.setSeed(1);
+    pf.setResampleThreshold(0.5);
+    pf.setResampleMethod(ParticleFilter::RESAMPLE_SYSTEMATIC);
+
+    // Two modes, such that there is more than one cluster
+    std::vector<geo::Transform2> poses;
+    poses.push_back(geo::Transform2(0, 0, 0));
+    poses.push_back(geo::Transform2(3, 1, 1));
+    pf.initGaussian(poses, 0.1, 0.05, NUM_SAMPLES);
+
+    printf("\n");
+
+    // Mild weight update (one update per sample): the effective sample size stays above the threshold
+    std::vector<double> log_updates(NUM_SAMPLES);
+    std::vector<unsigned int> index(NUM_SAMPLES);
+    for(unsigned int i = 0; i < NUM_SAMPLES; ++i)
+    {
+        log_updates[i] = 0.5 * pf.rng().gaussian();
+        index[i] = i;
+    }
+
+    pf.updateWeights(log_updates, index);
+    check(pf.effectiveSampleSizeCached(), "effective sample size cached after weight update");
+
+    double ess = pf.effectiveSampleSize();
+    check(ess >= 0.5 * NUM_SAMPLES, "effective sample size above the resample threshold");
+
+    unsigned int num_clusters = pf.clusters().size();
+    check(num_clusters == 2 && pf.clustersCached(), "clusters cached once requested");
+
+    SampleSet before = const_pf.sampleSet();
+    check(pf.effectiveSampleSizeCached() && pf.clustersCached(), "const sample set access keeps the caches");
+
+    pf.resample(NUM_SAMPLES);
+    check(equal(before, const_pf.sampleSet()), "skipped resample keeps the samples");
+    check(pf.effectiveSampleSizeCached() && pf.effectiveSampleSize() == ess,
+          "skipped resample keeps the effective sample size");
+    check(pf.clustersCached(), "skipped resample keeps the clusters");
+
+    // Strong weight update: the filter resamples, and the clusters are accumulated while doing so
+    for(unsigned int i = 0; i < NUM_SAMPLES; ++i)
+        log_updates[i] = 20 * pf.rng().gaussian();
+
+    pf.updateWeights(log_updates, index);
+    check(pf.effectiveSampleSize() < 0.5 * NUM_SAMPLES, "effective sample size below the resample threshold");
+
+    pf.resample(NUM_SAMPLES);
+    check(!equal(before, const_pf.sampleSet()), "resampled");
+    check(pf.clustersCached(), "clusters cached after resampling");
+
+    std::vector<PoseCluster> accumulated = pf.clusters();
+    pf.sampleSet();  // Invalidates the clusters, such that they are calculated from the samples
+    check(!pf.clustersCached(), "non-const sample set access invalidates the clusters");
+    check(equal(accumulated, pf.clusters()), "accumulated clusters equal the calculated clusters");
+
+    if (failed)
+    {
+        printf("\nThe particle filter caches are not consistent\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,667 @@
+// Offline replay benchmark of the localization pipeline
+//
+// Loads an ED world model and a bag with laser scans and TF, and runs the particle filter, odom model
+// and laser model directly on the recorded data (without ROS communication, as fast as possible). For
+// every combination of particle count and number of beams it reports the throughput, the per-stage
+// latencies and, if ground truth is available, the pose error.
+//
+// Usage:
+//
+//     ed_localization_replay_benchmark --config CONFIG.yaml --world MODEL --bag BAG
+//         [--scan-topic TOPIC] [--ground-truth-topic TOPIC] [--particles N1,N2,..] [--beams N1,N2,..]
+//
+// The configuration file has the same format as the plugin configuration (odom_model, laser_model,
+// num_particles, initial_pose, ...). The ground truth topic may contain geometry_msgs/PoseStamped,
+// geometry_msgs/PoseWithCovarianceStamped or nav_msgs/Odometry messages (in the map frame).
+//
+// If built with ED_LOCALIZATION_COUNT_ALLOCATIONS, the bag is replayed twice, and the benchmark fails if any
+// filter update of the second pass allocated. The first pass lets the buffers of the update grow to their
+// working size (e.g., to the largest number of lines that is visible anywhere along the path).
+
+#include "allocation_counter.h"
+#include "cross_section_cache.h"
+#include "laser_model.h"
+#include "odom_model.h"
+#include "particle_filter.h"
+#include "stage_profiler.h"
+
+#include <ed/models/model_loader.h>
+#include <ed/update_request.h>
+#include <ed/world_model.h>
+
+#include <geolib/ros/tf_conversions.h>
+
+#include <geometry_msgs/PoseStamped.h>
+#include <geometry_msgs/PoseWithCovarianceStamped.h>
+#include <nav_msgs/Odometry.h>
+#include <sensor_msgs/LaserScan.h>
+#include <tf2_msgs/TFMessage.h>
+
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+
+#include <tf/transform_datatypes.h>
+#include <tf/tf.h>
+
+#include <tue/config/configuration.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+struct GroundTruthPose
+{
+    double time;
+    double x;
+    double y;
+    double yaw;
+};
+
+struct Result
+{
+    unsigned int num_particles;
+    unsigned int num_beams;
+    unsigned int num_scans;
+    double duration;
+
+    unsigned int num_errors;
+    double sum_error_d;
+    double sum_error_d_sq;
+    double max_error_d;
+    double sum_error_a;
+    double sum_error_a_sq;
+
+    // Filter updates of the last pass that allocated, and their total number of allocations
+    unsigned int num_allocating_updates;
+    unsigned long num_allocations;
+
+    std::vector<DurationHistogram> stages;
+    std::vector<CounterStatistics> counters;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+void usage()
+{
+    std::cout << "Usage: ed_localization_replay_benchmark --config CONFIG.yaml --world MODEL --bag BAG" << std::endl
+              << "           [--scan-topic TOPIC] [--ground-truth-topic TOPIC]" << std::endl
+              << "           [--particles N1,N2,..] [--beams N1,N2,..]" << std::endl;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool parseList(const std::string& s, std::vector<int>& values)
+{
+    std::stringstream ss(s);
+    std::string item;
+    while(std::getline(ss, item, ','))
+    {
+        int v = std::atoi(item.c_str());
+        if (v <= 0)
+            return false;
+        values.push_back(v);
+    }
+    return !values.empty();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+double normalizeAngle(double a)
+{
+    return std::atan2(std::sin(a), std::cos(a));
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+GroundTruthPose toGroundTruth(const ros::Time& stamp, const geometry_msgs::Pose& pose)
+{
+    GroundTruthPose gt;
+    gt.time = stamp.toSec();
+    gt.x = pose.position.x;
+    gt.y = pose.position.y;
+    gt.yaw = tf::getYaw(pose.orientation);
+    return gt;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Interpolates the ground truth (sorted on time) at time t. Returns false if there is no ground truth
+// within 0.1 s on both sides of t.
+bool interpolateGroundTruth(const std::vector<GroundTruthPose>& ground_truth, double t, GroundTruthPose& p)
+{
+    if (ground_truth.empty() || t < ground_truth.front().time || t > ground_truth.back().time)
+        return false;
+
+    // First pose at or after t
+    std::vector<GroundTruthPose>::const_iterator it = std::lower_bound(ground_truth.begin(), ground_truth.end(), t,
+        [](const GroundTruthPose& p, double time) { return p.time < time; });
+
+    const GroundTruthPose& p2 = *it;
+    const GroundTruthPose& p1 = (it == ground_truth.begin() ? *it : *(it - 1));
+
+    if (t - p1.time > 0.1 || p2.time - t > 0.1)
+        return false;
+
+    double f = p2.time > p1.time ? (t - p1.time) / (p2.time - p1.time) : 0;
+    p.time = t;
+    p.x = p1.x + f * (p2.x - p1.x);
+    p.y = p1.y + f * (p2.y - p1.y);
+    p.yaw = normalizeAngle(p1.yaw + f * normalizeAngle(p2.yaw - p1.yaw));
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+std::string stripLeadingSlash(const std::string& topic)
+{
+    return (!topic.empty() && topic[0] == '/') ? topic.substr(1) : topic;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool lookupTransform(const tf::Transformer& transformer, const std::string& target_frame, const std::string& source_frame,
+                     const ros::Time& time, tf::StampedTransform& transform)
+{
+    try
+    {
+        transformer.lookupTransform(target_frame, source_frame, time, transform);
+        return true;
+    }
+    catch(tf::TransformException& ex)
+    {
+        return false;
+    }
+}
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+    std::string config_filename, world_model_name, bag_filename, scan_topic, ground_truth_topic;
+    std::vector<int> particle_counts, beam_counts;
+
+    for(int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (i + 1 >= argc)
+        {
+            usage();
+            return 1;
+        }
+
+        std::string value = argv[++i];
+
+        bool ok = true;
+        if (arg == "--config")
+            config_filename = value;
+        else if (arg == "--world")
+            world_model_name = value;
+        else if (arg == "--bag")
+            bag_filename = value;
+        else if (arg == "--scan-topic")
+            scan_topic = value;
+        else if (arg == "--ground-truth-topic")
+            ground_truth_topic = value;
+        else if (arg == "--particles")
+            ok = parseList(value, particle_counts);
+        else if (arg == "--beams")
+            ok = parseList(value, beam_counts);
+        else
+            ok = false;
+
+        if (!ok)
+        {
+            std::cout << "Invalid argument: " << arg << " " << value << std::endl;
+            usage();
+            return 1;
+        }
+    }
+
+    if (config_filename.empty() || world_model_name.empty() || bag_filename.empty())
+    {
+        usage();
+        return 1;
+    }
+
+    ros::Time::init();
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Configuration
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+    tue::Configuration config;
+    if (!config.loadFromYAMLFile(config_filename))
+    {
+        std::cout << "Could not load configuration: " << config.error() << std::endl;
+        return 1;
+    }
+
+    std::string map_frame_id, odom_frame_id, base_link_frame_id;
+    if (config.readGroup("odom_model", tue::config::REQUIRED))
+    {
+        config.value("map_frame", map_frame_id);
+        config.value("odom_frame", odom_frame_id);
+        config.value("base_link_frame", base_link_frame_id);
+        config.endGroup();
+    }
+
+    int num_beams_config = 0;
+    if (config.readGroup("laser_model", tue::config::REQUIRED))
+    {
+        if (scan_topic.empty())
+            config.value("topic", scan_topic);
+        config.value("num_beams", num_beams_config);
+        config.endGroup();
+    }
+
+    int num_particles_config = 0;
+    config.value("num_particles", num_particles_config);
+
+    double resample_threshold = 1;
+    config.value("resample_threshold", resample_threshold, tue::config::OPTIONAL);
+
+    int seed = 0;
+    config.value("seed", seed, tue::config::OPTIONAL);
+
+    geo::Vec2 initial_position(0, 0);
+    double initial_yaw = 0;
+    if (config.readGroup("initial_pose", tue::config::OPTIONAL))
+    {
+        config.value("x", initial_position.x);
+        config.value("y", initial_position.y);
+        config.value("rz", initial_yaw);
+        config.endGroup();
+    }
+
+    if (config.hasError())
+    {
+        std::cout << "Invalid configuration: " << config.error() << std::endl;
+        return 1;
+    }
+
+    if (particle_counts.empty())
+        particle_counts.push_back(num_particles_config);
+
+    if (beam_counts.empty())
+        beam_counts.push_back(num_beams_config);
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     World model
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+    ed::WorldModel world;
+    {
+        ed::models::ModelLoader model_loader;
+        ed::UpdateRequest req;
+        std::stringstream error;
+        if (!model_loader.create("_root", world_model_name, req, error))
+        {
+            std::cout << "Could not load world model '" << world_model_name << "': " << error.str() << std::endl;
+            return 1;
+        }
+        world.update(req);
+    }
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Bag
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+    // All data is read before the benchmark starts, such that disk access is not measured
+
+    std::vector<sensor_msgs::LaserScanConstPtr> scans;
+    std::vector<GroundTruthPose> ground_truth;
+    std::vector<tf::StampedTransform> static_transforms;
+
+    rosbag::Bag bag;
+    try
+    {
+        bag.open(bag_filename, rosbag::bagmode::Read);
+    }
+    catch(rosbag::BagException& ex)
+    {
+        std::cout << "Could not open bag: " << ex.what() << std::endl;
+        return 1;
+    }
+
+    rosbag::View view(bag);
+
+    // Keep the complete bag in the TF buffer
+    ros::Duration bag_duration = view.getEndTime() - view.getBeginTime();
+    tf::Transformer transformer(true, bag_duration + ros::Duration(10));
+
+    for(rosbag::View::iterator it = view.begin(); it != view.end(); ++it)
+    {
+        const rosbag::MessageInstance& m = *it;
+        std::string topic = stripLeadingSlash(m.getTopic());
+
+        if (topic == "tf" || topic == "tf_static")
+        {
+            tf2_msgs::TFMessageConstPtr msg = m.instantiate<tf2_msgs::TFMessage>();
+            if (!msg)
+                continue;
+
+            for(std::vector<geometry_msgs::TransformStamped>::const_iterator it_t = msg->transforms.begin(); it_t != msg->transforms.end(); ++it_t)
+            {
+                tf::StampedTransform t;
+                tf::transformStampedMsgToTF(*it_t, t);
+                if (topic == "tf_static")
+                    static_transforms.push_back(t);
+                else
+                    transformer.setTransform(t, "bag");
+            }
+        }
+        else if (topic == stripLeadingSlash(scan_topic))
+        {
+            sensor_msgs::LaserScanConstPtr msg = m.instantiate<sensor_msgs::LaserScan>();
+            if (msg)
+                scans.push_back(msg);
+        }
+        else if (!ground_truth_topic.empty() && topic == stripLeadingSlash(ground_truth_topic))
+        {
+            if (geometry_msgs::PoseStampedConstPtr msg = m.instantiate<geometry_msgs::PoseStamped>())
+                ground_truth.push_back(toGroundTruth(msg->header.stamp, msg->pose));
+            else if (geometry_msgs::PoseWithCovarianceStampedConstPtr msg = m.instantiate<geometry_msgs::PoseWithCovarianceStamped>())
+                ground_truth.push_back(toGroundTruth(msg->header.stamp, msg->pose.pose));
+            else if (nav_msgs::OdometryConstPtr msg = m.instantiate<nav_msgs::Odometry>())
+                ground_truth.push_back(toGroundTruth(msg->header.stamp, msg->pose.pose));
+        }
+    }
+
+    // tf::Transformer has no notion of static transforms: add them at the start and end of the bag,
+    // such that they can be interpolated at any time in between
+    for(std::vector<tf::StampedTransform>::iterator it = static_transforms.begin(); it != static_transforms.end(); ++it)
+    {
+        it->stamp_ = view.getBeginTime();
+        transformer.setTransform(*it, "bag");
+        it->stamp_ = view.getEndTime();
+        transformer.setTransform(*it, "bag");
+    }
+
+    bag.close();
+
+    std::sort(ground_truth.begin(), ground_truth.end(),
+              [](const GroundTruthPose& a, const GroundTruthPose& b) { return a.time < b.time; });
+
+    if (scans.empty())
+    {
+        std::cout << "No laser scans on topic '" << scan_topic << "'" << std::endl;
+        return 1;
+    }
+
+    // Start at the ground truth (if available), otherwise at the configured initial pose
+    GroundTruthPose initial_gt;
+    for(unsigned int i = 0; i < scans.size(); ++i)
+    {
+        if (interpolateGroundTruth(ground_truth, scans[i]->header.stamp.toSec(), initial_gt))
+        {
+            initial_position = geo::Vec2(initial_gt.x, initial_gt.y);
+            initial_yaw = initial_gt.yaw;
+            break;
+        }
+    }
+
+    std::cout << "Loaded " << scans.size() << " scans and " << ground_truth.size() << " ground truth poses" << std::endl;
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Benchmark
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+    std::vector<Result> results;
+
+    for(std::vector<int>::const_iterator it_p = particle_counts.begin(); it_p != particle_counts.end(); ++it_p)
+    {
+        for(std::vector<int>::const_iterator it_b = beam_counts.begin(); it_b != beam_counts.end(); ++it_b)
+        {
+            unsigned int num_particles = *it_p;
+
+            OdomModel odom_model;
+            LaserModel laser_model;
+            ParticleFilter particle_filter;
+            CrossSectionCache cross_section;
+            StageProfiler profiler;
+
+            config.readGroup("odom_model");
+            odom_model.configure(config);
+            config.endGroup();
+
+            config.readGroup("laser_model");
+            config.setValue("num_beams", *it_b);
+            laser_model.configure(config);
+            config.endGroup();
+
+            if (config.hasError())
+            {
+                std::cout << "Invalid configuration: " << config.error() << std::endl;
+                return 1;
+            }
+
+            if (!laser_model.backendError().empty())
+                std::cout << "Laser model backend not available (" << laser_model.backendError() << "), using the CPU" << std::endl;
+
+            laser_model.setProfiler(&profiler);
+
+            particle_filter.setSeed(seed);
+            particle_filter.setResampleThreshold(resample_threshold);
+
+            Result result;
+            result.num_particles = num_particles;
+            result.num_beams = *it_b;
+            result.num_scans = 0;
+            result.num_errors = 0;
+            result.sum_error_d = result.sum_error_d_sq = result.max_error_d = 0;
+            result.sum_error_a = result.sum_error_a_sq = 0;
+            result.num_allocating_updates = 0;
+            result.num_allocations = 0;
+
+            bool laser_offset_initialized = false;
+            bool have_previous_pose = false;
+            geo::Pose3D previous_pose;
+
+            // If allocations are counted, the first pass is a warmup (see above)
+            unsigned int num_passes = allocationCountingEnabled() ? 2 : 1;
+
+            StageProfiler::Clock::time_point t_benchmark_start = StageProfiler::Clock::now();
+
+            for(unsigned int k = 0; k < num_passes * scans.size(); ++k)
+            {
+                const sensor_msgs::LaserScan& scan = *scans[k % scans.size()];
+
+                // Every pass starts from the initial pose (the models keep their buffers)
+                if (k % scans.size() == 0)
+                {
+                    particle_filter.initUniform(initial_position - geo::Vec2(0.3, 0.3), initial_position + geo::Vec2(0.3, 0.3), 0.05,
+                                                initial_yaw - 0.1, initial_yaw + 0.1, 0.05);
+                    have_previous_pose = false;
+                }
+
+                StageProfiler::Clock::time_point t_start = StageProfiler::Clock::now();
+
+                if (!laser_offset_initialized)
+                {
+                    tf::StampedTransform p_laser;
+                    if (!lookupTransform(transformer, base_link_frame_id, scan.header.frame_id, scan.header.stamp, p_laser))
+                        continue;
+
+                    geo::Transform2 offset(geo::Mat2(p_laser.getBasis()[0][0], p_laser.getBasis()[0][1],
+                                                     p_laser.getBasis()[1][0], p_laser.getBasis()[1][1]),
+                                           geo::Vec2(p_laser.getOrigin().getX(), p_laser.getOrigin().getY()));
+
+                    bool upside_down = p_laser.getBasis()[2][2] < 0;
+                    if (upside_down)
+                    {
+                        offset.R.yx = -offset.R.yx;
+                        offset.R.yy = -offset.R.yy;
+                    }
+
+                    laser_model.setLaserOffset(offset, p_laser.getOrigin().getZ(), upside_down);
+                    laser_offset_initialized = true;
+
+                    // The world model is static, so the cross section only has to be calculated once
+                    StageProfiler::Clock::time_point t = StageProfiler::Clock::now();
+                    cross_section.update(world, laser_model.laser_height());
+                    profiler.recordSince(StageProfiler::CROSS_SECTION_UPDATE, t);
+                }
+
+                tf::StampedTransform odom_to_base_link_tf;
+                if (!lookupTransform(transformer, odom_frame_id, base_link_frame_id, scan.header.stamp, odom_to_base_link_tf))
+                    continue;
+
+                StageProfiler::Clock::time_point t = profiler.recordSince(StageProfiler::TF_LOOKUP, t_start);
+
+                unsigned long num_allocations_start = allocationCount();
+
+                geo::Pose3D odom_to_base_link;
+                geo::convert(odom_to_base_link_tf, odom_to_base_link);
+
+                Transform movement;
+                if (have_previous_pose)
+                {
+                    geo::Pose3D delta = previous_pose.inverse() * odom_to_base_link;
+                    movement.set(geo::Transform2(geo::Mat2(delta.R.xx, delta.R.xy,
+                                                           delta.R.yx, delta.R.yy),
+                                                 geo::Vec2(delta.t.x, delta.t.y)));
+                }
+                else
+                {
+                    movement.set(geo::Transform2::identity());
+                }
+
+                previous_pose = odom_to_base_link;
+                have_previous_pose = true;
+
+                odom_model.updatePoses(movement, 0, particle_filter);
+
+                t = profiler.recordSince(StageProfiler::MOTION_UPDATE, t);
+                profiler.record(StageProfiler::NUM_SAMPLES, static_cast<const ParticleFilter&>(particle_filter).sampleSet().size());
+
+                laser_model.updateWeights(cross_section, scan, particle_filter);
+
+                t = StageProfiler::Clock::now();
+
+                particle_filter.resample(num_particles);
+
+                t = profiler.recordSince(StageProfiler::RESAMPLE, t);
+
+                geo::Transform2 mean_pose = particle_filter.bestCluster().mean;
+
+                profiler.recordSince(StageProfiler::MEAN_POSE, t);
+                profiler.recordSince(StageProfiler::TOTAL, t_start);
+
+                unsigned long num_allocations = allocationCount() - num_allocations_start;
+                if (k >= (num_passes - 1) * scans.size() && num_allocations > 0)
+                {
+                    ++result.num_allocating_updates;
+                    result.num_allocations += num_allocations;
+                }
+
+                ++result.num_scans;
+
+                // Pose error (not part of the timing)
+                GroundTruthPose gt;
+                if (interpolateGroundTruth(ground_truth, scan.header.stamp.toSec(), gt))
+                {
+                    double error_d = (mean_pose.t - geo::Vec2(gt.x, gt.y)).length();
+                    double error_a = std::abs(normalizeAngle(mean_pose.rotation() - gt.yaw));
+
+                    ++result.num_errors;
+                    result.sum_error_d += error_d;
+                    result.sum_error_d_sq += error_d * error_d;
+                    result.max_error_d = std::max(result.max_error_d, error_d);
+                    result.sum_error_a += error_a;
+                    result.sum_error_a_sq += error_a * error_a;
+                }
+            }
+
+            result.duration = std::chrono::duration<double>(StageProfiler::Clock::now() - t_benchmark_start).count();
+            profiler.takeSnapshot(result.stages, result.counters);
+            results.push_back(result);
+
+            std::cout << "." << std::flush;
+        }
+    }
+
+    std::cout << std::endl;
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Report
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+    printf("\n%10s %6s %7s %10s %12s %12s %10s %10s %10s %10s\n", "particles", "beams", "scans", "scans/s",
+           "total p50", "total p99", "err mean", "err rms", "err max", "rot rms");
+    printf("%10s %6s %7s %10s %12s %12s %10s %10s %10s %10s\n", "", "", "", "", "(ms)", "(ms)", "(m)", "(m)", "(m)", "(rad)");
+
+    for(std::vector<Result>::const_iterator it = results.begin(); it != results.end(); ++it)
+    {
+        const Result& r = *it;
+        const DurationHistogram& total = r.stages[StageProfiler::TOTAL];
+
+        printf("%10u %6u %7u %10.1f %12.3f %12.3f", r.num_particles, r.num_beams, r.num_scans,
+               r.duration > 0 ? r.num_scans / r.duration : 0, total.percentile(50) * 1000, total.percentile(99) * 1000);
+
+        if (r.num_errors > 0)
+            printf(" %10.3f %10.3f %10.3f %10.4f\n", r.sum_error_d / r.num_errors, std::sqrt(r.sum_error_d_sq / r.num_errors),
+                   r.max_error_d, std::sqrt(r.sum_error_a_sq / r.num_errors));
+        else
+            printf(" %10s %10s %10s %10s\n", "-", "-", "-", "-");
+    }
+
+    // Per-stage latencies
+    for(std::vector<Result>::const_iterator it = results.begin(); it != results.end(); ++it)
+    {
+        const Result& r = *it;
+
+        printf("\nparticles = %u, beams = %u\n", r.num_particles, r.num_beams);
+        printf("  %-22s %10s %10s %10s %10s\n", "stage", "p50 (ms)", "p99 (ms)", "mean (ms)", "max (ms)");
+
+        for(unsigned int i = 0; i < StageProfiler::NUM_STAGES; ++i)
+        {
+            const DurationHistogram& h = r.stages[i];
+            if (h.count() == 0)
+                continue;
+
+            printf("  %-22s %10.3f %10.3f %10.3f %10.3f\n", StageProfiler::stageName((StageProfiler::Stage)i),
+                   h.percentile(50) * 1000, h.percentile(99) * 1000, h.mean() * 1000, h.max() * 1000);
+        }
+
+        for(unsigned int i = 0; i < StageProfiler::NUM_COUNTERS; ++i)
+        {
+            const CounterStatistics& c = r.counters[i];
+            printf("  %-22s %10.1f (mean) %10.1f (max)\n", StageProfiler::counterName((StageProfiler::Counter)i), c.mean(), c.max);
+        }
+    }
+
+    // Steady-state allocations
+    if (allocationCountingEnabled())
+    {
+        printf("\nHeap allocations of the filter updates (after a warmup pass)\n");
+        printf("%10s %6s %18s %12s\n", "particles", "beams", "allocating updates", "allocations");
+
+        bool allocated = false;
+        for(std::vector<Result>::const_iterator it = results.begin(); it != results.end(); ++it)
+        {
+            const Result& r = *it;
+            printf("%10u %6u %18u %12lu\n", r.num_particles, r.num_beams, r.num_allocating_updates, r.num_allocations);
+            allocated = allocated || r.num_allocating_updates > 0;
+        }
+
+        if (allocated)
+        {
+            std::cout << "\nThe steady-state filter update allocated memory" << std::endl;
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,84 @@
+#ifndef ED_LOCALIZATION_BENCHMARK_SYNTHETIC_WORLD_H_
+#define ED_LOCALIZATION_BENCHMARK_SYNTHETIC_WORLD_H_
+
+// Synthetic world and laser scans of the microbenchmarks and the OpenCL check
+
+#include <geolib/datatypes.h>
+
+#include <sensor_msgs/LaserScan.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// ----------------------------------------------------------------------------------------------------
+
+const double LASER_HEIGHT = 0.3;
+
+// Square room of 20 x 20 m with a regular grid of 0.4 x 0.4 m pillars, every 2 m
+inline void createWorld(std::vector<geo::Vec2>& lines_start, std::vector<geo::Vec2>& lines_end)
+{
+    lines_start.clear();
+    lines_end.clear();
+
+    // Adds the four sides of the box [x1, x2] x [y1, y2]
+    auto addBox = [&](double x1, double y1, double x2, double y2)
+    {
+        geo::Vec2 c[4] = { geo::Vec2(x1, y1), geo::Vec2(x2, y1), geo::Vec2(x2, y2), geo::Vec2(x1, y2) };
+        for(unsigned int i = 0; i < 4; ++i)
+        {
+            lines_start.push_back(c[i]);
+            lines_end.push_back(c[(i + 1) % 4]);
+        }
+    };
+
+    addBox(-10, -10, 10, 10);
+
+    for(double x = -9; x < 10; x += 2)
+        for(double y = -9; y < 10; y += 2)
+            addBox(x - 0.2, y - 0.2, x + 0.2, y + 0.2);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Simulates a 270 degree scan with 'num_ranges' beams from 'pose', by ray casting against the lines
+inline sensor_msgs::LaserScan createScan(const geo::Transform2& pose, unsigned int num_ranges,
+                                  const std::vector<geo::Vec2>& lines_start, const std::vector<geo::Vec2>& lines_end)
+{
+    sensor_msgs::LaserScan scan;
+    scan.header.frame_id = "laser";
+    scan.angle_min = -0.75 * M_PI;
+    scan.angle_max = 0.75 * M_PI;
+    scan.angle_increment = (scan.angle_max - scan.angle_min) / (num_ranges - 1);
+    scan.range_min = 0.05;
+    scan.range_max = 30;
+    scan.ranges.resize(num_ranges);
+
+    for(unsigned int i = 0; i < num_ranges; ++i)
+    {
+        double a = pose.rotation() + scan.angle_min + i * scan.angle_increment;
+        geo::Vec2 d(std::cos(a), std::sin(a));
+
+        double r = scan.range_max + 1;
+        for(unsigned int j = 0; j < lines_start.size(); ++j)
+        {
+            // Solve pose.t + t * d = p1 + s * (p2 - p1), with t >= 0 and 0 <= s <= 1
+            geo::Vec2 e = lines_end[j] - lines_start[j];
+            geo::Vec2 w = lines_start[j] - pose.t;
+            double det = e.x * d.y - e.y * d.x;
+            if (std::abs(det) < 1e-12)
+                continue;
+
+            double t = (e.x * w.y - e.y * w.x) / det;
+            double s = (d.x * w.y - d.y * w.x) / det;
+            if (t >= 0 && s >= 0 && s <= 1)
+                r = std::min(r, t);
+        }
+
+        scan.ranges[i] = r;
+    }
+
+    return scan;
+}
+
+#endif
@@ -0,0 +1,94 @@
+#include "allocation_counter.h"
+
+#ifdef ED_LOCALIZATION_COUNT_ALLOCATIONS
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+std::atomic<unsigned long> allocation_count(0);
+
+void* allocate(std::size_t size)
+{
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+
+    if (size == 0)
+        size = 1;
+
+    while(true)
+    {
+        void* p = std::malloc(size);
+        if (p)
+            return p;
+
+        std::new_handler handler = std::set_new_handler(0);
+        std::set_new_handler(handler);
+        if (!handler)
+            throw std::bad_alloc();
+
+        handler();
+    }
+}
+
+void* allocate(std::size_t size, const std::nothrow_t&) noexcept
+{
+    try
+    {
+        return allocate(size);
+    }
+    catch(std::bad_alloc&)
+    {
+        return 0;
+    }
+}
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void* operator new(std::size_t size) { return allocate(size); }
+void* operator new[](std::size_t size) { return allocate(size); }
+void* operator new(std::size_t size, const std::nothrow_t& nt) noexcept { return allocate(size, nt); }
+void* operator new[](std::size_t size, const std::nothrow_t& nt) noexcept { return allocate(size, nt); }
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { std::free(p); }
+
+// ----------------------------------------------------------------------------------------------------
+
+bool allocationCountingEnabled()
+{
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+unsigned long allocationCount()
+{
+    return allocation_count.load(std::memory_order_relaxed);
+}
+
+#else
+
+// ----------------------------------------------------------------------------------------------------
+
+bool allocationCountingEnabled()
+{
+    return false;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+unsigned long allocationCount()
+{
+    return 0;
+}
+
+#endif
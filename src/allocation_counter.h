@@ -0,0 +1,20 @@
+#ifndef ED_LOCALIZATION_ALLOCATION_COUNTER_H_
+#define ED_LOCALIZATION_ALLOCATION_COUNTER_H_
+
+// ----------------------------------------------------------------------------------------------------
+
+// Debug counter of heap allocations, used to verify that the steady-state filter update does not allocate.
+// Only active if built with the ED_LOCALIZATION_COUNT_ALLOCATIONS CMake option: the global operator new is
+// then replaced by one that counts every allocation (of all threads) before calling malloc.
+//
+// The replacement is linked into executables that use the counter (e.g., the replay benchmark). It is not
+// used by the plugin: ED loads plugins with dlopen, so the operator new of the executable (or libstdc++)
+// would take precedence anyway.
+
+// True if the allocations are counted
+bool allocationCountingEnabled();
+
+// Total number of heap allocations (operator new / new[]) so far. Always 0 if counting is not enabled.
+unsigned long allocationCount();
+
+#endif
@@ -0,0 +1,724 @@
+#include "beam_kernel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ED_LOCALIZATION_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define ED_LOCALIZATION_NEON
+#include <arm_neon.h>
+#endif
+
+// ----------------------------------------------------------------------------------------------------
+
+template<typename T>
+double calculateBeamLikelihoodScalar(const T* sensor_ranges, const T* model_ranges, unsigned int num_beams,
+                                     const BeamKernelParams<T>& params)
+{
+    typedef typename BeamPrecision<T>::Compute Compute;
+
+    const Compute range_max = params.range_max;
+    const Compute resolution = BeamPrecision<T>::resolution();
+
+    // Scale the table entries back to probabilities (only needed for fixed point tables)
+    const double z_hit = params.z_hit * BeamPrecision<T>::tableScale();
+    const double z_short_lambda = params.z_short_lambda * BeamPrecision<T>::tableScale();
+
+    double p = 1;
+
+    for(unsigned int i = 0; i < num_beams; ++i)
+    {
+        Compute obs_range = sensor_ranges[i];
+        Compute map_range = model_ranges[i];
+
+        Compute z = obs_range - map_range;
+
+        // Part 1: good, but noisy, hit
+        double pz = z_hit * params.exp_hit[(int)(std::min<Compute>(std::abs(z), range_max) * resolution)];
+
+        // Part 2: short reading from unexpected obstacle (e.g., a person)
+        double p_short = z_short_lambda * params.exp_short[(int)(std::min(obs_range, range_max) * resolution)];
+        pz += z < 0 ? p_short : 0;
+
+        // Part 3: Failure to detect obstacle, reported as max-range
+        // Part 4: Random measurements
+        pz += obs_range >= range_max ? params.z_max : params.z_rand_term;
+
+        // here we have an ad-hoc weighting scheme for combining beam probs
+        // works well, though...
+        p += pz * pz * pz;
+    }
+
+    return p;
+}
+
+template double calculateBeamLikelihoodScalar<double>(const double*, const double*, unsigned int, const BeamKernelParams<double>&);
+template double calculateBeamLikelihoodScalar<float>(const float*, const float*, unsigned int, const BeamKernelParams<float>&);
+template double calculateBeamLikelihoodScalar<uint16_t>(const uint16_t*, const uint16_t*, unsigned int, const BeamKernelParams<uint16_t>&);
+
+#ifdef ED_LOCALIZATION_X86
+
+// ----------------------------------------------------------------------------------------------------
+
+// AVX2, double: 4 beams at a time, using gathers for the table lookups. The gathers are masked (with all
+// lanes enabled) only to give them a defined source operand.
+__attribute__((target("avx2,fma")))
+double calculateBeamLikelihoodAVX2(const double* sensor_ranges, const double* model_ranges, unsigned int num_beams,
+                                   const BeamKernelParams<double>& params)
+{
+    const __m256d sign_mask = _mm256_set1_pd(-0.0);
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d range_max = _mm256_set1_pd(params.range_max);
+    const __m256d resolution = _mm256_set1_pd(BeamPrecision<double>::resolution());
+    const __m256d z_hit = _mm256_set1_pd(params.z_hit);
+    const __m256d z_short_lambda = _mm256_set1_pd(params.z_short_lambda);
+    const __m256d z_max = _mm256_set1_pd(params.z_max);
+    const __m256d z_rand_term = _mm256_set1_pd(params.z_rand_term);
+    const __m256d all_lanes = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+
+    __m256d sum = _mm256_setzero_pd();
+
+    unsigned int i = 0;
+    for(; i + 4 <= num_beams; i += 4)
+    {
+        __m256d obs_range = _mm256_loadu_pd(sensor_ranges + i);
+        __m256d map_range = _mm256_loadu_pd(model_ranges + i);
+        __m256d z = _mm256_sub_pd(obs_range, map_range);
+
+        // Part 1: good, but noisy, hit
+        __m256d abs_z = _mm256_min_pd(_mm256_andnot_pd(sign_mask, z), range_max);
+        __m128i i_hit = _mm256_cvttpd_epi32(_mm256_mul_pd(abs_z, resolution));
+        __m256d pz = _mm256_mul_pd(z_hit, _mm256_mask_i32gather_pd(zero, params.exp_hit, i_hit, all_lanes, 8));
+
+        // Part 2: short reading from unexpected obstacle (only if z < 0)
+        __m256d obs_clamped = _mm256_min_pd(obs_range, range_max);
+        __m128i i_short = _mm256_cvttpd_epi32(_mm256_mul_pd(obs_clamped, resolution));
+        __m256d p_short = _mm256_mul_pd(z_short_lambda, _mm256_mask_i32gather_pd(zero, params.exp_short, i_short, all_lanes, 8));
+        pz = _mm256_add_pd(pz, _mm256_and_pd(_mm256_cmp_pd(z, zero, _CMP_LT_OQ), p_short));
+
+        // Part 3 and 4: max-range or random measurement
+        __m256d is_max = _mm256_cmp_pd(obs_range, range_max, _CMP_GE_OQ);
+        pz = _mm256_add_pd(pz, _mm256_blendv_pd(z_rand_term, z_max, is_max));
+
+        sum = _mm256_fmadd_pd(_mm256_mul_pd(pz, pz), pz, sum);
+    }
+
+    // Horizontal sum
+    __m128d sum2 = _mm_add_pd(_mm256_castpd256_pd128(sum), _mm256_extractf128_pd(sum, 1));
+    sum2 = _mm_add_sd(sum2, _mm_unpackhi_pd(sum2, sum2));
+
+    // Remaining beams
+    return _mm_cvtsd_f64(sum2) + calculateBeamLikelihoodScalar(sensor_ranges + i, model_ranges + i, num_beams - i, params);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Horizontal sum of 8 floats, in double precision
+__attribute__((target("avx2,fma")))
+inline double horizontalSum(__m256 v)
+{
+    __m256d sum = _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(v)), _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+    __m128d sum2 = _mm_add_pd(_mm256_castpd256_pd128(sum), _mm256_extractf128_pd(sum, 1));
+    sum2 = _mm_add_sd(sum2, _mm_unpackhi_pd(sum2, sum2));
+    return _mm_cvtsd_f64(sum2);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// AVX2, float: 8 beams at a time
+__attribute__((target("avx2,fma")))
+double calculateBeamLikelihoodAVX2(const float* sensor_ranges, const float* model_ranges, unsigned int num_beams,
+                                   const BeamKernelParams<float>& params)
+{
+    const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 range_max = _mm256_set1_ps(params.range_max);
+    const __m256 resolution = _mm256_set1_ps(BeamPrecision<float>::resolution());
+    const __m256 z_hit = _mm256_set1_ps(params.z_hit);
+    const __m256 z_short_lambda = _mm256_set1_ps(params.z_short_lambda);
+    const __m256 z_max = _mm256_set1_ps(params.z_max);
+    const __m256 z_rand_term = _mm256_set1_ps(params.z_rand_term);
+    const __m256 all_lanes = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+
+    __m256 sum = _mm256_setzero_ps();
+
+    unsigned int i = 0;
+    for(; i + 8 <= num_beams; i += 8)
+    {
+        __m256 obs_range = _mm256_loadu_ps(sensor_ranges + i);
+        __m256 map_range = _mm256_loadu_ps(model_ranges + i);
+        __m256 z = _mm256_sub_ps(obs_range, map_range);
+
+        // Part 1: good, but noisy, hit
+        __m256 abs_z = _mm256_min_ps(_mm256_andnot_ps(sign_mask, z), range_max);
+        __m256i i_hit = _mm256_cvttps_epi32(_mm256_mul_ps(abs_z, resolution));
+        __m256 pz = _mm256_mul_ps(z_hit, _mm256_mask_i32gather_ps(zero, params.exp_hit, i_hit, all_lanes, 4));
+
+        // Part 2: short reading from unexpected obstacle (only if z < 0)
+        __m256 obs_clamped = _mm256_min_ps(obs_range, range_max);
+        __m256i i_short = _mm256_cvttps_epi32(_mm256_mul_ps(obs_clamped, resolution));
+        __m256 p_short = _mm256_mul_ps(z_short_lambda, _mm256_mask_i32gather_ps(zero, params.exp_short, i_short, all_lanes, 4));
+        pz = _mm256_add_ps(pz, _mm256_and_ps(_mm256_cmp_ps(z, zero, _CMP_LT_OQ), p_short));
+
+        // Part 3 and 4: max-range or random measurement
+        __m256 is_max = _mm256_cmp_ps(obs_range, range_max, _CMP_GE_OQ);
+        pz = _mm256_add_ps(pz, _mm256_blendv_ps(z_rand_term, z_max, is_max));
+
+        sum = _mm256_fmadd_ps(_mm256_mul_ps(pz, pz), pz, sum);
+    }
+
+    // Remaining beams
+    return horizontalSum(sum) + calculateBeamLikelihoodScalar(sensor_ranges + i, model_ranges + i, num_beams - i, params);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// AVX2, 16-bit fixed point: 8 beams at a time. The ranges are in millimeters, so the table indices are
+// the (clamped) ranges themselves. The 16-bit table entries are gathered as 32-bit values (hence the
+// padding entry at the end of the tables), of which the upper half is masked out.
+__attribute__((target("avx2,fma")))
+double calculateBeamLikelihoodAVX2(const uint16_t* sensor_ranges, const uint16_t* model_ranges, unsigned int num_beams,
+                                   const BeamKernelParams<uint16_t>& params)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i low_16_bits = _mm256_set1_epi32(0xFFFF);
+    const __m256i all_lanes = _mm256_set1_epi32(-1);
+    const __m256i range_max = _mm256_set1_epi32(params.range_max);
+    const __m256i range_max_minus_one = _mm256_set1_epi32(params.range_max - 1);
+    const __m256 z_hit = _mm256_set1_ps(params.z_hit * BeamPrecision<uint16_t>::tableScale());
+    const __m256 z_short_lambda = _mm256_set1_ps(params.z_short_lambda * BeamPrecision<uint16_t>::tableScale());
+    const __m256 z_max = _mm256_set1_ps(params.z_max);
+    const __m256 z_rand_term = _mm256_set1_ps(params.z_rand_term);
+
+    const int* exp_hit = reinterpret_cast<const int*>(params.exp_hit);
+    const int* exp_short = reinterpret_cast<const int*>(params.exp_short);
+
+    __m256 sum = _mm256_setzero_ps();
+
+    unsigned int i = 0;
+    for(; i + 8 <= num_beams; i += 8)
+    {
+        __m256i obs_range = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(sensor_ranges + i)));
+        __m256i map_range = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(model_ranges + i)));
+        __m256i z = _mm256_sub_epi32(obs_range, map_range);
+
+        // Part 1: good, but noisy, hit
+        __m256i i_hit = _mm256_min_epi32(_mm256_abs_epi32(z), range_max);
+        __m256i t_hit = _mm256_and_si256(_mm256_mask_i32gather_epi32(zero, exp_hit, i_hit, all_lanes, 2), low_16_bits);
+        __m256 pz = _mm256_mul_ps(z_hit, _mm256_cvtepi32_ps(t_hit));
+
+        // Part 2: short reading from unexpected obstacle (only if z < 0)
+        __m256i i_short = _mm256_min_epi32(obs_range, range_max);
+        __m256i t_short = _mm256_and_si256(_mm256_mask_i32gather_epi32(zero, exp_short, i_short, all_lanes, 2), low_16_bits);
+        __m256 p_short = _mm256_mul_ps(z_short_lambda, _mm256_cvtepi32_ps(t_short));
+        pz = _mm256_add_ps(pz, _mm256_and_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(zero, z)), p_short));
+
+        // Part 3 and 4: max-range or random measurement
+        __m256 is_max = _mm256_castsi256_ps(_mm256_cmpgt_epi32(obs_range, range_max_minus_one));
+        pz = _mm256_add_ps(pz, _mm256_blendv_ps(z_rand_term, z_max, is_max));
+
+        sum = _mm256_fmadd_ps(_mm256_mul_ps(pz, pz), pz, sum);
+    }
+
+    // Remaining beams
+    return horizontalSum(sum) + calculateBeamLikelihoodScalar(sensor_ranges + i, model_ranges + i, num_beams - i, params);
+}
+
+#endif
+
+#if defined(ED_LOCALIZATION_X86) && defined(__SSE2__)
+
+// ----------------------------------------------------------------------------------------------------
+
+// SSE2 has no gathers: the table entries are loaded one by one, everything else is done in SIMD registers.
+// Stores the table indices of a vector of 4 32-bit integers.
+inline void storeIndices(__m128i indices, int* out)
+{
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), indices);
+}
+
+// Horizontal sum of 4 floats, in double precision
+inline double horizontalSum(__m128 v)
+{
+    __m128d sum = _mm_add_pd(_mm_cvtps_pd(v), _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+    sum = _mm_add_sd(sum, _mm_unpackhi_pd(sum, sum));
+    return _mm_cvtsd_f64(sum);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// SSE2, double: 2 beams at a time
+double calculateBeamLikelihoodSSE2(const double* sensor_ranges, const double* model_ranges, unsigned int num_beams,
+                                   const BeamKernelParams<double>& params)
+{
+    const __m128d sign_mask = _mm_set1_pd(-0.0);
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d range_max = _mm_set1_pd(params.range_max);
+    const __m128d resolution = _mm_set1_pd(BeamPrecision<double>::resolution());
+    const __m128d z_hit = _mm_set1_pd(params.z_hit);
+    const __m128d z_short_lambda = _mm_set1_pd(params.z_short_lambda);
+    const __m128d z_max = _mm_set1_pd(params.z_max);
+    const __m128d z_rand_term = _mm_set1_pd(params.z_rand_term);
+
+    __m128d sum = _mm_setzero_pd();
+    int i_hit[4], i_short[4];
+
+    unsigned int i = 0;
+    for(; i + 2 <= num_beams; i += 2)
+    {
+        __m128d obs_range = _mm_loadu_pd(sensor_ranges + i);
+        __m128d map_range = _mm_loadu_pd(model_ranges + i);
+        __m128d z = _mm_sub_pd(obs_range, map_range);
+
+        // Part 1: good, but noisy, hit
+        __m128d abs_z = _mm_min_pd(_mm_andnot_pd(sign_mask, z), range_max);
+        storeIndices(_mm_cvttpd_epi32(_mm_mul_pd(abs_z, resolution)), i_hit);
+        __m128d pz = _mm_mul_pd(z_hit, _mm_setr_pd(params.exp_hit[i_hit[0]], params.exp_hit[i_hit[1]]));
+
+        // Part 2: short reading from unexpected obstacle (only if z < 0)
+        __m128d obs_clamped = _mm_min_pd(obs_range, range_max);
+        storeIndices(_mm_cvttpd_epi32(_mm_mul_pd(obs_clamped, resolution)), i_short);
+        __m128d p_short = _mm_mul_pd(z_short_lambda, _mm_setr_pd(params.exp_short[i_short[0]], params.exp_short[i_short[1]]));
+        pz = _mm_add_pd(pz, _mm_and_pd(_mm_cmplt_pd(z, zero), p_short));
+
+        // Part 3 and 4: max-range or random measurement
+        __m128d is_max = _mm_cmpge_pd(obs_range, range_max);
+        pz = _mm_add_pd(pz, _mm_or_pd(_mm_and_pd(is_max, z_max), _mm_andnot_pd(is_max, z_rand_term)));
+
+        sum = _mm_add_pd(sum, _mm_mul_pd(_mm_mul_pd(pz, pz), pz));
+    }
+
+    sum = _mm_add_sd(sum, _mm_unpackhi_pd(sum, sum));
+
+    // Remaining beams
+    return _mm_cvtsd_f64(sum) + calculateBeamLikelihoodScalar(sensor_ranges + i, model_ranges + i, num_beams - i, params);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// SSE2, float: 4 beams at a time
+double calculateBeamLikelihoodSSE2(const float* sensor_ranges, const float* model_ranges, unsigned int num_beams,
+                                   const BeamKernelParams<float>& params)
+{
+    const __m128 sign_mask = _mm_set1_ps(-0.0f);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 range_max = _mm_set1_ps(params.range_max);
+    const __m128 resolution = _mm_set1_ps(BeamPrecision<float>::resolution());
+    const __m128 z_hit = _mm_set1_ps(params.z_hit);
+    const __m128 z_short_lambda = _mm_set1_ps(params.z_short_lambda);
+    const __m128 z_max = _mm_set1_ps(params.z_max);
+    const __m128 z_rand_term = _mm_set1_ps(params.z_rand_term);
+
+    const float* exp_hit = params.exp_hit;
+    const float* exp_short = params.exp_short;
+
+    __m128 sum = _mm_setzero_ps();
+    int i_hit[4], i_short[4];
+
+    unsigned int i = 0;
+    for(; i + 4 <= num_beams; i += 4)
+    {
+        __m128 obs_range = _mm_loadu_ps(sensor_ranges + i);
+        __m128 map_range = _mm_loadu_ps(model_ranges + i);
+        __m128 z = _mm_sub_ps(obs_range, map_range);
+
+        // Part 1: good, but noisy, hit
+        __m128 abs_z = _mm_min_ps(_mm_andnot_ps(sign_mask, z), range_max);
+        storeIndices(_mm_cvttps_epi32(_mm_mul_ps(abs_z, resolution)), i_hit);
+        __m128 pz = _mm_mul_ps(z_hit, _mm_setr_ps(exp_hit[i_hit[0]], exp_hit[i_hit[1]], exp_hit[i_hit[2]], exp_hit[i_hit[3]]));
+
+        // Part 2: short reading from unexpected obstacle (only if z < 0)
+        __m128 obs_clamped = _mm_min_ps(obs_range, range_max);
+        storeIndices(_mm_cvttps_epi32(_mm_mul_ps(obs_clamped, resolution)), i_short);
+        __m128 p_short = _mm_mul_ps(z_short_lambda, _mm_setr_ps(exp_short[i_short[0]], exp_short[i_short[1]],
+                                                                exp_short[i_short[2]], exp_short[i_short[3]]));
+        pz = _mm_add_ps(pz, _mm_and_ps(_mm_cmplt_ps(z, zero), p_short));
+
+        // Part 3 and 4: max-range or random measurement
+        __m128 is_max = _mm_cmpge_ps(obs_range, range_max);
+        pz = _mm_add_ps(pz, _mm_or_ps(_mm_and_ps(is_max, z_max), _mm_andnot_ps(is_max, z_rand_term)));
+
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_mul_ps(pz, pz), pz));
+    }
+
+    // Remaining beams
+    return horizontalSum(sum) + calculateBeamLikelihoodScalar(sensor_ranges + i, model_ranges + i, num_beams - i, params);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// SSE2, 16-bit fixed point: 4 beams at a time (SSE2 has no 32-bit abs and min, so these use compares)
+double calculateBeamLikelihoodSSE2(const uint16_t* sensor_ranges, const uint16_t* model_ranges, unsigned int num_beams,
+                                   const BeamKernelParams<uint16_t>& params)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i range_max = _mm_set1_epi32(params.range_max);
+    const __m128i range_max_minus_one = _mm_set1_epi32(params.range_max - 1);
+    const __m128 z_hit = _mm_set1_ps(params.z_hit * BeamPrecision<uint16_t>::tableScale());
+    const __m128 z_short_lambda = _mm_set1_ps(params.z_short_lambda * BeamPrecision<uint16_t>::tableScale());
+    const __m128 z_max = _mm_set1_ps(params.z_max);
+    const __m128 z_rand_term = _mm_set1_ps(params.z_rand_term);
+
+    const uint16_t* exp_hit = params.exp_hit;
+    const uint16_t* exp_short = params.exp_short;
+
+    __m128 sum = _mm_setzero_ps();
+    int i_hit[4], i_short[4];
+
+    unsigned int i = 0;
+    for(; i + 4 <= num_beams; i += 4)
+    {
+        __m128i obs_range = _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(sensor_ranges + i)), zero);
+        __m128i map_range = _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(model_ranges + i)), zero);
+        __m128i z = _mm_sub_epi32(obs_range, map_range);
+
+        // Part 1: good, but noisy, hit
+        __m128i z_sign = _mm_srai_epi32(z, 31);
+        __m128i abs_z = _mm_sub_epi32(_mm_xor_si128(z, z_sign), z_sign);
+        __m128i above_max = _mm_cmpgt_epi32(abs_z, range_max);
+        storeIndices(_mm_or_si128(_mm_and_si128(above_max, range_max), _mm_andnot_si128(above_max, abs_z)), i_hit);
+        __m128 pz = _mm_mul_ps(z_hit, _mm_setr_ps(exp_hit[i_hit[0]], exp_hit[i_hit[1]], exp_hit[i_hit[2]], exp_hit[i_hit[3]]));
+
+        // Part 2: short reading from unexpected obstacle (only if z < 0)
+        __m128i is_max_i = _mm_cmpgt_epi32(obs_range, range_max_minus_one);
+        storeIndices(_mm_or_si128(_mm_and_si128(is_max_i, range_max), _mm_andnot_si128(is_max_i, obs_range)), i_short);
+        __m128 p_short = _mm_mul_ps(z_short_lambda, _mm_setr_ps(exp_short[i_short[0]], exp_short[i_short[1]],
+                                                                exp_short[i_short[2]], exp_short[i_short[3]]));
+        pz = _mm_add_ps(pz, _mm_and_ps(_mm_castsi128_ps(_mm_cmplt_epi32(z, zero)), p_short));
+
+        // Part 3 and 4: max-range or random measurement
+        __m128 is_max = _mm_castsi128_ps(is_max_i);
+        pz = _mm_add_ps(pz, _mm_or_ps(_mm_and_ps(is_max, z_max), _mm_andnot_ps(is_max, z_rand_term)));
+
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_mul_ps(pz, pz), pz));
+    }
+
+    // Remaining beams
+    return horizontalSum(sum) + calculateBeamLikelihoodScalar(sensor_ranges + i, model_ranges + i, num_beams - i, params);
+}
+
+#endif
+
+#ifdef ED_LOCALIZATION_NEON
+
+// ----------------------------------------------------------------------------------------------------
+
+// NEON has no gathers either: the table entries are loaded one by one, like in the SSE2 versions
+
+// Horizontal sum of 4 floats, in double precision
+inline double horizontalSum(float32x4_t v)
+{
+    float lanes[4];
+    vst1q_f32(lanes, v);
+    return ((double)lanes[0] + lanes[1]) + ((double)lanes[2] + lanes[3]);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+#ifdef __aarch64__
+
+// NEON, double: 2 beams at a time (double precision vectors are only available on AArch64)
+double calculateBeamLikelihoodNEON(const double* sensor_ranges, const double* model_ranges, unsigned int num_beams,
+                                   const BeamKernelParams<double>& params)
+{
+    const float64x2_t zero = vdupq_n_f64(0);
+    const float64x2_t range_max = vdupq_n_f64(params.range_max);
+    const float64x2_t resolution = vdupq_n_f64(BeamPrecision<double>::resolution());
+    const float64x2_t z_hit = vdupq_n_f64(params.z_hit);
+    const float64x2_t z_short_lambda = vdupq_n_f64(params.z_short_lambda);
+    const float64x2_t z_max = vdupq_n_f64(params.z_max);
+    const float64x2_t z_rand_term = vdupq_n_f64(params.z_rand_term);
+
+    float64x2_t sum = vdupq_n_f64(0);
+    int64_t i_hit[2], i_short[2];
+    double t[2];
+
+    unsigned int i = 0;
+    for(; i + 2 <= num_beams; i += 2)
+    {
+        float64x2_t obs_range = vld1q_f64(sensor_ranges + i);
+        float64x2_t map_range = vld1q_f64(model_ranges + i);
+        float64x2_t z = vsubq_f64(obs_range, map_range);
+
+        // Part 1: good, but noisy, hit
+        float64x2_t abs_z = vminq_f64(vabsq_f64(z), range_max);
+        vst1q_s64(i_hit, vcvtq_s64_f64(vmulq_f64(abs_z, resolution)));
+        t[0] = params.exp_hit[i_hit[0]];
+        t[1] = params.exp_hit[i_hit[1]];
+        float64x2_t pz = vmulq_f64(z_hit, vld1q_f64(t));
+
+        // Part 2: short reading from unexpected obstacle (only if z < 0)
+        float64x2_t obs_clamped = vminq_f64(obs_range, range_max);
+        vst1q_s64(i_short, vcvtq_s64_f64(vmulq_f64(obs_clamped, resolution)));
+        t[0] = params.exp_short[i_short[0]];
+        t[1] = params.exp_short[i_short[1]];
+        float64x2_t p_short = vmulq_f64(z_short_lambda, vld1q_f64(t));
+        pz = vaddq_f64(pz, vreinterpretq_f64_u64(vandq_u64(vcltq_f64(z, zero), vreinterpretq_u64_f64(p_short))));
+
+        // Part 3 and 4: max-range or random measurement
+        pz = vaddq_f64(pz, vbslq_f64(vcgeq_f64(obs_range, range_max), z_max, z_rand_term));
+
+        sum = vaddq_f64(sum, vmulq_f64(vmulq_f64(pz, pz), pz));
+    }
+
+    // Remaining beams
+    return vgetq_lane_f64(sum, 0) + vgetq_lane_f64(sum, 1)
+            + calculateBeamLikelihoodScalar(sensor_ranges + i, model_ranges + i, num_beams - i, params);
+}
+
+#else
+
+double calculateBeamLikelihoodNEON(const double* sensor_ranges, const double* model_ranges, unsigned int num_beams,
+                                   const BeamKernelParams<double>& params)
+{
+    return calculateBeamLikelihoodScalar(sensor_ranges, model_ranges, num_beams, params);
+}
+
+#endif
+
+// ----------------------------------------------------------------------------------------------------
+
+// NEON, float: 4 beams at a time
+double calculateBeamLikelihoodNEON(const float* sensor_ranges, const float* model_ranges, unsigned int num_beams,
+                                   const BeamKernelParams<float>& params)
+{
+    const float32x4_t zero = vdupq_n_f32(0);
+    const float32x4_t range_max = vdupq_n_f32(params.range_max);
+    const float32x4_t resolution = vdupq_n_f32(BeamPrecision<float>::resolution());
+    const float32x4_t z_hit = vdupq_n_f32(params.z_hit);
+    const float32x4_t z_short_lambda = vdupq_n_f32(params.z_short_lambda);
+    const float32x4_t z_max = vdupq_n_f32(params.z_max);
+    const float32x4_t z_rand_term = vdupq_n_f32(params.z_rand_term);
+
+    const float* exp_hit = params.exp_hit;
+    const float* exp_short = params.exp_short;
+
+    float32x4_t sum = vdupq_n_f32(0);
+    int32_t i_hit[4], i_short[4];
+    float t[4];
+
+    unsigned int i = 0;
+    for(; i + 4 <= num_beams; i += 4)
+    {
+        float32x4_t obs_range = vld1q_f32(sensor_ranges + i);
+        float32x4_t map_range = vld1q_f32(model_ranges + i);
+        float32x4_t z = vsubq_f32(obs_range, map_range);
+
+        // Part 1: good, but noisy, hit
+        float32x4_t abs_z = vminq_f32(vabsq_f32(z), range_max);
+        vst1q_s32(i_hit, vcvtq_s32_f32(vmulq_f32(abs_z, resolution)));
+        for(unsigned int k = 0; k < 4; ++k)
+            t[k] = exp_hit[i_hit[k]];
+        float32x4_t pz = vmulq_f32(z_hit, vld1q_f32(t));
+
+        // Part 2: short reading from unexpected obstacle (only if z < 0)
+        float32x4_t obs_clamped = vminq_f32(obs_range, range_max);
+        vst1q_s32(i_short, vcvtq_s32_f32(vmulq_f32(obs_clamped, resolution)));
+        for(unsigned int k = 0; k < 4; ++k)
+            t[k] = exp_short[i_short[k]];
+        float32x4_t p_short = vmulq_f32(z_short_lambda, vld1q_f32(t));
+        pz = vaddq_f32(pz, vreinterpretq_f32_u32(vandq_u32(vcltq_f32(z, zero), vreinterpretq_u32_f32(p_short))));
+
+        // Part 3 and 4: max-range or random measurement
+        pz = vaddq_f32(pz, vbslq_f32(vcgeq_f32(obs_range, range_max), z_max, z_rand_term));
+
+        sum = vaddq_f32(sum, vmulq_f32(vmulq_f32(pz, pz), pz));
+    }
+
+    // Remaining beams
+    return horizontalSum(sum) + calculateBeamLikelihoodScalar(sensor_ranges + i, model_ranges + i, num_beams - i, params);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// NEON, 16-bit fixed point: 4 beams at a time
+double calculateBeamLikelihoodNEON(const uint16_t* sensor_ranges, const uint16_t* model_ranges, unsigned int num_beams,
+                                   const BeamKernelParams<uint16_t>& params)
+{
+    const int32x4_t zero = vdupq_n_s32(0);
+    const int32x4_t range_max = vdupq_n_s32(params.range_max);
+    const float32x4_t z_hit = vdupq_n_f32(params.z_hit * BeamPrecision<uint16_t>::tableScale());
+    const float32x4_t z_short_lambda = vdupq_n_f32(params.z_short_lambda * BeamPrecision<uint16_t>::tableScale());
+    const float32x4_t z_max = vdupq_n_f32(params.z_max);
+    const float32x4_t z_rand_term = vdupq_n_f32(params.z_rand_term);
+
+    const uint16_t* exp_hit = params.exp_hit;
+    const uint16_t* exp_short = params.exp_short;
+
+    float32x4_t sum = vdupq_n_f32(0);
+    int32_t i_hit[4], i_short[4];
+    float t[4];
+
+    unsigned int i = 0;
+    for(; i + 4 <= num_beams; i += 4)
+    {
+        int32x4_t obs_range = vreinterpretq_s32_u32(vmovl_u16(vld1_u16(sensor_ranges + i)));
+        int32x4_t map_range = vreinterpretq_s32_u32(vmovl_u16(vld1_u16(model_ranges + i)));
+        int32x4_t z = vsubq_s32(obs_range, map_range);
+
+        // Part 1: good, but noisy, hit
+        vst1q_s32(i_hit, vminq_s32(vabsq_s32(z), range_max));
+        for(unsigned int k = 0; k < 4; ++k)
+            t[k] = exp_hit[i_hit[k]];
+        float32x4_t pz = vmulq_f32(z_hit, vld1q_f32(t));
+
+        // Part 2: short reading from unexpected obstacle (only if z < 0)
+        vst1q_s32(i_short, vminq_s32(obs_range, range_max));
+        for(unsigned int k = 0; k < 4; ++k)
+            t[k] = exp_short[i_short[k]];
+        float32x4_t p_short = vmulq_f32(z_short_lambda, vld1q_f32(t));
+        pz = vaddq_f32(pz, vreinterpretq_f32_u32(vandq_u32(vcltq_s32(z, zero), vreinterpretq_u32_f32(p_short))));
+
+        // Part 3 and 4: max-range or random measurement
+        pz = vaddq_f32(pz, vbslq_f32(vcgeq_s32(obs_range, range_max), z_max, z_rand_term));
+
+        sum = vaddq_f32(sum, vmulq_f32(vmulq_f32(pz, pz), pz));
+    }
+
+    // Remaining beams
+    return horizontalSum(sum) + calculateBeamLikelihoodScalar(sensor_ranges + i, model_ranges + i, num_beams - i, params);
+}
+
+#endif
+
+// ----------------------------------------------------------------------------------------------------
+
+bool beamInstructionSetAvailable(BeamInstructionSet set)
+{
+    switch (set)
+    {
+    case BEAM_SCALAR:
+        return true;
+    case BEAM_SSE2:
+#if defined(ED_LOCALIZATION_X86) && defined(__SSE2__)
+        return true;
+#else
+        return false;
+#endif
+    case BEAM_NEON:
+#ifdef ED_LOCALIZATION_NEON
+        return true;
+#else
+        return false;
+#endif
+    case BEAM_AVX2:
+#ifdef ED_LOCALIZATION_X86
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#else
+        return false;
+#endif
+    }
+
+    return false;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+BeamInstructionSet bestBeamInstructionSet()
+{
+    if (beamInstructionSetAvailable(BEAM_AVX2))
+        return BEAM_AVX2;
+    if (beamInstructionSetAvailable(BEAM_SSE2))
+        return BEAM_SSE2;
+    if (beamInstructionSetAvailable(BEAM_NEON))
+        return BEAM_NEON;
+    return BEAM_SCALAR;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+const char* beamInstructionSetName(BeamInstructionSet set)
+{
+    switch (set)
+    {
+    case BEAM_SCALAR: return "scalar";
+    case BEAM_SSE2: return "sse2";
+    case BEAM_NEON: return "neon";
+    case BEAM_AVX2: return "avx2";
+    }
+
+    return "unknown";
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+template<typename T>
+struct BeamLikelihoodFunction
+{
+    typedef double (*type)(const T*, const T*, unsigned int, const BeamKernelParams<T>&);
+};
+
+template<typename T>
+typename BeamLikelihoodFunction<T>::type beamLikelihoodFunction(BeamInstructionSet set)
+{
+    if (!beamInstructionSetAvailable(set))
+        return &calculateBeamLikelihoodScalar<T>;
+
+#ifdef ED_LOCALIZATION_X86
+    if (set == BEAM_AVX2)
+        return &calculateBeamLikelihoodAVX2;
+#endif
+
+#if defined(ED_LOCALIZATION_X86) && defined(__SSE2__)
+    if (set == BEAM_SSE2)
+        return &calculateBeamLikelihoodSSE2;
+#endif
+
+#ifdef ED_LOCALIZATION_NEON
+    if (set == BEAM_NEON)
+        return &calculateBeamLikelihoodNEON;
+#endif
+
+    return &calculateBeamLikelihoodScalar<T>;
+}
+
+const BeamLikelihoodFunction<double>::type beam_likelihood_function_double = beamLikelihoodFunction<double>(bestBeamInstructionSet());
+const BeamLikelihoodFunction<float>::type beam_likelihood_function_float = beamLikelihoodFunction<float>(bestBeamInstructionSet());
+const BeamLikelihoodFunction<uint16_t>::type beam_likelihood_function_fixed16 = beamLikelihoodFunction<uint16_t>(bestBeamInstructionSet());
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+double calculateBeamLikelihood(const double* sensor_ranges, const double* model_ranges, unsigned int num_beams,
+                               const BeamKernelParams<double>& params)
+{
+    return beam_likelihood_function_double(sensor_ranges, model_ranges, num_beams, params);
+}
+
+double calculateBeamLikelihood(const float* sensor_ranges, const float* model_ranges, unsigned int num_beams,
+                               const BeamKernelParams<float>& params)
+{
+    return beam_likelihood_function_float(sensor_ranges, model_ranges, num_beams, params);
+}
+
+double calculateBeamLikelihood(const uint16_t* sensor_ranges, const uint16_t* model_ranges, unsigned int num_beams,
+                               const BeamKernelParams<uint16_t>& params)
+{
+    return beam_likelihood_function_fixed16(sensor_ranges, model_ranges, num_beams, params);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+double calculateBeamLikelihood(const double* sensor_ranges, const double* model_ranges, unsigned int num_beams,
+                               const BeamKernelParams<double>& params, BeamInstructionSet set)
+{
+    return beamLikelihoodFunction<double>(set)(sensor_ranges, model_ranges, num_beams, params);
+}
+
+double calculateBeamLikelihood(const float* sensor_ranges, const float* model_ranges, unsigned int num_beams,
+                               const BeamKernelParams<float>& params, BeamInstructionSet set)
+{
+    return beamLikelihoodFunction<float>(set)(sensor_ranges, model_ranges, num_beams, params);
+}
+
+double calculateBeamLikelihood(const uint16_t* sensor_ranges, const uint16_t* model_ranges, unsigned int num_beams,
+                               const BeamKernelParams<uint16_t>& params, BeamInstructionSet set)
+{
+    return beamLikelihoodFunction<uint16_t>(set)(sensor_ranges, model_ranges, num_beams, params);
+}
@@ -0,0 +1,120 @@
+#ifndef ED_LOCALIZATION_BEAM_KERNEL_H_
+#define ED_LOCALIZATION_BEAM_KERNEL_H_
+
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Storage precision of the hot data of the beam model: the sensor and model ranges and the lookup
+// tables. 'Compute' is the type used for the range arithmetic. The lookup tables always have one
+// entry per millimeter (plus one padding entry, needed by the 16-bit gathers).
+template<typename T>
+struct BeamPrecision;
+
+template<>
+struct BeamPrecision<double>
+{
+    typedef double Table;
+    typedef double Compute;
+
+    static double fromMeters(double r) { return r; }
+    static Table toTable(double p) { return p; }
+    static double tableScale() { return 1; }
+    static Compute resolution() { return 1000; }  // Table entries per range unit
+};
+
+template<>
+struct BeamPrecision<float>
+{
+    typedef float Table;
+    typedef float Compute;
+
+    static float fromMeters(double r) { return r; }
+    static Table toTable(double p) { return p; }
+    static double tableScale() { return 1; }
+    static Compute resolution() { return 1000; }
+};
+
+// 16-bit fixed point: ranges in millimeters (at most 65.535 m), table entries scaled to [0, 65535]
+template<>
+struct BeamPrecision<uint16_t>
+{
+    typedef uint16_t Table;
+    typedef int Compute;
+
+    // Positive ranges are never rounded to 0, since 0 means 'no range'
+    static uint16_t fromMeters(double r) { return r <= 0 ? 0 : std::max<long>(1, std::min<long>(65535, std::lround(r * 1000))); }
+    static Table toTable(double p) { return std::lround(std::max(0.0, std::min(1.0, p)) * 65535); }
+    static double tableScale() { return 1.0 / 65535; }
+    static Compute resolution() { return 1; }
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Parameters of the beam model mixture, with the lookup tables of the expensive exponentials
+template<typename T>
+struct BeamKernelParams
+{
+    typedef typename BeamPrecision<T>::Table Table;
+
+    double z_hit;
+    double z_short_lambda;  // z_short * lambda_short
+    double z_max;
+    double z_rand_term;     // z_rand / range_max
+    T range_max;            // In range units (see BeamPrecision)
+
+    const Table* exp_hit;    // exp(-z^2 / (2 * sigma_hit^2)), indexed by |z| in millimeters
+    const Table* exp_short;  // exp(-lambda_short * z), indexed by z in millimeters
+};
+
+// SIMD instruction sets of the beam model kernel
+enum BeamInstructionSet
+{
+    BEAM_SCALAR,  // Portable version
+    BEAM_SSE2,    // x86
+    BEAM_NEON,    // ARM (double precision only on AArch64, the portable version is used otherwise)
+    BEAM_AVX2     // x86, if the CPU supports AVX2 and FMA
+};
+
+// True if the instruction set is built in and supported by the CPU
+bool beamInstructionSetAvailable(BeamInstructionSet set);
+
+// Fastest available instruction set, used by calculateBeamLikelihood
+BeamInstructionSet bestBeamInstructionSet();
+
+const char* beamInstructionSetName(BeamInstructionSet set);
+
+// Scores the sensor ranges against the model ranges using the beam model. Returns 1 + sum(pz^3), with pz
+// the mixture probability of every beam. Uses the fastest instruction set the CPU supports: AVX2 (with
+// gathers for the table lookups), SSE2 or NEON (with scalar table lookups). Implemented for double, float
+// and 16-bit fixed point.
+//
+// The SIMD versions sum the beams in a different order (and AVX2 uses FMA), and the single precision
+// versions sum in float, so they are equal to the portable version up to rounding, not bit-identical.
+double calculateBeamLikelihood(const double* sensor_ranges, const double* model_ranges, unsigned int num_beams,
+                               const BeamKernelParams<double>& params);
+
+double calculateBeamLikelihood(const float* sensor_ranges, const float* model_ranges, unsigned int num_beams,
+                               const BeamKernelParams<float>& params);
+
+double calculateBeamLikelihood(const uint16_t* sensor_ranges, const uint16_t* model_ranges, unsigned int num_beams,
+                               const BeamKernelParams<uint16_t>& params);
+
+// Versions with the given instruction set, to compare them (the portable version is used if it is not available)
+double calculateBeamLikelihood(const double* sensor_ranges, const double* model_ranges, unsigned int num_beams,
+                               const BeamKernelParams<double>& params, BeamInstructionSet set);
+
+double calculateBeamLikelihood(const float* sensor_ranges, const float* model_ranges, unsigned int num_beams,
+                               const BeamKernelParams<float>& params, BeamInstructionSet set);
+
+double calculateBeamLikelihood(const uint16_t* sensor_ranges, const uint16_t* model_ranges, unsigned int num_beams,
+                               const BeamKernelParams<uint16_t>& params, BeamInstructionSet set);
+
+// Portable (non-SIMD) version, used for remaining beams and if no supported SIMD instruction set is available
+template<typename T>
+double calculateBeamLikelihoodScalar(const T* sensor_ranges, const T* model_ranges, unsigned int num_beams,
+                                     const BeamKernelParams<T>& params);
+
+#endif
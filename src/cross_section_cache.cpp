@@ -0,0 +1,307 @@
+#include "cross_section_cache.h"
+
+#include <ed/world_model.h>
+#include <ed/entity.h>
+#include <geolib/Shape.h>
+#include <geolib/Mesh.h>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+class LineRenderResult : public geo::LaserRangeFinder::RenderResult
+{
+
+public:
+
+    LineRenderResult(std::vector<geo::Vec2>& lines_start, std::vector<geo::Vec2>& lines_end)
+        : geo::LaserRangeFinder::RenderResult(dummy_ranges_), lines_start_(lines_start), lines_end_(lines_end) {}
+
+    void renderLine(const geo::Vec2& p1, const geo::Vec2& p2)
+    {
+        lines_start_.push_back(p1);
+        lines_end_.push_back(p2);
+    }
+
+private:
+
+    std::vector<double> dummy_ranges_;
+    std::vector<geo::Vec2>& lines_start_;
+    std::vector<geo::Vec2>& lines_end_;
+
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Squared distance of the origin to line segment p1-p2
+inline double distanceSq(const geo::Vec2& p1, const geo::Vec2& p2)
+{
+    geo::Vec2 diff = p2 - p1;
+    double line_length_sq = diff.length2();
+
+    double t = p1.dot(diff) / -line_length_sq;
+
+    if (t < 0)
+        return p1.length2();
+    else if (t > 1)
+        return p2.length2();
+    else
+        return (p1 + t * diff).length2();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+inline bool isLocalizable(const ed::Entity& e)
+{
+    // Do not render the robot itself (we're trying to localize it!)
+    return e.shape() && e.has_pose() && !e.hasFlag("self") && !e.hasFlag("non-localizable");
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Key of the cross section of an entity in the map artifacts: a hash of everything it depends on
+uint64_t entityKey(const ed::Entity& e, double height)
+{
+    ArtifactHash h;
+    h.add(e.id().str());
+    h.add(height);
+
+    const geo::Pose3D& p = e.pose();
+    const double pose[12] = { p.t.x, p.t.y, p.t.z, p.R.xx, p.R.xy, p.R.xz, p.R.yx, p.R.yy, p.R.yz, p.R.zx, p.R.zy, p.R.zz };
+    h.add(pose, sizeof(pose));
+
+    const geo::Mesh& mesh = e.shape()->getMesh();
+
+    const std::vector<geo::Vector3>& points = mesh.getPoints();
+    for(unsigned int i = 0; i < points.size(); ++i)
+    {
+        h.add(points[i].x);
+        h.add(points[i].y);
+        h.add(points[i].z);
+    }
+
+    const std::vector<geo::TriangleI>& triangles = mesh.getTriangleIs();
+    for(unsigned int i = 0; i < triangles.size(); ++i)
+    {
+        const int indices[3] = { triangles[i].i1_, triangles[i].i2_, triangles[i].i3_ };
+        h.add(indices, sizeof(indices));
+    }
+
+    return h.value();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+inline bool equal(const geo::Pose3D& p1, const geo::Pose3D& p2)
+{
+    return p1.t.x == p2.t.x && p1.t.y == p2.t.y && p1.t.z == p2.t.z
+            && p1.R.xx == p2.R.xx && p1.R.xy == p2.R.xy && p1.R.xz == p2.R.xz
+            && p1.R.yx == p2.R.yx && p1.R.yy == p2.R.yy && p1.R.yz == p2.R.yz
+            && p1.R.zx == p2.R.zx && p1.R.zy == p2.R.zy && p1.R.zz == p2.R.zz;
+}
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+CrossSectionCache::CrossSectionCache() : height_(0), revision_(0), update_count_(0), startup_revision_(0), artifacts_(0)
+{
+    // Render everything, the selection of lines is done afterwards
+    lrf_.setAngleLimits(-M_PI, M_PI);
+    lrf_.setNumBeams(100);
+    lrf_.setRangeLimits(0, 1e9);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+CrossSectionCache::~CrossSectionCache()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool CrossSectionCache::update(const ed::WorldModel& world, double height)
+{
+    bool changed = false;
+
+    // A different height gives a different cross section for every entity
+    if (height != height_)
+    {
+        entities_.clear();
+        height_ = height;
+        changed = true;
+    }
+
+    ++update_count_;
+
+    for(ed::WorldModel::const_iterator it = world.begin(); it != world.end(); ++it)
+    {
+        const ed::EntityConstPtr& e = *it;
+        if (!isLocalizable(*e))
+            continue;
+
+        // Look up first: inserting would copy the id and allocate a node, even if the entity is known
+        std::unordered_map<std::string, EntityLines>::iterator it_lines = entities_.find(e->id().str());
+        bool is_new = it_lines == entities_.end();
+        if (is_new)
+            it_lines = entities_.insert(std::make_pair(e->id().str(), EntityLines())).first;
+
+        EntityLines& entity_lines = it_lines->second;
+        entity_lines.update_count = update_count_;
+
+        if (is_new || entity_lines.shape_revision != e->shapeRevision() || !equal(entity_lines.pose, e->pose()))
+        {
+            render(*e, entity_lines);
+            changed = true;
+        }
+    }
+
+    // Remove all entities that have been removed from the world model (or are no longer localizable)
+    for(std::unordered_map<std::string, EntityLines>::iterator it = entities_.begin(); it != entities_.end();)
+    {
+        if (it->second.update_count != update_count_)
+        {
+            it = entities_.erase(it);
+            changed = true;
+        }
+        else
+            ++it;
+    }
+
+    if (changed)
+        ++revision_;
+
+    if (update_count_ == 1)
+        startup_revision_ = revision_;
+
+    return changed;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void CrossSectionCache::setLines(const std::string& id, const std::vector<geo::Vec2>& lines_start,
+                                 const std::vector<geo::Vec2>& lines_end, double height)
+{
+    if (height != height_)
+    {
+        entities_.clear();
+        height_ = height;
+    }
+
+    EntityLines& entity_lines = entities_[id];
+    entity_lines.shape_revision = 0;
+    entity_lines.lines_start = lines_start;
+    entity_lines.lines_end = lines_end;
+    entity_lines.update_count = update_count_;
+    calculateBoundingBox(entity_lines);
+
+    ++revision_;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void CrossSectionCache::selectLines(const geo::Vec2& center, double max_distance,
+                                    std::vector<geo::Vec2>& lines_start, std::vector<geo::Vec2>& lines_end) const
+{
+    lines_start.clear();
+    lines_end.clear();
+
+    double max_distance_sq = max_distance * max_distance;
+
+    for(std::unordered_map<std::string, EntityLines>::const_iterator it = entities_.begin(); it != entities_.end(); ++it)
+    {
+        const EntityLines& entity_lines = it->second;
+        if (entity_lines.lines_start.empty())
+            continue;
+
+        // First check the distance to the bounding box of the entity (object selection)
+        double dx = std::max(0.0, std::max(entity_lines.min.x - center.x, center.x - entity_lines.max.x));
+        double dy = std::max(0.0, std::max(entity_lines.min.y - center.y, center.y - entity_lines.max.y));
+        if (dx * dx + dy * dy > max_distance_sq)
+            continue;
+
+        // Then select the lines within range (line selection)
+        for(unsigned int i = 0; i < entity_lines.lines_start.size(); ++i)
+        {
+            const geo::Vec2& p1 = entity_lines.lines_start[i];
+            const geo::Vec2& p2 = entity_lines.lines_end[i];
+
+            if (distanceSq(p1 - center, p2 - center) > max_distance_sq)
+                continue;
+
+            lines_start.push_back(p1);
+            lines_end.push_back(p2);
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void CrossSectionCache::getLines(std::vector<geo::Vec2>& lines_start, std::vector<geo::Vec2>& lines_end) const
+{
+    lines_start.clear();
+    lines_end.clear();
+
+    for(std::unordered_map<std::string, EntityLines>::const_iterator it = entities_.begin(); it != entities_.end(); ++it)
+    {
+        const EntityLines& entity_lines = it->second;
+        lines_start.insert(lines_start.end(), entity_lines.lines_start.begin(), entity_lines.lines_start.end());
+        lines_end.insert(lines_end.end(), entity_lines.lines_end.begin(), entity_lines.lines_end.end());
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void CrossSectionCache::render(const ed::Entity& e, EntityLines& entity_lines)
+{
+    entity_lines.shape_revision = e.shapeRevision();
+    entity_lines.pose = e.pose();
+
+    entity_lines.lines_start.clear();
+    entity_lines.lines_end.clear();
+
+    uint64_t key = 0;
+    if (artifacts_)
+    {
+        key = entityKey(e, height_);
+        if (artifacts_->findEntityLines(key, entity_lines.lines_start, entity_lines.lines_end))
+        {
+            calculateBoundingBox(entity_lines);
+            return;
+        }
+    }
+
+    // Render the entity as seen from the map origin, such that the lines are in the map frame
+    geo::Pose3D laser_pose(0, 0, height_);
+
+    LineRenderResult render_result(entity_lines.lines_start, entity_lines.lines_end);
+
+    geo::LaserRangeFinder::RenderOptions options;
+    geo::Transform t_inv = laser_pose.inverse() * e.pose();
+    options.setMesh(e.shape()->getMesh(), t_inv);
+    lrf_.render(options, render_result);
+
+    calculateBoundingBox(entity_lines);
+
+    // Only the startup world model is stored, such that changes during operation do not end up in the file
+    if (artifacts_ && update_count_ == 1)
+        artifacts_->addEntityLines(key, e.id().str(), entity_lines.lines_start, entity_lines.lines_end);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void CrossSectionCache::calculateBoundingBox(EntityLines& entity_lines)
+{
+    entity_lines.min = geo::Vec2(1e9, 1e9);
+    entity_lines.max = geo::Vec2(-1e9, -1e9);
+    for(unsigned int i = 0; i < entity_lines.lines_start.size(); ++i)
+    {
+        const geo::Vec2& p1 = entity_lines.lines_start[i];
+        const geo::Vec2& p2 = entity_lines.lines_end[i];
+        entity_lines.min.x = std::min(entity_lines.min.x, std::min(p1.x, p2.x));
+        entity_lines.min.y = std::min(entity_lines.min.y, std::min(p1.y, p2.y));
+        entity_lines.max.x = std::max(entity_lines.max.x, std::max(p1.x, p2.x));
+        entity_lines.max.y = std::max(entity_lines.max.y, std::max(p1.y, p2.y));
+    }
+}
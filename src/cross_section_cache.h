@@ -0,0 +1,93 @@
+#ifndef ED_LOCALIZATION_CROSS_SECTION_CACHE_H_
+#define ED_LOCALIZATION_CROSS_SECTION_CACHE_H_
+
+#include "map_artifacts.h"
+
+#include <ed/types.h>
+#include <geolib/datatypes.h>
+#include <geolib/sensors/LaserRangeFinder.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Caches the 2D cross section (line segments in the map frame) of every localizable entity in the
+// world model. Entities are only re-rendered if their shape revision or pose changed.
+class CrossSectionCache
+{
+
+public:
+
+    CrossSectionCache();
+
+    ~CrossSectionCache();
+
+    // Brings the cache up-to-date with the world model, using a cross section at the given height.
+    // Returns true if anything changed.
+    bool update(const ed::WorldModel& world, double height);
+
+    // Sets the lines of entity 'id' directly (in the map frame), without a world model. Used to set up
+    // synthetic worlds, e.g., for benchmarking. The next call to update() removes these lines again.
+    void setLines(const std::string& id, const std::vector<geo::Vec2>& lines_start, const std::vector<geo::Vec2>& lines_end,
+                  double height);
+
+    // Selects all cached lines of which the distance to 'center' is at most 'max_distance'
+    void selectLines(const geo::Vec2& center, double max_distance,
+                     std::vector<geo::Vec2>& lines_start, std::vector<geo::Vec2>& lines_end) const;
+
+    // Returns all cached lines
+    void getLines(std::vector<geo::Vec2>& lines_start, std::vector<geo::Vec2>& lines_end) const;
+
+    // Is increased every time the cross section changes
+    unsigned long revision() const { return revision_; }
+
+    // Height of the cross section
+    double height() const { return height_; }
+
+    // True if the cross section did not change since the first update (i.e., it is the static map)
+    bool isStartupRevision() const { return update_count_ > 0 && revision_ == startup_revision_; }
+
+    // If set, entities are looked up in the artifacts before they are rendered, and the entities that
+    // are rendered during the first update are added to them
+    void setArtifacts(MapArtifacts* artifacts) { artifacts_ = artifacts; }
+
+private:
+
+    struct EntityLines
+    {
+        unsigned long shape_revision;
+        geo::Pose3D pose;
+
+        std::vector<geo::Vec2> lines_start;
+        std::vector<geo::Vec2> lines_end;
+
+        // Bounding box around the lines
+        geo::Vec2 min, max;
+
+        // Value of 'update_count_' during the last update that this entity was seen
+        unsigned long update_count;
+    };
+
+    std::unordered_map<std::string, EntityLines> entities_;
+
+    double height_;
+
+    unsigned long revision_;
+
+    unsigned long update_count_;
+
+    unsigned long startup_revision_;
+
+    MapArtifacts* artifacts_;
+
+    geo::LaserRangeFinder lrf_;
+
+    void render(const ed::Entity& e, EntityLines& entity_lines);
+
+    static void calculateBoundingBox(EntityLines& entity_lines);
+
+};
+
+#endif
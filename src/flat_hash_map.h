@@ -0,0 +1,135 @@
+#ifndef ED_LOCALIZATION_FLAT_HASH_MAP_H_
+#define ED_LOCALIZATION_FLAT_HASH_MAP_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Hash map with open addressing (linear probing) in two flat arrays. Unlike std::unordered_map, it does
+// not allocate per entry, and clear() keeps the memory: once it has grown to its working size, a map that
+// is cleared and refilled every update does not allocate anymore. Entries can not be removed.
+template<typename Key, typename Value, typename Hash = std::hash<Key> >
+class FlatHashMap
+{
+
+public:
+
+    FlatHashMap() : size_(0), stamp_(1) {}
+
+    // Removes all entries. Slots are marked as occupied with the stamp of the current contents, so this
+    // does not touch the slots.
+    void clear()
+    {
+        size_ = 0;
+        if (++stamp_ == 0)
+        {
+            std::fill(stamps_.begin(), stamps_.end(), 0);
+            stamp_ = 1;
+        }
+    }
+
+    // Makes sure that n entries fit without growing
+    void reserve(std::size_t n)
+    {
+        if (2 * n > slots_.size())
+            rehash(n);
+    }
+
+    std::size_t size() const { return size_; }
+
+    bool empty() const { return size_ == 0; }
+
+    // Inserts the entry if the key is not in the map yet. Returns the value of the key, and whether it was inserted.
+    std::pair<Value*, bool> insert(const Key& key, const Value& value)
+    {
+        if (2 * (size_ + 1) > slots_.size())
+            rehash(2 * (size_ + 1));
+
+        std::size_t i = findSlot(key);
+        if (stamps_[i] == stamp_)
+            return std::make_pair(&slots_[i].second, false);
+
+        slots_[i].first = key;
+        slots_[i].second = value;
+        stamps_[i] = stamp_;
+        ++size_;
+
+        return std::make_pair(&slots_[i].second, true);
+    }
+
+    // Returns null if the key is not in the map
+    const Value* find(const Key& key) const
+    {
+        if (size_ == 0)
+            return 0;
+
+        std::size_t i = findSlot(key);
+        return stamps_[i] == stamp_ ? &slots_[i].second : 0;
+    }
+
+private:
+
+    std::vector<std::pair<Key, Value> > slots_;
+
+    // A slot is occupied if its stamp equals stamp_
+    std::vector<uint32_t> stamps_;
+
+    std::size_t size_;
+    uint32_t stamp_;
+
+    Hash hash_;
+
+    // The slot of the key, or the free slot where it would be inserted. The table is never more than half full.
+    std::size_t findSlot(const Key& key) const
+    {
+        std::size_t mask = slots_.size() - 1;
+
+        // Mix the bits, such that hashes that only differ in the high bits (or the identity hash of
+        // integers) still spread over the table
+        uint64_t h = hash_(key);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+
+        std::size_t i = h & mask;
+        while(stamps_[i] == stamp_ && !(slots_[i].first == key))
+            i = (i + 1) & mask;
+
+        return i;
+    }
+
+    // Grows the table (to a power of two) such that n entries fit, and reinserts the current entries
+    void rehash(std::size_t n)
+    {
+        std::size_t capacity = 16;
+        while(capacity < 2 * n)
+            capacity *= 2;
+
+        std::vector<std::pair<Key, Value> > old_slots(capacity);
+        std::vector<uint32_t> old_stamps(capacity, 0);
+        old_slots.swap(slots_);
+        old_stamps.swap(stamps_);
+
+        uint32_t old_stamp = stamp_;
+        stamp_ = 1;
+        size_ = 0;
+
+        for(std::size_t i = 0; i < old_slots.size(); ++i)
+        {
+            if (old_stamps[i] != old_stamp)
+                continue;
+
+            std::size_t j = findSlot(old_slots[i].first);
+            slots_[j] = old_slots[i];
+            stamps_[j] = stamp_;
+            ++size_;
+        }
+    }
+
+};
+
+#endif
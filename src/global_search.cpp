@@ -0,0 +1,262 @@
+#include "global_search.h"
+
+#include <algorithm>
+#include <cmath>
+
+// ----------------------------------------------------------------------------------------------------
+
+GlobalSearch::GlobalSearch() : resolution_(0.1), sigma_(0.2), num_levels_(6), num_candidates_(10), max_points_(60),
+    min_candidate_distance_(0.5), min_candidate_rotation_distance_(0.5), padding_(0), padded_width_(0), padded_height_(0),
+    rotation_step_(0)
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+GlobalSearch::~GlobalSearch()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void GlobalSearch::configure(tue::Configuration config)
+{
+    int num_levels = num_levels_;
+    int num_candidates = num_candidates_;
+    int max_points = max_points_;
+
+    config.value("resolution", resolution_, tue::config::OPTIONAL);
+    config.value("sigma", sigma_, tue::config::OPTIONAL);
+    config.value("num_levels", num_levels, tue::config::OPTIONAL);
+    config.value("num_candidates", num_candidates, tue::config::OPTIONAL);
+    config.value("num_beams", max_points, tue::config::OPTIONAL);
+    config.value("min_candidate_distance", min_candidate_distance_, tue::config::OPTIONAL);
+    config.value("min_candidate_rotation_distance", min_candidate_rotation_distance_, tue::config::OPTIONAL);
+
+    if (resolution_ <= 0 || sigma_ <= 0)
+        config.addError("resolution and sigma must be positive");
+
+    // Every level doubles the block size (and the padding of the levels)
+    num_levels_ = std::max(1, std::min(10, num_levels));
+    num_candidates_ = std::max(1, num_candidates);
+    max_points_ = std::max(1, max_points);
+
+    // The pyramid depends on the configuration, so it has to be rebuilt
+    levels_.clear();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void GlobalSearch::build(const std::vector<geo::Vec2>& lines_start, const std::vector<geo::Vec2>& lines_end,
+                         MapArtifacts* artifacts)
+{
+    levels_.clear();
+
+    // Likelihood of a point at distance d to the closest line: exp(-d^2 / (2 * sigma^2)) (in [0, 1])
+    if (artifacts)
+        artifacts->getLikelihoodField("global_search", lines_start, lines_end, resolution_, 3 * sigma_, 1, sigma_, 0, field_);
+    else
+        field_.build(lines_start, lines_end, resolution_, 3 * sigma_, 1, sigma_, 0);
+
+    if (field_.empty())
+        return;
+
+    padding_ = (1 << (num_levels_ - 1)) - 1;
+    padded_width_ = field_.width() + padding_;
+    padded_height_ = field_.height() + padding_;
+
+    float outside = field_.outsideValue();
+
+    levels_.resize(num_levels_);
+
+    std::vector<float>& level0 = levels_[0];
+    level0.assign(padded_width_ * padded_height_, outside);
+    for(int my = 0; my < field_.height(); ++my)
+        for(int mx = 0; mx < field_.width(); ++mx)
+            level0[(my + padding_) * padded_width_ + mx + padding_] = field_.cellValue(mx, my);
+
+    // Every level takes the maximum of four blocks of the previous level
+    for(unsigned int k = 1; k < num_levels_; ++k)
+    {
+        const std::vector<float>& prev = levels_[k - 1];
+        std::vector<float>& level = levels_[k];
+        level.resize(prev.size());
+
+        int s = 1 << (k - 1);
+        for(int py = 0; py < padded_height_; ++py)
+        {
+            for(int px = 0; px < padded_width_; ++px)
+            {
+                float v = prev[py * padded_width_ + px];
+                if (px + s < padded_width_)
+                    v = std::max(v, prev[py * padded_width_ + px + s]);
+                if (py + s < padded_height_)
+                {
+                    v = std::max(v, prev[(py + s) * padded_width_ + px]);
+                    if (px + s < padded_width_)
+                        v = std::max(v, prev[(py + s) * padded_width_ + px + s]);
+                }
+
+                level[py * padded_width_ + px] = v;
+            }
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+double GlobalSearch::score(const std::vector<int>& dx, const std::vector<int>& dy, int x, int y, int level) const
+{
+    const std::vector<float>& values = levels_[level];
+    float outside = field_.outsideValue();
+
+    double sum = 0;
+    for(unsigned int i = 0; i < dx.size(); ++i)
+    {
+        int px = x + dx[i] + padding_;
+        int py = y + dy[i] + padding_;
+
+        if (px < 0 || py < 0 || px >= padded_width_ || py >= padded_height_)
+            sum += outside;
+        else
+            sum += values[py * padded_width_ + px];
+    }
+
+    return sum / dx.size();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void GlobalSearch::addCandidate(const Candidate& c, std::vector<Candidate>& candidates) const
+{
+    double min_dist_sq = min_candidate_distance_ * min_candidate_distance_;
+
+    std::vector<Candidate>::iterator it_out = candidates.begin();
+    for(std::vector<Candidate>::iterator it = candidates.begin(); it != candidates.end(); ++it)
+    {
+        double rot_diff = std::abs(it->rotation - c.rotation);
+        if (rot_diff > M_PI)
+            rot_diff = 2 * M_PI - rot_diff;
+
+        bool close = (it->pose.t - c.pose.t).length2() < min_dist_sq && rot_diff < min_candidate_rotation_distance_;
+
+        if (close && it->score >= c.score)
+            return;
+
+        // Keep all candidates that are not a worse version of this one
+        if (!close)
+            *it_out++ = *it;
+    }
+    candidates.erase(it_out, candidates.end());
+
+    candidates.insert(std::upper_bound(candidates.begin(), candidates.end(), c,
+                                       [](const Candidate& a, const Candidate& b) { return a.score > b.score; }), c);
+
+    if (candidates.size() > num_candidates_)
+        candidates.resize(num_candidates_);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void GlobalSearch::search(const std::vector<geo::Vec2>& points, std::vector<Candidate>& candidates) const
+{
+    candidates.clear();
+
+    if (levels_.empty() || points.empty())
+        return;
+
+    // Use an evenly spaced subset of the points
+    std::vector<geo::Vec2> pts;
+    unsigned int num_points = std::min<unsigned int>(points.size(), max_points_);
+    double max_range = resolution_;
+    for(unsigned int k = 0; k < num_points; ++k)
+    {
+        pts.push_back(points[(unsigned long)k * points.size() / num_points]);
+        max_range = std::max(max_range, pts.back().length());
+    }
+
+    // Rotation step such that the furthest point moves about one cell
+    int num_rotations = std::ceil(2 * M_PI / (resolution_ / max_range));
+    rotation_step_ = 2 * M_PI / num_rotations;
+
+    int top_level = num_levels_ - 1;
+    int top_size = 1 << top_level;
+
+    std::vector<int> dx(pts.size());
+    std::vector<int> dy(pts.size());
+    std::vector<Node> stack;
+    std::vector<Node> children;
+
+    for(int i_rot = 0; i_rot < num_rotations; ++i_rot)
+    {
+        double rotation = -M_PI + i_rot * rotation_step_;
+        double c = std::cos(rotation);
+        double s = std::sin(rotation);
+
+        // Cell offsets of the rotated points, relative to the cell of the robot
+        for(unsigned int i = 0; i < pts.size(); ++i)
+        {
+            const geo::Vec2& p = pts[i];
+            dx[i] = std::floor((c * p.x - s * p.y) / resolution_ + 0.5);
+            dy[i] = std::floor((s * p.x + c * p.y) / resolution_ + 0.5);
+        }
+
+        // Coarsest blocks, sorted such that the most promising one is on top of the stack
+        stack.clear();
+        for(int y = 0; y < field_.height(); y += top_size)
+        {
+            for(int x = 0; x < field_.width(); x += top_size)
+            {
+                Node n;
+                n.x = x;
+                n.y = y;
+                n.level = top_level;
+                n.score = score(dx, dy, x, y, top_level);
+                stack.push_back(n);
+            }
+        }
+
+        std::sort(stack.begin(), stack.end(), [](const Node& a, const Node& b) { return a.score < b.score; });
+
+        // Depth-first branch and bound
+        while (!stack.empty())
+        {
+            Node n = stack.back();
+            stack.pop_back();
+
+            // Only blocks that can beat the worst candidate are of interest
+            if (candidates.size() >= num_candidates_ && n.score <= candidates.back().score)
+                continue;
+
+            if (n.level == 0)
+            {
+                Candidate cand;
+                cand.rotation = rotation;
+                cand.pose = geo::Transform2(field_.origin().x + (n.x + 0.5) * resolution_,
+                                            field_.origin().y + (n.y + 0.5) * resolution_, rotation);
+                cand.score = n.score;
+                addCandidate(cand, candidates);
+                continue;
+            }
+
+            int h = 1 << (n.level - 1);
+
+            children.clear();
+            for(int cy = n.y; cy < std::min(n.y + 2 * h, field_.height()); cy += h)
+            {
+                for(int cx = n.x; cx < std::min(n.x + 2 * h, field_.width()); cx += h)
+                {
+                    Node child;
+                    child.x = cx;
+                    child.y = cy;
+                    child.level = n.level - 1;
+                    child.score = score(dx, dy, cx, cy, child.level);
+                    children.push_back(child);
+                }
+            }
+
+            std::sort(children.begin(), children.end(), [](const Node& a, const Node& b) { return a.score < b.score; });
+            stack.insert(stack.end(), children.begin(), children.end());
+        }
+    }
+}
@@ -0,0 +1,97 @@
+#ifndef ED_LOCALIZATION_GLOBAL_SEARCH_H_
+#define ED_LOCALIZATION_GLOBAL_SEARCH_H_
+
+#include "likelihood_field.h"
+#include "map_artifacts.h"
+
+#include <geolib/datatypes.h>
+
+#include <tue/config/configuration.h>
+
+#include <vector>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Global localization: finds the robot poses at which a scan best matches the world model cross
+// section, without any prior. Uses a multi-resolution branch-and-bound correlative search (Olson,
+// 2009; Hess et al., 2016): the translations are searched on a pyramid of max-pooled likelihood
+// fields, which give an upper bound of the score of all translations within a coarse cell. Only the
+// cells of which the bound can beat the current candidates are refined.
+class GlobalSearch
+{
+
+public:
+
+    struct Candidate
+    {
+        geo::Transform2 pose;
+        double rotation;
+        double score;  // Mean likelihood of the scan points, in [0, 1]
+    };
+
+    GlobalSearch();
+
+    ~GlobalSearch();
+
+    void configure(tue::Configuration config);
+
+    // Builds the likelihood field pyramid from the cross section lines (in the map frame). If artifacts are
+    // given, the likelihood field is taken from (or added to) them.
+    void build(const std::vector<geo::Vec2>& lines_start, const std::vector<geo::Vec2>& lines_end,
+               MapArtifacts* artifacts = 0);
+
+    bool empty() const { return levels_.empty(); }
+
+    // Finds the best (at most numCandidates()) robot poses for the given scan points (in the robot
+    // frame), sorted on decreasing score. Candidates that are close to a better candidate are skipped.
+    void search(const std::vector<geo::Vec2>& points, std::vector<Candidate>& candidates) const;
+
+    unsigned int numCandidates() const { return num_candidates_; }
+
+    // Maximum number of scan points that should be used for the search
+    unsigned int maxPoints() const { return max_points_; }
+
+    double resolution() const { return resolution_; }
+
+    // Rotation step used during the last search
+    double rotationStep() const { return rotation_step_; }
+
+private:
+
+    // Configuration
+    double resolution_;
+    double sigma_;
+    unsigned int num_levels_;
+    unsigned int num_candidates_;
+    unsigned int max_points_;
+    double min_candidate_distance_;
+    double min_candidate_rotation_distance_;
+
+    LikelihoodField field_;
+
+    // levels_[k] holds, for every cell, the maximum of the field over the 2^k x 2^k block of cells starting
+    // at that cell. The levels are padded with 'padding_' cells on the low sides, such that blocks that
+    // only partially overlap the field can be looked up as well.
+    std::vector<std::vector<float> > levels_;
+    int padding_;
+    int padded_width_;
+    int padded_height_;
+
+    mutable double rotation_step_;
+
+    struct Node
+    {
+        int x, y;       // Translation (in cells) of the lowest corner of the block
+        int level;
+        double score;   // Upper bound of the score of all translations in the block
+    };
+
+    // Upper bound of the score of the points (as cell offsets) for all translations in the node
+    double score(const std::vector<int>& dx, const std::vector<int>& dy, int x, int y, int level) const;
+
+    // Adds the candidate, unless it is close to a better one. Removes worse candidates that are close.
+    void addCandidate(const Candidate& c, std::vector<Candidate>& candidates) const;
+
+};
+
+#endif
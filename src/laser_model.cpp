@@ -1,61 +1,37 @@
 #include "laser_model.h"
 
 #include "particle_filter.h"
-#include <ed/world_model.h>
-#include <ed/entity.h>
-#include <geolib/Shape.h>
 
-#include <tue/profiling/timer.h>
+#include <algorithm>
+#include <functional>
 
 // ----------------------------------------------------------------------------------------------------
 
-class LineRenderResult : public geo::LaserRangeFinder::RenderResult
-{
-
-public:
-
-    LineRenderResult(std::vector<geo::Vec2>& lines_start, std::vector<geo::Vec2>& lines_end, double max_distance)
-        : geo::LaserRangeFinder::RenderResult(dummy_ranges_),
-          lines_start_(lines_start), lines_end_(lines_end), max_distance_sq_(max_distance * max_distance) {}
-
-    void renderLine(const geo::Vec2& p1, const geo::Vec2& p2)
-    {
-        // Calculate distance to the line
-
-        geo::Vec2 diff = p2 - p1;
-        double line_length_sq = diff.length2();
+// The pose estimate is only used to select and reject beams if the best cluster holds at least this part
+// of the total weight (i.e., the filter is tracking)
+const double TRACKING_MIN_CLUSTER_WEIGHT = 0.5;
 
-        double t = p1.dot(diff) / -line_length_sq;
+// If more beams than this ratio seem to hit dynamic obstacles, the pose estimate is probably off, so
+// no beams are rejected
+const double MAX_DYNAMIC_BEAM_RATIO = 0.5;
 
-        double distance_sq;
-
-        if (t < 0)
-            distance_sq = p1.length2();
-        else if (t > 1)
-            distance_sq = p2.length2();
-        else
-            distance_sq = (p1 + t * diff).length2();
-
-        // If too far, skip
-        if (distance_sq > max_distance_sq_)
-            return;
-
-        lines_start_.push_back(p1);
-        lines_end_.push_back(p2);
-    }
-
-private:
-
-    std::vector<double> dummy_ranges_;
-    std::vector<geo::Vec2>& lines_start_;
-    std::vector<geo::Vec2>& lines_end_;
-    double max_distance_sq_;
+// ----------------------------------------------------------------------------------------------------
 
-};
+// Normalizes an angle to [-pi, pi)
+inline double normalizeAngle(double a)
+{
+    a = std::fmod(a + M_PI, 2 * M_PI);
+    if (a < 0)
+        a += 2 * M_PI;
+    return a - M_PI;
+}
 
 // ----------------------------------------------------------------------------------------------------
 
-LaserModel::LaserModel()
+LaserModel::LaserModel() : type_(BEAM_MODEL), beam_selection_(UNIFORM_BEAMS), profiler_(0), artifacts_(0), scan_angle_min_(0),
+    scan_angle_increment_(0), selection_lines_revision_(0), segment_grid_cell_size_(1.0), lines_(&visible_lines_), angle_min_(-M_PI), angle_max_(M_PI),
+    range_min_(0), render_range_(0), use_opencl_(false), dynamic_obstacle_distance_(0), num_dynamic_beams_(0), likelihood_field_revision_(0),
+    num_max_range_beams_(0)
 {
     // DEFAULT:
     z_hit = 0.95;
@@ -66,8 +42,17 @@ LaserModel::LaserModel()
     lambda_short = 0.1;
     range_max = 10;      // m
 
+    min_particle_distance_ = 0.05;
+    min_particle_rotation_distance_ = 0.05;
+
+    likelihood_field_resolution_ = 0.05;
+    likelihood_field_max_distance_ = 1.0;
+
     laser_height_ = 0.3;
     laser_offset_ = geo::Transform2(0.3, 0, 0);
+    laser_upside_down_ = false;
+    scan_motion_ = geo::Transform2::identity();
+    scan_offset_ = laser_offset_;
 }
 
 // ----------------------------------------------------------------------------------------------------
@@ -80,8 +65,29 @@ LaserModel::~LaserModel()
 
 void LaserModel::configure(tue::Configuration config)
 {
+    std::string type = "beam";
+    config.value("type", type, tue::config::OPTIONAL);
+    if (type == "beam")
+        type_ = BEAM_MODEL;
+    else if (type == "likelihood_field")
+        type_ = LIKELIHOOD_FIELD;
+    else
+        config.addError("Unknown laser model type: '" + type + "' (options: 'beam', 'likelihood_field')");
+
+    config.value("likelihood_field_resolution", likelihood_field_resolution_, tue::config::OPTIONAL);
+    config.value("likelihood_field_max_distance", likelihood_field_max_distance_, tue::config::OPTIONAL);
+
     config.value("num_beams", num_beams);
 
+    std::string beam_selection = "uniform";
+    config.value("beam_selection", beam_selection, tue::config::OPTIONAL);
+    if (beam_selection == "uniform")
+        beam_selection_ = UNIFORM_BEAMS;
+    else if (beam_selection == "adaptive")
+        beam_selection_ = ADAPTIVE_BEAMS;
+    else
+        config.addError("Unknown beam selection: '" + beam_selection + "' (options: 'uniform', 'adaptive')");
+
     config.value("z_hit", z_hit);
     config.value("sigma_hit", sigma_hit);
     config.value("z_short", z_short);
@@ -89,31 +95,82 @@ void LaserModel::configure(tue::Configuration config)
     config.value("z_rand", z_rand);
     config.value("lambda_short", lambda_short);
     config.value("range_max", range_max);
+
+#ifdef ED_LOCALIZATION_LASER_PRECISION_FIXED16
+    // Ranges are stored in millimeters in 16 bits
+    range_max = std::min(range_max, 65.0);
+#endif
     config.value("min_particle_distance", min_particle_distance_);
     config.value("min_particle_rotation_distance", min_particle_rotation_distance_);
 
+    config.value("segment_grid_cell_size", segment_grid_cell_size_, tue::config::OPTIONAL);
+
+    // Beams that are this much shorter than expected from the best pose are not scored (0 = score all beams)
+    config.value("dynamic_obstacle_distance", dynamic_obstacle_distance_, tue::config::OPTIONAL);
+
+    int num_threads = 1;
+    config.value("num_threads", num_threads, tue::config::OPTIONAL);
+    workers_.setNumThreads(std::max(0, num_threads));
+
+    // Falls back to the CPU if OpenCL is not available (see backendError())
+    std::string backend = "cpu";
+    config.value("backend", backend, tue::config::OPTIONAL);
+    use_opencl_ = false;
+    backend_error_.clear();
+    if (backend == "opencl")
+    {
+        if (type_ != BEAM_MODEL)
+            backend_error_ = "the OpenCL backend only implements the beam model";
+        else
+            use_opencl_ = opencl_.initialize(backend_error_);
+    }
+    else if (backend != "cpu")
+        config.addError("Unknown laser model backend: '" + backend + "' (options: 'cpu', 'opencl')");
+
     // Pre-calculate expensive operations
     int resolution = 1000; // mm accuracy
 
-    exp_hit_.resize(range_max * resolution + 1);
+    // One extra entry for rounding of range_max, and one padding entry for the 16-bit gathers
+    int table_size = std::ceil(range_max * resolution) + 2;
+
+    exp_hit_.resize(table_size);
     for(int i = 0; i < exp_hit_.size(); ++i)
     {
         double z = (double)i / resolution;
-        exp_hit_[i] = exp(-(z * z) / (2 * this->sigma_hit * this->sigma_hit));
+        exp_hit_[i] = BeamPrecision<BeamRange>::toTable(exp(-(z * z) / (2 * this->sigma_hit * this->sigma_hit)));
     }
 
-    exp_short_.resize(range_max * resolution + 1);
+    exp_short_.resize(table_size);
     for(int i = 0; i < exp_hit_.size(); ++i)
     {
         double obs_range = (double)i / resolution;
-        exp_short_[i] = exp(-this->lambda_short * obs_range);
+        exp_short_[i] = BeamPrecision<BeamRange>::toTable(exp(-this->lambda_short * obs_range));
     }
+
+    // Make sure the likelihood field is rebuilt using the new parameters
+    likelihood_field_ = LikelihoodField();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LaserModel::updateWeights(const CrossSectionCache& cross_section, const sensor_msgs::LaserScan& scan, ParticleFilter& pf)
+{
+    single_models_.assign(1, this);
+    single_scans_.assign(1, &scan);
+    updateWeights(single_models_, single_scans_, cross_section, pf);
 }
 
 // ----------------------------------------------------------------------------------------------------
 
-void LaserModel::updateWeights(const ed::WorldModel& world, const sensor_msgs::LaserScan& scan, ParticleFilter& pf)
+void LaserModel::updateWeights(const std::vector<LaserModel*>& models, const std::vector<const sensor_msgs::LaserScan*>& scans,
+                               const CrossSectionCache& cross_section, ParticleFilter& pf)
 {
+    if (models.empty())
+        return;
+
+    LaserModel& main_model = *models.front();
+    StageProfiler* profiler = main_model.profiler_;
+
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
     // -     Find unique samples
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -123,239 +180,893 @@ void LaserModel::updateWeights(const ed::WorldModel& world, const sensor_msgs::L
     // that only contain samples that are further apart than a given threshold. We will only
     // calculate the probabilities of those samples, and share them with the similar samples.
 
-    // unique samples
-    std::vector<Transform> unique_samples;
+    StageProfiler::Clock::time_point t = StageProfiler::Clock::now();
+
+    const SampleSet& samples = static_cast<const ParticleFilter&>(pf).sampleSet();  // Keeps the clusters valid
+
+    // unique samples (indices in the sample set)
+    std::vector<unsigned int>& unique_samples = main_model.unique_samples_;
 
     // mapping of samples from the particle filter to the unique sample list
-    std::vector<unsigned int> sample_to_unique(pf.samples().size());
+    std::vector<unsigned int>& sample_to_unique = main_model.sample_to_unique_;
+
+    main_model.findUniqueSamples(samples, unique_samples, sample_to_unique);
+
+    if (profiler)
+    {
+        t = profiler->recordSince(StageProfiler::UNIQUE_SAMPLES, t);
+        profiler->record(StageProfiler::NUM_UNIQUE_SAMPLES, unique_samples.size());
+    }
+
+    // If there is only one unique sample, it means are particles are (almost) identical, and the laser model
+    // update is not neccesary. This typically holds if the robot is standing still.
+    if (unique_samples.size() == 1)
+        return;
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Select beams
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+    std::vector<LaserModel*>& active_models = main_model.active_models_;
+    active_models.clear();
+    for(unsigned int k = 0; k < models.size() && k < scans.size(); ++k)
+    {
+        if (!scans[k])
+            continue;
+
+        LaserModel* model = models[k];
+        model->updateScanTables(*scans[k]);
+        model->selectBeams(cross_section, *scans[k], pf);
+        active_models.push_back(model);
+    }
+
+    if (active_models.empty())
+        return;
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Calculate sample weight updates
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+    std::vector<geo::Transform2>& unique_poses = main_model.unique_poses_;
+    unique_poses.reserve(samples.size());
+    unique_poses.resize(unique_samples.size());
+    for(unsigned int j = 0; j < unique_samples.size(); ++j)
+        unique_poses[j] = samples.transform(unique_samples[j]);
+
+    // Select the part of the cross section that is needed for this update (once for all models)
+    for(std::vector<LaserModel*>::const_iterator it = active_models.begin(); it != active_models.end(); ++it)
+    {
+        if ((*it)->type_ == LIKELIHOOD_FIELD)
+            (*it)->updateLikelihoodField(cross_section);
+    }
+
+    main_model.selectVisibleLines(active_models, cross_section, pf);
+
+    unsigned int num_beams = 0;
+    unsigned int num_dynamic_beams = 0;
+    for(std::vector<LaserModel*>::const_iterator it = active_models.begin(); it != active_models.end(); ++it)
+    {
+        LaserModel* model = *it;
+
+        // Beams that hit unmodeled obstacles do not have to be scored for every sample
+        model->rejectDynamicBeams(pf);
+
+        model->calculateBeamData();
+
+        num_beams += model->sensor_ranges_.size();
+        num_dynamic_beams += model->num_dynamic_beams_;
+    }
+
+    if (profiler)
+    {
+        t = profiler->recordSince(StageProfiler::CROSS_SECTION_SELECT, t);
+        profiler->record(StageProfiler::NUM_LINES, main_model.visible_lines_.start.size());
+        profiler->record(StageProfiler::NUM_BEAMS, num_beams);
+        profiler->record(StageProfiler::NUM_DYNAMIC_BEAMS, num_dynamic_beams);
+    }
+
+    // The weights are updated in log space, which avoids underflow, lets the likelihoods of the scans be
+    // summed, and lets the particle filter normalize and calculate the effective sample size in the same pass
+    std::vector<double>& weight_updates = main_model.weight_updates_;
+    weight_updates.reserve(samples.size());
+    weight_updates.resize(unique_samples.size());
+    main_model.calculateWeights(active_models, unique_poses, weight_updates);
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Update the particle filter
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+    pf.updateWeights(weight_updates, sample_to_unique);
+
+    if (profiler)
+        profiler->recordSince(StageProfiler::WEIGHT_UPDATE, t);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LaserModel::findUniqueSamples(const SampleSet& samples, std::vector<unsigned int>& unique_samples,
+                                   std::vector<unsigned int>& sample_to_unique) const
+{
+    unique_samples.clear();
+    unique_samples.reserve(samples.size());
+    sample_to_unique.resize(samples.size());
 
     double min_particle_distance_sq = min_particle_distance_ * min_particle_distance_;
 
-    for(unsigned int i = 0; i < pf.samples().size(); ++i)
+    // To avoid comparing each sample with all unique samples found so far, the unique samples are
+    // stored in a hashed (x, y, rotation) grid. The cell sizes are at least the distance thresholds,
+    // so any unique sample within the thresholds lies in the same or in one of the neighboring cells.
+    // For each cell, 'cell_first' holds the first unique sample in that cell and 'unique_next' links
+    // to the next one in the same cell. Both are kept between calls, so they do not allocate anymore
+    // once they have grown to the sample set size.
+    bool use_grid = min_particle_distance_ > 0 && min_particle_rotation_distance_ > 0;
+
+    int num_rot_cells = 1;
+    double rot_cell_size = 2 * M_PI;
+    if (use_grid)
     {
-        const Sample& s1 = pf.samples()[i];
-        const Transform& t1 = s1.pose;
+        num_rot_cells = std::max<int>(1, 2 * M_PI / min_particle_rotation_distance_);
+        rot_cell_size = 2 * M_PI / num_rot_cells;
+    }
 
-        bool found = false;
-        for(unsigned int j = 0; j < unique_samples.size(); ++j)
+    // Neighboring rotation cells (wrapping around). If there are less than 3 rotation cells,
+    // the neighbors coincide, so only visit each of them once
+    int rot_neighbors[3] = { -1, 0, 1 };
+    int num_rot_neighbors = std::min(3, num_rot_cells);
+    if (num_rot_cells == 2)
+        rot_neighbors[0] = 0, rot_neighbors[1] = 1;
+    else if (num_rot_cells == 1)
+        rot_neighbors[0] = 0;
+
+    SampleCellMap& cell_first = unique_cells_;
+    std::vector<int>& unique_next = unique_next_;
+    cell_first.clear();
+    unique_next.clear();
+    if (use_grid)
+    {
+        cell_first.reserve(samples.size());
+        unique_next.reserve(samples.size());
+    }
+
+    for(unsigned int i = 0; i < samples.size(); ++i)
+    {
+        if (!use_grid)
         {
-            const Transform& t2 = unique_samples[j];
+            // With non-positive thresholds no two samples are considered similar
+            sample_to_unique[i] = unique_samples.size();
+            unique_samples.push_back(i);
+            continue;
+        }
 
-            // Calculate difference in rotation
-            double rot_diff = std::abs(t1.rotation() - t2.rotation());
-            if (rot_diff > M_PI)
-                rot_diff = 2 * M_PI - rot_diff;
+        SampleCell cell;
+        cell.x = std::floor(samples.x[i] / min_particle_distance_);
+        cell.y = std::floor(samples.y[i] / min_particle_distance_);
+        cell.a = (int)std::floor((normalizeAngle(samples.theta[i]) + M_PI) / rot_cell_size) % num_rot_cells;
 
-            // Check if translation and rotational difference are within boundaries
-            if ((t1.matrix().t - t2.matrix().t).length2() < min_particle_distance_sq && rot_diff < min_particle_rotation_distance_)
+        // Find the first unique sample (lowest index) within the thresholds. This results in the
+        // same mapping as comparing against all unique samples in order
+        int found = -1;
+        for(int dx = -1; dx <= 1; ++dx)
+        {
+            for(int dy = -1; dy <= 1; ++dy)
             {
-                found = true;
-                sample_to_unique[i] = j;
-                break;
+                for(int k = 0; k < num_rot_neighbors; ++k)
+                {
+                    SampleCell neighbor;
+                    neighbor.x = cell.x + dx;
+                    neighbor.y = cell.y + dy;
+                    neighbor.a = (cell.a + rot_neighbors[k] + num_rot_cells) % num_rot_cells;
+
+                    const int* first = cell_first.find(neighbor);
+                    if (!first)
+                        continue;
+
+                    for(int j = *first; j >= 0; j = unique_next[j])
+                    {
+                        if (found >= 0 && j >= found)
+                            continue;
+
+                        unsigned int k2 = unique_samples[j];
+
+                        // Calculate difference in rotation
+                        double rot_diff = std::abs(samples.theta[i] - samples.theta[k2]);
+                        if (rot_diff > M_PI)
+                            rot_diff = 2 * M_PI - rot_diff;
+
+                        // Check if translation and rotational difference are within boundaries
+                        double dx = samples.x[i] - samples.x[k2];
+                        double dy = samples.y[i] - samples.y[k2];
+                        if (dx * dx + dy * dy < min_particle_distance_sq && rot_diff < min_particle_rotation_distance_)
+                            found = j;
+                    }
+                }
             }
         }
 
-        if (!found)
+        if (found >= 0)
         {
-            sample_to_unique[i] = unique_samples.size();
-            unique_samples.push_back(t1);
+            sample_to_unique[i] = found;
         }
+        else
+        {
+            int j = unique_samples.size();
+            sample_to_unique[i] = j;
+            unique_samples.push_back(i);
+
+            // Prepend the new unique sample to the list of its cell
+            std::pair<int*, bool> res = cell_first.insert(cell, j);
+            unique_next.push_back(res.second ? -1 : *res.first);
+            *res.first = j;
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LaserModel::calculateScanPoints(const sensor_msgs::LaserScan& scan, std::vector<geo::Vec2>& points) const
+{
+    points.clear();
+
+    double r_max = std::min<double>(range_max, scan.range_max);
+
+    unsigned int n = scan.ranges.size();
+    for(unsigned int i = 0; i < n; ++i)
+    {
+        // Same convention as the model: if the laser is upside down, the ranges are mirrored (and
+        // the offset mirrors them back)
+        double r = scan.ranges[laser_upside_down_ ? n - 1 - i : i];
+        if (!(r > scan.range_min) || !(r < r_max))
+            continue;
+
+        double a = scan.angle_min + i * scan.angle_increment;
+        points.push_back(laser_offset_ * geo::Vec2(r * std::cos(a), r * std::sin(a)));
     }
+}
 
-    // If there is only one unique sample, it means are particles are (almost) identical, and the laser model
-    // update is not neccesary. This typically holds if the robot is standing still.
-    if (unique_samples.size() == 1)
+// ----------------------------------------------------------------------------------------------------
+
+void LaserModel::updateScanTables(const sensor_msgs::LaserScan& scan)
+{
+    range_min_ = scan.range_min;
+
+    if (scan_angles_.size() == scan.ranges.size() && scan_angle_min_ == scan.angle_min
+            && scan_angle_increment_ == scan.angle_increment)
         return;
 
-    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-    // -     Update world renderer
-    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    unsigned int n = scan.ranges.size();
+    scan_angles_.resize(n);
+    scan_dirs_.resize(n);
+    for(unsigned int i = 0; i < n; ++i)
+    {
+        double a = scan.angle_min + i * scan.angle_increment;
+        scan_angles_[i] = a;
+        scan_dirs_[i] = geo::Vec2(std::cos(a), std::sin(a));
+    }
+
+    scan_angle_min_ = scan.angle_min;
+    scan_angle_increment_ = scan.angle_increment;
+    angle_min_ = scan.angle_min;
+    angle_max_ = scan.angle_max;
+    range_max = std::min<double>(range_max, scan.range_max);
 
-    if (num_beams <= 0)
-        num_beams = scan.ranges.size();
+    // The uniform selection depends on the number of beams of the scan
+    uniform_beams_.clear();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LaserModel::selectBeams(const CrossSectionCache& cross_section, const sensor_msgs::LaserScan& scan, const ParticleFilter& pf)
+{
+    unsigned int n = scan.ranges.size();
+    unsigned int num_selected = (num_beams <= 0) ? n : std::min<unsigned int>(n, num_beams);
+
+    if (uniform_beams_.size() != num_selected)
+    {
+        uniform_beams_.resize(num_selected);
+        for(unsigned int k = 0; k < num_selected; ++k)
+            uniform_beams_[k] = (unsigned long)k * n / num_selected;
+    }
+
+    // Adaptive selection relies on the pose estimate, so it is only used if the filter is tracking
+    // (most of the weight in one cluster). Otherwise, the scan is subsampled uniformly.
+    bool adaptive = beam_selection_ == ADAPTIVE_BEAMS && num_selected < n && !pf.sampleSet().empty()
+            && pf.bestCluster().weight >= TRACKING_MIN_CLUSTER_WEIGHT;
+
+    if (adaptive)
+    {
+        // The score tells how close an end point lies to map structure. Beams into open space or at
+        // unmodeled (dynamic) objects end far from it, and hardly help to discriminate the samples.
+        if (type_ == LIKELIHOOD_FIELD)
+            updateLikelihoodField(cross_section);
+        else
+            updateSelectionLines(cross_section);
+
+        geo::Transform2 laser_pose = pf.bestCluster().mean * scan_offset_;
+
+        beam_values_.clear();
+        beam_values_.reserve(n);
+        for(unsigned int i = 0; i < n; ++i)
+        {
+            double r = scan.ranges[laser_upside_down_ ? n - 1 - i : i];
+            if (r > scan.range_min && r < range_max)
+                beam_values_.push_back(std::make_pair(endPointScore(laser_pose * (scan_dirs_[i] * r)), i));
+        }
+
+        std::sort(beam_values_.begin(), beam_values_.end(), std::greater<std::pair<double, unsigned int> >());
+
+        // Take the best beams, but keep them apart such that they are spread over the field of view
+        int min_gap = std::max<int>(1, n / (2 * num_selected));
+
+        beam_states_.assign(n, BEAM_FREE);
+        selected_beams_.clear();
+        selected_beams_.reserve(num_selected);
+        for(unsigned int k = 0; k < beam_values_.size() && selected_beams_.size() < num_selected; ++k)
+        {
+            int i = beam_values_[k].second;
+            if (beam_states_[i] != BEAM_FREE)
+                continue;
+
+            selected_beams_.push_back(i);
+            for(int j = std::max(0, i - min_gap + 1); j < std::min<int>(n, i + min_gap); ++j)
+                beam_states_[j] = BEAM_BLOCKED;
+            beam_states_[i] = BEAM_SELECTED;
+        }
+
+        // If not enough beams hit something, fill up with the uniform selection
+        for(unsigned int k = 0; k < num_selected && selected_beams_.size() < num_selected; ++k)
+        {
+            if (beam_states_[uniform_beams_[k]] != BEAM_SELECTED)
+                selected_beams_.push_back(uniform_beams_[k]);
+        }
+
+        // The renderer needs increasing beam angles
+        std::sort(selected_beams_.begin(), selected_beams_.end());
+    }
     else
-        num_beams = std::min<int>(scan.ranges.size(), num_beams);
+    {
+        selected_beams_ = uniform_beams_;
+    }
 
-    int i_step = scan.ranges.size() / num_beams;
-    sensor_ranges_.clear();
-    for (unsigned int i = 0; i < scan.ranges.size(); i += i_step)
+    sensor_ranges_.resize(num_selected);
+    beam_angles_.resize(num_selected);
+    beam_dirs_.resize(num_selected);
+    for(unsigned int k = 0; k < num_selected; ++k)
     {
-        double r = scan.ranges[i];
+        unsigned int i = selected_beams_[k];
+
+        // If the laser is upside down, we need to mirror the sensor data
+        double r = scan.ranges[laser_upside_down_ ? n - 1 - i : i];
 
         // Check for Inf
         if (r != r || r > scan.range_max)
             r = 0;
-        sensor_ranges_.push_back(r);
+
+        sensor_ranges_[k] = r;
+        beam_angles_[k] = scan_angles_[i];
+        beam_dirs_[k] = scan_dirs_[i];
     }
-    num_beams = sensor_ranges_.size();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LaserModel::updateSelectionLines(const CrossSectionCache& cross_section)
+{
+    if (selection_lines_.indexed && cross_section.revision() == selection_lines_revision_)
+        return;
+
+    cross_section.getLines(selection_lines_.start, selection_lines_.end);
+
+    // End points are only compared with the lines within likelihood_field_max_distance_, so a query visits
+    // at most 3 x 3 cells
+    selection_lines_.grid.build(selection_lines_.start, selection_lines_.end, std::max(0.1, likelihood_field_max_distance_));
+    selection_lines_.indexed = true;
+    selection_lines_revision_ = cross_section.revision();
+}
 
-    if (lrf_.getNumBeams() != num_beams)
+// ----------------------------------------------------------------------------------------------------
+
+double LaserModel::endPointScore(const geo::Vec2& p)
+{
+    if (type_ == LIKELIHOOD_FIELD)
+        return likelihood_field_.value(p);
+
+    // Minus the squared distance to the nearest line, saturating at likelihood_field_max_distance_ (like the field)
+    double max_distance = likelihood_field_max_distance_;
+    geo::Vec2 d(max_distance, max_distance);
+    selection_lines_.grid.query(p - d, p + d, selection_query_, selection_segment_indices_);
+
+    double min_distance_sq = max_distance * max_distance;
+    for(unsigned int k = 0; k < selection_segment_indices_.size(); ++k)
     {
-        lrf_.setNumBeams(num_beams);
-        lrf_.setAngleLimits(scan.angle_min, scan.angle_max);
-        range_max = std::min<double>(range_max, scan.range_max);
+        unsigned int j = selection_segment_indices_[k];
+        const geo::Vec2& p1 = selection_lines_.start[j];
+        geo::Vec2 e = selection_lines_.end[j] - p1;
+
+        // Closest point on the segment
+        double l_sq = e.length2();
+        double t = l_sq > 0 ? std::max(0.0, std::min(1.0, (p - p1).dot(e) / l_sq)) : 0;
+        min_distance_sq = std::min(min_distance_sq, (p1 + e * t - p).length2());
     }
 
-    // If the laser is upside down, we need to mirror the sensor data
-    if (laser_upside_down_)
-        std::reverse(sensor_ranges_.begin(), sensor_ranges_.end());
+    return -min_distance_sq;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool LaserModel::rendersLines() const
+{
+    return type_ == BEAM_MODEL || dynamic_obstacle_distance_ > 0;
+}
 
+// ----------------------------------------------------------------------------------------------------
+
+void LaserModel::selectVisibleLines(const std::vector<LaserModel*>& models, const CrossSectionCache& cross_section,
+                                    const ParticleFilter& pf)
+{
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
     // -     Determine center and maximum range of world model cross section
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-    // Find the bounding rectangle around all sample poses. This will be used to determine
-    // the largest render distance (anything max_range beyond the sample boundaries does
-    // not have to be considered)
+    // Find the bounding rectangle around the sensor poses of all samples (and all models). This will
+    // be used to determine the largest render distance (anything max_range beyond the sample boundaries
+    // does not have to be considered)
 
     geo::Vec2 sample_min(1e9, 1e9);
     geo::Vec2 sample_max(-1e9, -1e9);
-    for(std::vector<Sample>::iterator it = pf.samples().begin(); it != pf.samples().end(); ++it)
+    double render_range = 0;
+    bool render = false;
+
+    const SampleSet& samples = pf.sampleSet();
+    for(std::vector<LaserModel*>::const_iterator it = models.begin(); it != models.end(); ++it)
     {
-        Sample& sample = *it;
+        LaserModel* model = *it;
+        model->lines_ = &visible_lines_;
+
+        if (!model->rendersLines())
+            continue;
+
+        render = true;
+
+        for(unsigned int i = 0; i < samples.size(); ++i)
+        {
+            geo::Transform2 laser_pose = samples.transform(i) * model->scan_offset_;
+
+            sample_min.x = std::min(sample_min.x, laser_pose.t.x);
+            sample_min.y = std::min(sample_min.y, laser_pose.t.y);
+            sample_max.x = std::max(sample_max.x, laser_pose.t.x);
+            sample_max.y = std::max(sample_max.y, laser_pose.t.y);
+        }
 
-        geo::Transform2 laser_pose = sample.pose.matrix() * laser_offset_;
+        double temp_range_max = 0;
+        for(unsigned int i = 0; i < model->sensor_ranges_.size(); ++i)
+        {
+            double r = model->sensor_ranges_[i];
+            if (r < model->range_max)
+                temp_range_max = std::max(temp_range_max, r);
+        }
+
+        // Add a small buffer to the distance to allow model data that is
+        // slightly further away to still match
+        temp_range_max += model->lambda_short;
 
-        sample_min.x = std::min(sample_min.x, laser_pose.t.x);
-        sample_min.y = std::min(sample_min.y, laser_pose.t.y);
-        sample_max.x = std::max(sample_min.x, laser_pose.t.x);
-        sample_max.y = std::max(sample_min.y, laser_pose.t.y);
+        model->render_range_ = temp_range_max;
+        render_range = std::max(render_range, temp_range_max);
     }
 
-    double temp_range_max = 0;
-    for(unsigned int i = 0; i < sensor_ranges_.size(); ++i)
+    if (!render)
     {
-        double r = sensor_ranges_[i];
-        if (r < range_max)
-            temp_range_max = std::max(temp_range_max, r);
+        // Only likelihood fields: nothing is rendered
+        visible_lines_.start.clear();
+        visible_lines_.end.clear();
+        visible_lines_.indexed = false;
+        return;
     }
 
-    // Add a small buffer to the distance to allow model data that is
-    // slightly further away to still match
-    temp_range_max += lambda_short;
-
     // Calculate the sample boundary center and boundary render distance
     geo::Vec2 sample_center = (sample_min + sample_max) / 2;
-    double max_distance = (sample_max - sample_min).length() / 2 + temp_range_max;
-
-    // Set the range limit to the lrf renderer. This will make sure all shapes that
-    // are too far away will not be rendered (object selection, not line selection)
-    lrf_.setRangeLimits(scan.range_min, max_distance);
+    double max_distance = (sample_max - sample_min).length() / 2 + render_range;
 
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
     // -     Create world model cross section
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-    geo::Pose3D laser_pose(sample_center.x, sample_center.y, laser_height_);
+    // Of the cached lines, all lines that are further away than max_distance from the sample center are discarded
+    cross_section.selectLines(sample_center, max_distance, visible_lines_.start, visible_lines_.end);
 
-    lines_start_.clear();
-    lines_end_.clear();
+    // Index the selected lines. Each sample then only renders the lines in the neighborhood of its sensor
+    visible_lines_.indexed = segment_grid_cell_size_ > 0;
+    if (visible_lines_.indexed)
+        visible_lines_.grid.build(visible_lines_.start, visible_lines_.end, segment_grid_cell_size_);
+}
 
-    // Give the max_distance also to the line renderer. It will discard all LINES that
-    // are further away. Note that this is an even finer selection than the default
-    // object selection that is done by the lrf renderer.
-    LineRenderResult render_result(lines_start_, lines_end_, max_distance);
+// ----------------------------------------------------------------------------------------------------
 
-    for(ed::WorldModel::const_iterator it = world.begin(); it != world.end(); ++it)
+void LaserModel::calculateWeights(const std::vector<LaserModel*>& models, const std::vector<geo::Transform2>& unique_poses,
+                                  std::vector<double>& weight_updates)
+{
+    // The unique samples are divided over the worker threads. Each thread gets its own buffers, which
+    // it uses for all models.
+    for(std::vector<LaserModel*>::const_iterator it = models.begin(); it != models.end(); ++it)
     {
-        const ed::EntityConstPtr& e = *it;
-        if (e->shape() && e->has_pose())
-        {
-            // Do not render the robot itself (we're trying to localize it!)
-            if (e->hasFlag("self"))
-                continue;
+        if ((*it)->use_opencl_)
+            (*it)->calculateOpenCLWeights(unique_poses);
+    }
 
-            if (e->hasFlag("non-localizable"))
-                continue;
+    unsigned int num_threads = workers_.numThreads();
+    thread_model_ranges_.resize(num_threads);
+    thread_segment_queries_.resize(num_threads);
+    thread_segment_indices_.resize(num_threads);
+
+    workers_.run(unique_poses.size(), [&](unsigned int thread_idx, unsigned int begin, unsigned int end)
+    {
+        std::vector<BeamRange>& model_ranges = thread_model_ranges_[thread_idx];
+        SegmentGrid::Query& segment_query = thread_segment_queries_[thread_idx];
+        std::vector<unsigned int>& segment_indices = thread_segment_indices_[thread_idx];
+
+        for(unsigned int j = begin; j < end; ++j)
+        {
+            double log_p = 0;
+            for(std::vector<LaserModel*>::const_iterator it = models.begin(); it != models.end(); ++it)
+            {
+                const LaserModel* model = *it;
+                if (model->use_opencl_)
+                    log_p += model->opencl_log_likelihoods_[j];
+                else if (model->type_ == LIKELIHOOD_FIELD)
+                    log_p += std::log(model->calculateLikelihoodFieldWeightUpdate(unique_poses[j]));
+                else
+                    log_p += std::log(model->calculateWeightUpdate(unique_poses[j], model_ranges, segment_query, segment_indices));
+            }
 
-            geo::LaserRangeFinder::RenderOptions options;
-            geo::Transform t_inv = laser_pose.inverse() * e->pose();
-            options.setMesh(e->shape()->getMesh(), t_inv);
-            lrf_.render(options, render_result);
+            weight_updates[j] = log_p;
         }
+    });
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+OpenCLBeamModelParams LaserModel::openCLParams() const
+{
+    OpenCLBeamModelParams params;
+    params.z_hit = z_hit;
+    params.sigma_hit = sigma_hit;
+    params.z_short = z_short;
+    params.lambda_short = lambda_short;
+    params.z_max = z_max;
+    params.z_rand = z_rand;
+    params.range_max = range_max;
+    params.range_min = range_min_;
+    params.render_range = render_range_;
+    return params;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LaserModel::calculateOpenCLWeights(const std::vector<geo::Transform2>& unique_poses)
+{
+    // The device renders all selected lines (it does not use the segment grid)
+    if (!opencl_.calculateLogLikelihoods(lines_->start, lines_->end, beam_angles_, beam_dirs_, sensor_ranges_, scan_offset_,
+                                         unique_poses, openCLParams(), opencl_log_likelihoods_, backend_error_))
+        use_opencl_ = false;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool LaserModel::calculateLogLikelihoods(const std::vector<geo::Transform2>& sample_poses, Backend backend,
+                                         std::vector<double>& log_likelihoods, std::string& error)
+{
+    if (type_ != BEAM_MODEL)
+    {
+        error = "only implemented for the beam model";
+        return false;
     }
 
-    for(unsigned int i = 0; i < lines_start_.size(); ++i)
+    if (backend == OPENCL_BACKEND)
     {
-        lines_start_[i] += sample_center;
-        lines_end_[i] += sample_center;
+        if (!opencl_.initialize(error))
+            return false;
+
+        return opencl_.calculateLogLikelihoods(lines_->start, lines_->end, beam_angles_, beam_dirs_, sensor_ranges_, scan_offset_,
+                                               sample_poses, openCLParams(), log_likelihoods, error);
     }
 
-    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-    // -     Calculate sample weight updates
-    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    if (backend == OPENCL_HOST_BACKEND)
+    {
+        OpenCLBeamModel::calculateLogLikelihoodsOnHost(lines_->start, lines_->end, beam_angles_, beam_dirs_, sensor_ranges_,
+                                                       scan_offset_, sample_poses, openCLParams(), log_likelihoods);
+        return true;
+    }
 
-    lrf_.setRangeLimits(scan.range_min, temp_range_max);
+    std::vector<BeamRange> model_ranges;
+    SegmentGrid::Query segment_query;
+    std::vector<unsigned int> segment_indices;
 
-    std::vector<double> weight_updates(unique_samples.size());
-    for(unsigned int j = 0; j < unique_samples.size(); ++j)
+    log_likelihoods.resize(sample_poses.size());
+    for(unsigned int j = 0; j < sample_poses.size(); ++j)
+        log_likelihoods[j] = std::log(calculateWeightUpdate(sample_poses[j], model_ranges, segment_query, segment_indices));
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LaserModel::renderLine(const geo::Vec2& p1, const geo::Vec2& p2, std::vector<BeamRange>& model_ranges) const
+{
+    if (beam_angles_.empty())
+        return;
+
+    geo::Vec2 e = p2 - p1;
+
+    // Angular interval [a_start, a_start + a_span] covered by the line, as seen from the sensor
+    double a1 = atan2(p1.y, p1.x);
+    double a_span = normalizeAngle(atan2(p2.y, p2.x) - a1);
+    double a_start = a1;
+    if (a_span < 0)
+    {
+        a_start += a_span;
+        a_span = -a_span;
+    }
+
+    // Range of the hit for beam direction d: p1 + t * e = r * d  =>  r = (p1 x e) / (d x e)
+    double p1_cross_e = p1.x * e.y - p1.y * e.x;
+
+    double beam_angle_min = beam_angles_.front();
+    double beam_angle_max = beam_angles_.back();
+
+    // The interval may have to be shifted by a full turn to overlap with the beam angles
+    for(int k = -1; k <= 1; ++k)
     {
-        geo::Transform2 laser_pose = unique_samples[j].matrix() * laser_offset_;
-        geo::Transform2 pose_inv = laser_pose.inverse();
+        double a_min = a_start + k * 2 * M_PI;
+        double a_max = a_min + a_span;
+
+        if (a_max < beam_angle_min || a_min > beam_angle_max)
+            continue;
 
-        // Calculate sensor model for this pose
-        std::vector<double> model_ranges(sensor_ranges_.size(), 0);
+        // Indices of the beams within the interval
+        unsigned int i_min = std::lower_bound(beam_angles_.begin(), beam_angles_.end(), a_min) - beam_angles_.begin();
+        unsigned int i_max = std::upper_bound(beam_angles_.begin(), beam_angles_.end(), a_max) - beam_angles_.begin();
 
-        for(unsigned int i = 0; i < lines_start_.size(); ++i)
+        for(unsigned int i = i_min; i < i_max; ++i)
         {
-            const geo::Vec2& p1 = lines_start_[i];
-            const geo::Vec2& p2 = lines_end_[i];
+            const geo::Vec2& d = beam_dirs_[i];
+
+            double den = d.x * e.y - d.y * e.x;
+            if (den == 0)
+                continue;
+
+            double r = p1_cross_e / den;
+            if (r <= 0 || r < range_min_ || r > render_range_)
+                continue;
 
-            // Transform the points to the laser pose
-            geo::Vec2 p1_t = pose_inv * p1;
-            geo::Vec2 p2_t = pose_inv * p2;
+            BeamRange r_beam = BeamPrecision<BeamRange>::fromMeters(r);
 
-            // Render the line as if seen by the sensor
-            lrf_.renderLine(p1_t, p2_t, model_ranges);
+            BeamRange& model_range = model_ranges[i];
+            if (model_range == 0 || r_beam < model_range)
+                model_range = r_beam;
         }
+    }
+}
 
-        double p = 1;
+// ----------------------------------------------------------------------------------------------------
 
-        for(unsigned int i = 0; i < sensor_ranges_.size(); ++i)
+void LaserModel::calculateSensorBoundingBox(const geo::Transform2& laser_pose, geo::Vec2& min, geo::Vec2& max) const
+{
+    const geo::Vec2& o = laser_pose.t;
+    double r = render_range_;
+
+    // Start with the sensor origin and the end points of the outer beams
+    geo::Vec2 p_min = laser_pose.R * geo::Vec2(cos(angle_min_) * r, sin(angle_min_) * r);
+    geo::Vec2 p_max = laser_pose.R * geo::Vec2(cos(angle_max_) * r, sin(angle_max_) * r);
+
+    min.x = std::min(0.0, std::min(p_min.x, p_max.x));
+    min.y = std::min(0.0, std::min(p_min.y, p_max.y));
+    max.x = std::max(0.0, std::max(p_min.x, p_max.x));
+    max.y = std::max(0.0, std::max(p_min.y, p_max.y));
+
+    // For each of the four axis directions (in the map frame) that lies within the field of view, the
+    // arc reaches its extreme in that direction. The rotation matrix is orthonormal (possibly mirrored
+    // if the laser is upside down), so its transpose maps the directions to the laser frame.
+    const geo::Mat2& R = laser_pose.R;
+    const double dirs[4][2] = { { 1, 0 }, { 0, 1 }, { -1, 0 }, { 0, -1 } };
+    for(int k = 0; k < 4; ++k)
+    {
+        double lx = R.xx * dirs[k][0] + R.yx * dirs[k][1];
+        double ly = R.xy * dirs[k][0] + R.yy * dirs[k][1];
+        double a = atan2(ly, lx);
+
+        if ((a >= angle_min_ && a <= angle_max_) || (a + 2 * M_PI >= angle_min_ && a + 2 * M_PI <= angle_max_)
+                || (a - 2 * M_PI >= angle_min_ && a - 2 * M_PI <= angle_max_))
         {
-            double obs_range = sensor_ranges_[i];
-            double map_range = model_ranges[i];
+            min.x = std::min(min.x, dirs[k][0] * r);
+            min.y = std::min(min.y, dirs[k][1] * r);
+            max.x = std::max(max.x, dirs[k][0] * r);
+            max.y = std::max(max.y, dirs[k][1] * r);
+        }
+    }
+
+    min = min + o;
+    max = max + o;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+double LaserModel::calculateWeightUpdate(const geo::Transform2& sample_pose,
+                                         std::vector<BeamRange>& model_ranges, SegmentGrid::Query& segment_query,
+                                         std::vector<unsigned int>& segment_indices) const
+{
+    geo::Transform2 laser_pose = sample_pose * scan_offset_;
+
+    // Calculate sensor model for this pose
+    renderModelRanges(laser_pose, lines_->indexed, model_ranges, segment_query, segment_indices);
+
+    BeamKernelParams<BeamRange> params;
+    params.z_hit = z_hit;
+    params.z_short_lambda = z_short * lambda_short;
+    params.z_max = z_max;
+    params.z_rand_term = z_rand / range_max;
+    params.range_max = BeamPrecision<BeamRange>::fromMeters(range_max);
+    params.exp_hit = exp_hit_.data();
+    params.exp_short = exp_short_.data();
+
+    return calculateBeamLikelihood(beam_sensor_ranges_.data(), model_ranges.data(), beam_sensor_ranges_.size(), params);
+}
+
+// ----------------------------------------------------------------------------------------------------
 
-            double z = obs_range - map_range;
+void LaserModel::renderModelRanges(const geo::Transform2& laser_pose, bool use_grid, std::vector<BeamRange>& model_ranges,
+                                   SegmentGrid::Query& segment_query, std::vector<unsigned int>& segment_indices) const
+{
+    geo::Transform2 pose_inv = laser_pose.inverse();
 
-            double pz = 0;
+    model_ranges.assign(sensor_ranges_.size(), 0);
 
-            // Part 1: good, but noisy, hit
-            //            pz += this->z_hit * exp(-(z * z) / (2 * this->sigma_hit * this->sigma_hit));
-            pz += this->z_hit * exp_hit_[std::min(std::abs(z), range_max) * 1000];
+    // Only the lines that are within the area the sensor can see have to be rendered (the renderer
+    // ignores anything beyond render_range_ anyway)
+    if (use_grid)
+    {
+        geo::Vec2 bb_min, bb_max;
+        calculateSensorBoundingBox(laser_pose, bb_min, bb_max);
+        lines_->grid.query(bb_min, bb_max, segment_query, segment_indices);
+    }
 
-            // Part 2: short reading from unexpected obstacle (e.g., a person)
-            if(z < 0)
-                //                pz += this->z_short * this->lambda_short * exp(-this->lambda_short*obs_range);
-                pz += this->z_short * this->lambda_short * exp_short_[std::min(obs_range, range_max) * 1000];
+    unsigned int num_lines = use_grid ? segment_indices.size() : lines_->start.size();
+    for(unsigned int k = 0; k < num_lines; ++k)
+    {
+        unsigned int i = use_grid ? segment_indices[k] : k;
 
-            // Part 3: Failure to detect obstacle, reported as max-range
-            if(obs_range >= this->range_max)
-                pz += this->z_max * 1.0;
+        const geo::Vec2& p1 = lines_->start[i];
+        const geo::Vec2& p2 = lines_->end[i];
 
-            // Part 4: Random measurements
-            if(obs_range < this->range_max)
-                pz += this->z_rand * 1.0 / this->range_max;
+        // Transform the points to the laser pose
+        geo::Vec2 p1_t = pose_inv * p1;
+        geo::Vec2 p2_t = pose_inv * p2;
 
-            // here we have an ad-hoc weighting scheme for combining beam probs
-            // works well, though...
-            p += pz * pz * pz;
+        // Render the line as if seen by the sensor
+        renderLine(p1_t, p2_t, model_ranges);
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LaserModel::rejectDynamicBeams(const ParticleFilter& pf)
+{
+    num_dynamic_beams_ = 0;
+
+    if (dynamic_obstacle_distance_ <= 0 || sensor_ranges_.empty() || pf.sampleSet().empty())
+        return;
+
+    const PoseCluster& best_cluster = pf.bestCluster();
+    if (best_cluster.weight < TRACKING_MIN_CLUSTER_WEIGHT)
+        return;
+
+    // Expected ranges from the best pose estimate
+    renderModelRanges(best_cluster.mean * scan_offset_, lines_->indexed, dynamic_model_ranges_,
+                      dynamic_segment_query_, dynamic_segment_indices_);
+
+    // A beam is unexplained if it ends well before the structure it should have hit, e.g., because a person
+    // or an unmapped object is in between. Max-range beams, and beams for which nothing is expected, are kept.
+    double min_difference = BeamPrecision<BeamRange>::fromMeters(dynamic_obstacle_distance_);
+
+    dynamic_beams_.assign(sensor_ranges_.size(), false);
+    for(unsigned int i = 0; i < sensor_ranges_.size(); ++i)
+    {
+        double r = sensor_ranges_[i];
+        BeamRange model_range = dynamic_model_ranges_[i];
+        if (r > 0 && r < range_max && model_range != 0
+                && (double)BeamPrecision<BeamRange>::fromMeters(r) + min_difference < (double)model_range)
+        {
+            dynamic_beams_[i] = true;
+            ++num_dynamic_beams_;
         }
+    }
 
-        weight_updates[j] = p;
+    if (num_dynamic_beams_ > MAX_DYNAMIC_BEAM_RATIO * sensor_ranges_.size())
+    {
+        num_dynamic_beams_ = 0;
+        return;
     }
 
-    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-    // -     Update the particle filter
-    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Remove the rejected beams (keeping the order, the renderer needs increasing beam angles)
+    unsigned int n = 0;
+    for(unsigned int i = 0; i < sensor_ranges_.size(); ++i)
+    {
+        if (dynamic_beams_[i])
+            continue;
+
+        sensor_ranges_[n] = sensor_ranges_[i];
+        beam_angles_[n] = beam_angles_[i];
+        beam_dirs_[n] = beam_dirs_[i];
+        ++n;
+    }
 
-    for(unsigned int j = 0; j < pf.samples().size(); ++j)
+    sensor_ranges_.resize(n);
+    beam_angles_.resize(n);
+    beam_dirs_.resize(n);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LaserModel::calculateBeamData()
+{
+    if (type_ == BEAM_MODEL)
     {
-        Sample& sample = pf.samples()[j];
-        sample.weight *= weight_updates[sample_to_unique[j]];
+        beam_sensor_ranges_.resize(sensor_ranges_.size());
+        for(unsigned int i = 0; i < sensor_ranges_.size(); ++i)
+            beam_sensor_ranges_[i] = BeamPrecision<BeamRange>::fromMeters(sensor_ranges_[i]);
+        return;
     }
 
-    pf.normalize();
+    // Calculate the beam end points in the laser frame once, such that for every sample they
+    // only have to be transformed
+    beam_points_.clear();
+    beam_points_.reserve(sensor_ranges_.size());
+    num_max_range_beams_ = 0;
+    for(unsigned int i = 0; i < sensor_ranges_.size(); ++i)
+    {
+        double r = sensor_ranges_[i];
+        if (r >= range_max)
+            ++num_max_range_beams_;
+        else if (r > 0)
+            beam_points_.push_back(beam_dirs_[i] * r);
+    }
+}
+
+
+// ----------------------------------------------------------------------------------------------------
+
+void LaserModel::updateLikelihoodField(const CrossSectionCache& cross_section)
+{
+    // The (relatively expensive) likelihood field is only rebuilt if the cross section changed
+    if (!likelihood_field_.empty() && cross_section.revision() == likelihood_field_revision_)
+        return;
+
+    std::vector<geo::Vec2> lines_start, lines_end;
+    cross_section.getLines(lines_start, lines_end);
+
+    if (artifacts_ && cross_section.isStartupRevision())
+        artifacts_->getLikelihoodField(artifacts_slot_, lines_start, lines_end, likelihood_field_resolution_,
+                                       likelihood_field_max_distance_, z_hit, sigma_hit, z_rand / range_max, likelihood_field_);
+    else
+        likelihood_field_.build(lines_start, lines_end, likelihood_field_resolution_, likelihood_field_max_distance_,
+                                z_hit, sigma_hit, z_rand / range_max);
+    likelihood_field_revision_ = cross_section.revision();
 }
 
+// ----------------------------------------------------------------------------------------------------
+
+double LaserModel::calculateLikelihoodFieldWeightUpdate(const geo::Transform2& sample_pose) const
+{
+    geo::Transform2 laser_pose = sample_pose * scan_offset_;
+
+    // Max-range readings are explained by the 'failure to detect' part of the model, independent of the pose
+    double p = 1 + num_max_range_beams_ * z_max * z_max * z_max;
 
+    for(unsigned int i = 0; i < beam_points_.size(); ++i)
+    {
+        double pz = likelihood_field_.value(laser_pose * beam_points_[i]);
+
+        // Same ad-hoc weighting scheme for combining beam probs as the beam model
+        p += pz * pz * pz;
+    }
+
+    return p;
+}
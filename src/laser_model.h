@@ -1,14 +1,52 @@
 #ifndef ED_LOCALIZATION_LASER_MODEL_H_
 #define ED_LOCALIZATION_LASER_MODEL_H_
 
+#include "beam_kernel.h"
+#include "cross_section_cache.h"
+#include "flat_hash_map.h"
+#include "likelihood_field.h"
+#include "map_artifacts.h"
+#include "opencl_beam_model.h"
+#include "segment_grid.h"
+#include "stage_profiler.h"
+#include "worker_pool.h"
+
 #include <ed/types.h>
-#include <geolib/sensors/LaserRangeFinder.h>
+#include <geolib/datatypes.h>
 
 #include <tue/config/configuration.h>
 
 #include <sensor_msgs/LaserScan.h>
 
 class ParticleFilter;
+struct SampleSet;
+
+// Storage type of the hot data of the beam model (sensor ranges, model ranges and lookup tables),
+// selected at compile time with the ED_LOCALIZATION_LASER_PRECISION CMake option (see BeamPrecision)
+#if defined(ED_LOCALIZATION_LASER_PRECISION_FIXED16)
+typedef uint16_t BeamRange;
+#elif defined(ED_LOCALIZATION_LASER_PRECISION_FLOAT)
+typedef float BeamRange;
+#else
+typedef double BeamRange;
+#endif
+
+// Lines of the cross section that can be seen from the samples, and a spatial index over them, such that
+// for each sample only the lines within sensor range have to be rendered. Shared by all laser models that
+// are updated together.
+struct VisibleLines
+{
+    VisibleLines() : indexed(false) {}
+
+    std::vector<geo::Vec2> start;
+    std::vector<geo::Vec2> end;
+
+    // Only built if 'indexed' is set
+    SegmentGrid grid;
+    bool indexed;
+};
+
+// ----------------------------------------------------------------------------------------------------
 
 class LaserModel
 {
@@ -21,25 +59,106 @@ public:
 
     void configure(tue::Configuration config);
 
-    void updateWeights(const ed::WorldModel& world, const sensor_msgs::LaserScan& scan, ParticleFilter& pf);
+    // Updates the sample weights based on the scan and the (up-to-date) world model cross section
+    void updateWeights(const CrossSectionCache& cross_section, const sensor_msgs::LaserScan& scan, ParticleFilter& pf);
+
+    // Updates the sample weights based on the scans of multiple laser models (e.g., a front and a rear laser),
+    // as if the scans were independent measurements. The unique samples are determined once, all models render
+    // the same selection of the cross section (indexed once), and every unique sample is scored against all
+    // scans in one pass. Each model selects its own beams. Models of which the scan is null are skipped.
+    // The unique sample thresholds, segment grid cell size, threads and profiler of the first model are used.
+    static void updateWeights(const std::vector<LaserModel*>& models, const std::vector<const sensor_msgs::LaserScan*>& scans,
+                              const CrossSectionCache& cross_section, ParticleFilter& pf);
 
-    const std::vector<geo::Vec2>& lines_start() const { return lines_start_; }
-    const std::vector<geo::Vec2>& lines_end() const { return lines_end_; }
+    // Finds the samples that are further apart than min_particle_distance / min_particle_rotation_distance.
+    // Every sample is mapped to the first unique sample (index in 'unique_samples') within these thresholds.
+    void findUniqueSamples(const SampleSet& samples, std::vector<unsigned int>& unique_samples,
+                           std::vector<unsigned int>& sample_to_unique) const;
 
-    const geo::LaserRangeFinder& renderer() const { return lrf_; }
+    // Calculates the end points of the valid (not max-range) beams of the scan, in the robot frame
+    void calculateScanPoints(const sensor_msgs::LaserScan& scan, std::vector<geo::Vec2>& points) const;
+
+    // Lines that were rendered during the last update
+    const std::vector<geo::Vec2>& lines_start() const { return lines_->start; }
+    const std::vector<geo::Vec2>& lines_end() const { return lines_->end; }
+
+    // Ranges and directions (in the laser frame) of the beams that were used for the last update
     const std::vector<double>& sensor_ranges() const { return sensor_ranges_; }
+    const std::vector<geo::Vec2>& beam_dirs() const { return beam_dirs_; }
 
     const geo::Transform2& laser_offset() const { return laser_offset_; }
 
+    // True if the beam model weights are calculated with OpenCL ('backend: opencl')
+    bool usesOpenCL() const { return use_opencl_; }
+
+    // Why the configured backend is not used (the CPU is used instead). Empty if it is used.
+    const std::string& backendError() const { return backend_error_; }
+
+    enum Backend
+    {
+        CPU_BACKEND,
+        OPENCL_HOST_BACKEND,  // The OpenCL kernel, run on the host (see OpenCLBeamModel::calculateLogLikelihoodsOnHost)
+        OPENCL_BACKEND
+    };
+
+    // Calculates the log likelihood of every sample pose for the beams and lines of the last update, with the
+    // given backend instead of the configured one, to compare the backends. Returns false, with the reason in
+    // 'error', if the backend is not available. Only implemented for the beam model.
+    bool calculateLogLikelihoods(const std::vector<geo::Transform2>& sample_poses, Backend backend,
+                                 std::vector<double>& log_likelihoods, std::string& error);
+
+    double laser_height() const { return laser_height_; }
+
+    // If set, the durations of the laser model stages and its counters are recorded
+    void setProfiler(StageProfiler* profiler) { profiler_ = profiler; }
+
+    // If set, the likelihood field of the startup cross section is taken from (or added to) the given slot of
+    // the artifacts. Every laser model needs its own slot.
+    void setArtifacts(MapArtifacts* artifacts, const std::string& slot = "laser_model")
+    {
+        artifacts_ = artifacts;
+        artifacts_slot_ = slot;
+    }
+
     void setLaserOffset(const geo::Transform2& offset, double height, bool upside_down)
     {
         laser_offset_ = offset;
         laser_height_ = height;
         laser_upside_down_ = upside_down;
+        scan_offset_ = scan_motion_ * laser_offset_;
+    }
+
+    // Motion of the robot from the pose of the samples to its pose at the stamp of the scan (e.g., if the scan
+    // is fused into the update of another laser). Identity by default.
+    void setScanMotion(const geo::Transform2& motion)
+    {
+        scan_motion_ = motion;
+        scan_offset_ = scan_motion_ * laser_offset_;
     }
 
 private:
 
+    enum ModelType
+    {
+        BEAM_MODEL,
+        LIKELIHOOD_FIELD
+    };
+
+    ModelType type_;
+
+    enum BeamSelection
+    {
+        UNIFORM_BEAMS,
+        ADAPTIVE_BEAMS
+    };
+
+    BeamSelection beam_selection_;
+
+    StageProfiler* profiler_;
+
+    MapArtifacts* artifacts_;
+    std::string artifacts_slot_;
+
     double z_hit;
     double sigma_hit;
     double z_short;
@@ -52,21 +171,202 @@ private:
     geo::Transform2 laser_offset_;
     bool laser_upside_down_;
 
+    // Pose of the laser at the stamp of the scan, relative to the sample pose (scan_motion_ * laser_offset_)
+    geo::Transform2 scan_motion_;
+    geo::Transform2 scan_offset_;
+
     int num_beams;
 
     double min_particle_distance_;
     double min_particle_rotation_distance_;
 
     // CACHING
-    std::vector<double> exp_hit_;
-    std::vector<double> exp_short_;
+    std::vector<BeamPrecision<BeamRange>::Table> exp_hit_;
+    std::vector<BeamPrecision<BeamRange>::Table> exp_short_;
+
+    // Sensor ranges in the representation used by the beam model
+    std::vector<BeamRange> beam_sensor_ranges_;
+
+    // BEAM SELECTION
+
+    // Angles and directions (in the laser frame) of all beams of the scan, in model order: if the laser
+    // is upside down, model beam i measures scan.ranges[n - 1 - i] (the laser offset mirrors it back).
+    // Only rebuilt if the scan geometry changes.
+    std::vector<double> scan_angles_;
+    std::vector<geo::Vec2> scan_dirs_;
+    double scan_angle_min_;
+    double scan_angle_increment_;
+
+    // Indices (in model order) of the beams of the uniform selection, and of the beams used for this scan
+    std::vector<unsigned int> uniform_beams_;
+    std::vector<unsigned int> selected_beams_;
+
+    void updateScanTables(const sensor_msgs::LaserScan& scan);
+
+    // Adaptive selection: (likelihood field value of the end point, beam index) for every beam that hits
+    // something, and per beam whether it was selected or lies too close to a selected beam
+    enum BeamState
+    {
+        BEAM_FREE,
+        BEAM_BLOCKED,
+        BEAM_SELECTED
+    };
+
+    std::vector<std::pair<double, unsigned int> > beam_values_;
+    std::vector<unsigned char> beam_states_;
+
+    // The likelihood field model scores the end points with its likelihood field. The beam model does not need
+    // a likelihood field, so it uses the distance to the nearest line of the cross section instead, for which
+    // all lines are indexed (once per cross section revision).
+    VisibleLines selection_lines_;
+    unsigned long selection_lines_revision_;
+    SegmentGrid::Query selection_query_;
+    std::vector<unsigned int> selection_segment_indices_;
+
+    void updateSelectionLines(const CrossSectionCache& cross_section);
+
+    // Adaptive selection score of a beam end point (in the map frame): the higher, the closer it lies to map structure
+    double endPointScore(const geo::Vec2& p);
+
+    // Selects at most num_beams beams of the scan, and fills the sensor ranges and beam tables with them.
+    // Adaptive selection takes the beams of which the end points (seen from the best pose estimate) lie
+    // closest to map structure, at least half the uniform spacing apart.
+    void selectBeams(const CrossSectionCache& cross_section, const sensor_msgs::LaserScan& scan, const ParticleFilter& pf);
 
     // RENDERING
-    geo::LaserRangeFinder lrf_;
 
-    // Visualization
-    std::vector<geo::Vec2> lines_start_;
-    std::vector<geo::Vec2> lines_end_;
+    // Angles (increasing, unwrapped) and directions in the laser frame of the selected beams
+    std::vector<double> beam_angles_;
+    std::vector<geo::Vec2> beam_dirs_;
+
+    // Renders a line (in the laser frame) into the model ranges: for every beam that hits
+    // the line, the range is set to the hit distance if that is closer than the current range
+    void renderLine(const geo::Vec2& p1, const geo::Vec2& p2, std::vector<BeamRange>& model_ranges) const;
+
+    // UNIQUE SAMPLES: quantized (x, y, rotation) cell used to hash the samples
+    struct SampleCell
+    {
+        int x, y, a;
+
+        bool operator==(const SampleCell& other) const { return x == other.x && y == other.y && a == other.a; }
+    };
+
+    struct SampleCellHash
+    {
+        std::size_t operator()(const SampleCell& c) const
+        {
+            return (std::size_t)c.x * 73856093u ^ (std::size_t)c.y * 19349663u ^ (std::size_t)c.a * 83492791u;
+        }
+    };
+
+    typedef FlatHashMap<SampleCell, int, SampleCellHash> SampleCellMap;
+
+    // Scratch space of findUniqueSamples
+    mutable SampleCellMap unique_cells_;
+    mutable std::vector<int> unique_next_;
+
+    // Scratch space of the update (of the first model), kept between updates such that the steady-state
+    // update does not allocate
+    std::vector<LaserModel*> single_models_;
+    std::vector<const sensor_msgs::LaserScan*> single_scans_;
+    std::vector<LaserModel*> active_models_;
+    std::vector<unsigned int> unique_samples_;
+    std::vector<unsigned int> sample_to_unique_;
+    std::vector<geo::Transform2> unique_poses_;
+    std::vector<double> weight_updates_;
+
+    // MULTI-THREADING
+    WorkerPool workers_;
+    std::vector<std::vector<BeamRange> > thread_model_ranges_;
+    std::vector<SegmentGrid::Query> thread_segment_queries_;
+    std::vector<std::vector<unsigned int> > thread_segment_indices_;
+
+    // SPATIAL INDEX over the selected lines, such that for each sample only the lines within
+    // sensor range have to be rendered. If the cell size is 0, all lines are rendered.
+    double segment_grid_cell_size_;
+
+    // Lines selected by this model, and the lines rendered during the update (which may be selected by
+    // another model that is updated together with this one)
+    VisibleLines visible_lines_;
+    const VisibleLines* lines_;
+
+    // Field of view and render range of the sensor (used to query the segment grid). Lines closer than the
+    // minimum range of the sensor are not rendered.
+    double angle_min_;
+    double angle_max_;
+    double range_min_;
+    double render_range_;
+
+    // Calculates the axis-aligned bounding box of the area the sensor can see from the given pose
+    void calculateSensorBoundingBox(const geo::Transform2& laser_pose, geo::Vec2& min, geo::Vec2& max) const;
+
+    // Renders the expected ranges of the selected beams from the laser pose, using the given buffers. If
+    // use_grid is set, only the lines that the segment grid returns for the sensor area are rendered.
+    void renderModelRanges(const geo::Transform2& laser_pose, bool use_grid, std::vector<BeamRange>& model_ranges,
+                           SegmentGrid::Query& segment_query, std::vector<unsigned int>& segment_indices) const;
+
+    // Calculates the weight update for a single sample pose, using the given buffers
+    double calculateWeightUpdate(const geo::Transform2& sample_pose,
+                                 std::vector<BeamRange>& model_ranges, SegmentGrid::Query& segment_query,
+                                 std::vector<unsigned int>& segment_indices) const;
+
+    // True if the model renders the expected ranges (the beam model, or dynamic obstacle rejection)
+    bool rendersLines() const;
+
+    // Selects the lines of the cross section that can be seen by any of the models from the samples, indexes
+    // them, and lets all models render them
+    void selectVisibleLines(const std::vector<LaserModel*>& models, const CrossSectionCache& cross_section,
+                            const ParticleFilter& pf);
+
+    // Calculates the log likelihood of every unique sample pose for the scans of all models, in one pass
+    void calculateWeights(const std::vector<LaserModel*>& models, const std::vector<geo::Transform2>& unique_poses,
+                          std::vector<double>& weight_updates);
+
+    // OPENCL BACKEND: if enabled, the beam model is evaluated on an OpenCL device, and the log likelihoods of the
+    // unique samples are added during the CPU pass. If the device fails, the CPU is used from then on.
+    bool use_opencl_;
+    std::string backend_error_;
+    OpenCLBeamModel opencl_;
+    std::vector<double> opencl_log_likelihoods_;
+
+    OpenCLBeamModelParams openCLParams() const;
+
+    void calculateOpenCLWeights(const std::vector<geo::Transform2>& unique_poses);
+
+    // DYNAMIC OBSTACLES: beams that are at least dynamic_obstacle_distance_ shorter than the expected ranges
+    // from the best pose are removed before scoring (0 = disabled)
+    double dynamic_obstacle_distance_;
+    unsigned int num_dynamic_beams_;
+    std::vector<bool> dynamic_beams_;
+    std::vector<BeamRange> dynamic_model_ranges_;
+    SegmentGrid::Query dynamic_segment_query_;
+    std::vector<unsigned int> dynamic_segment_indices_;
+
+    void rejectDynamicBeams(const ParticleFilter& pf);
+
+    // Converts the remaining beams to the representation that the model scores (sensor ranges or end points)
+    void calculateBeamData();
+
+    // LIKELIHOOD FIELD
+    LikelihoodField likelihood_field_;
+    double likelihood_field_resolution_;
+    double likelihood_field_max_distance_;
+
+    // Revision of the cross section that was used to build the likelihood field
+    unsigned long likelihood_field_revision_;
+
+    // End points of the sensor beams in the laser frame (only the beams that hit something)
+    std::vector<geo::Vec2> beam_points_;
+
+    // Number of sensor beams that are reported as max-range
+    int num_max_range_beams_;
+
+    // Rebuilds the likelihood field if the cross section changed
+    void updateLikelihoodField(const CrossSectionCache& cross_section);
+
+    double calculateLikelihoodFieldWeightUpdate(const geo::Transform2& sample_pose) const;
+
+    // Sensor ranges of the selected beams (also used for visualization)
     std::vector<double> sensor_ranges_;
 
 };
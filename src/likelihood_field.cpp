@@ -0,0 +1,183 @@
+#include "likelihood_field.h"
+
+#include <algorithm>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+const float INF = 1e20;
+
+// One dimensional squared Euclidean distance transform of a sampled function (Felzenszwalb and
+// Huttenlocher, 2012). f: input (0 for occupied, INF for free), d: output, v and z: workspace.
+void distanceTransform1D(const float* f, int n, float* d, int* v, float* z)
+{
+    int k = 0;
+    v[0] = 0;
+    z[0] = -INF;
+    z[1] = INF;
+
+    for(int q = 1; q < n; ++q)
+    {
+        float s = ((f[q] + q * q) - (f[v[k]] + v[k] * v[k])) / (2 * q - 2 * v[k]);
+        while (s <= z[k])
+        {
+            --k;
+            s = ((f[q] + q * q) - (f[v[k]] + v[k] * v[k])) / (2 * q - 2 * v[k]);
+        }
+
+        ++k;
+        v[k] = q;
+        z[k] = s;
+        z[k + 1] = INF;
+    }
+
+    k = 0;
+    for(int q = 0; q < n; ++q)
+    {
+        while (z[k + 1] < q)
+            ++k;
+
+        float diff = q - v[k];
+        d[q] = diff * diff + f[v[k]];
+    }
+}
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+LikelihoodField::LikelihoodField() : resolution_(0), inv_resolution_(0), width_(0), height_(0), outside_value_(0)
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+LikelihoodField::~LikelihoodField()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LikelihoodField::build(const std::vector<geo::Vec2>& lines_start, const std::vector<geo::Vec2>& lines_end,
+                            double resolution, double max_distance, double z_hit, double sigma_hit, double z_rand)
+{
+    resolution_ = resolution;
+    inv_resolution_ = 1.0 / resolution;
+    outside_value_ = z_hit * std::exp(-(max_distance * max_distance) / (2 * sigma_hit * sigma_hit)) + z_rand;
+
+    cells_.clear();
+    width_ = 0;
+    height_ = 0;
+
+    if (lines_start.empty())
+        return;
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Determine grid bounds
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+    geo::Vec2 p_min(1e9, 1e9);
+    geo::Vec2 p_max(-1e9, -1e9);
+    for(unsigned int i = 0; i < lines_start.size(); ++i)
+    {
+        const geo::Vec2& p1 = lines_start[i];
+        const geo::Vec2& p2 = lines_end[i];
+        p_min.x = std::min(p_min.x, std::min(p1.x, p2.x));
+        p_min.y = std::min(p_min.y, std::min(p1.y, p2.y));
+        p_max.x = std::max(p_max.x, std::max(p1.x, p2.x));
+        p_max.y = std::max(p_max.y, std::max(p1.y, p2.y));
+    }
+
+    // Add a border of max_distance, such that the grid covers everything that is closer than
+    // max_distance to a line
+    origin_ = p_min - geo::Vec2(max_distance, max_distance);
+    width_ = (p_max.x - p_min.x + 2 * max_distance) * inv_resolution_ + 1;
+    height_ = (p_max.y - p_min.y + 2 * max_distance) * inv_resolution_ + 1;
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Rasterize lines
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+    std::vector<float> dist_sq(width_ * height_, INF);
+
+    for(unsigned int i = 0; i < lines_start.size(); ++i)
+    {
+        const geo::Vec2& p1 = lines_start[i];
+        geo::Vec2 diff = lines_end[i] - p1;
+
+        // Step with half the resolution to make sure no cell is skipped
+        int n = diff.length() * 2 * inv_resolution_ + 1;
+        geo::Vec2 step = diff / n;
+
+        geo::Vec2 p = p1;
+        for(int j = 0; j <= n; ++j)
+        {
+            int mx = (p.x - origin_.x) * inv_resolution_;
+            int my = (p.y - origin_.y) * inv_resolution_;
+            if (mx >= 0 && my >= 0 && mx < width_ && my < height_)
+                dist_sq[my * width_ + mx] = 0;
+            p += step;
+        }
+    }
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Calculate (squared) distance transform
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+    int n_max = std::max(width_, height_);
+    std::vector<float> f(n_max);
+    std::vector<float> d(n_max);
+    std::vector<int> v(n_max);
+    std::vector<float> z(n_max + 1);
+
+    // Columns
+    for(int x = 0; x < width_; ++x)
+    {
+        for(int y = 0; y < height_; ++y)
+            f[y] = dist_sq[y * width_ + x];
+
+        distanceTransform1D(&f[0], height_, &d[0], &v[0], &z[0]);
+
+        for(int y = 0; y < height_; ++y)
+            dist_sq[y * width_ + x] = d[y];
+    }
+
+    // Rows
+    for(int y = 0; y < height_; ++y)
+    {
+        float* row = &dist_sq[y * width_];
+        std::copy(row, row + width_, f.begin());
+        distanceTransform1D(&f[0], width_, row, &v[0], &z[0]);
+    }
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Convert distances to likelihoods
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+    double max_dist_sq = max_distance * max_distance;
+    double res_sq = resolution_ * resolution_;
+    double factor = -1.0 / (2 * sigma_hit * sigma_hit);
+
+    cells_.resize(dist_sq.size());
+    for(unsigned int i = 0; i < dist_sq.size(); ++i)
+    {
+        double d_sq = std::min<double>(dist_sq[i] * res_sq, max_dist_sq);
+        cells_[i] = z_hit * std::exp(factor * d_sq) + z_rand;
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LikelihoodField::assign(const geo::Vec2& origin, double resolution, int width, int height, float outside_value,
+                             const float* cells)
+{
+    origin_ = origin;
+    resolution_ = resolution;
+    inv_resolution_ = 1.0 / resolution;
+    width_ = width;
+    height_ = height;
+    outside_value_ = outside_value;
+    cells_.assign(cells, cells + width * height);
+}
@@ -0,0 +1,71 @@
+#ifndef ED_LOCALIZATION_LIKELIHOOD_FIELD_H_
+#define ED_LOCALIZATION_LIKELIHOOD_FIELD_H_
+
+#include <geolib/datatypes.h>
+
+#include <cmath>
+#include <vector>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Grid in the map frame that stores for every cell the likelihood of a beam ending in that cell. The
+// likelihood is based on the distance to the closest line of the world model cross section:
+//
+//     z_hit * exp(-d^2 / (2 * sigma_hit^2)) + z_rand
+//
+// with d clamped at max_distance. Points outside the grid get the likelihood at max_distance.
+class LikelihoodField
+{
+
+public:
+
+    LikelihoodField();
+
+    ~LikelihoodField();
+
+    void build(const std::vector<geo::Vec2>& lines_start, const std::vector<geo::Vec2>& lines_end,
+               double resolution, double max_distance, double z_hit, double sigma_hit, double z_rand);
+
+    // Sets the grid from stored cell values (e.g., from a file), instead of building it
+    void assign(const geo::Vec2& origin, double resolution, int width, int height, float outside_value, const float* cells);
+
+    inline double value(const geo::Vec2& p) const
+    {
+        int mx = std::floor((p.x - origin_.x) * inv_resolution_);
+        int my = std::floor((p.y - origin_.y) * inv_resolution_);
+
+        if (mx < 0 || my < 0 || mx >= width_ || my >= height_)
+            return outside_value_;
+
+        return cells_[my * width_ + mx];
+    }
+
+    // Value of cell (mx, my), which must lie within the grid
+    inline float cellValue(int mx, int my) const { return cells_[my * width_ + mx]; }
+
+    float outsideValue() const { return outside_value_; }
+
+    bool empty() const { return cells_.empty(); }
+
+    // Cell values, row-major
+    const float* data() const { return cells_.data(); }
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+    double resolution() const { return resolution_; }
+    const geo::Vec2& origin() const { return origin_; }
+
+private:
+
+    geo::Vec2 origin_;
+    double resolution_;
+    double inv_resolution_;
+    int width_;
+    int height_;
+
+    std::vector<float> cells_;
+    float outside_value_;
+
+};
+
+#endif
@@ -2,6 +2,7 @@
 
 #include <ros/node_handle.h>
 #include <ros/subscribe_options.h>
+#include <ros/advertise_service_options.h>
 
 #include <ed/world_model.h>
 #include <ed/entity.h>
@@ -14,21 +15,50 @@
 #include <geolib/ros/msg_conversions.h>
 #include <geolib/ros/tf_conversions.h>
 
-#include <geometry_msgs/PoseArray.h>
+#include <tf2_msgs/TFMessage.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
+
+#include <sstream>
 
 #include <ed/update_request.h>
 
 // ----------------------------------------------------------------------------------------------------
 
-LocalizationPlugin::LocalizationPlugin() : have_previous_pose_(false), laser_offset_initialized_(false),
+namespace
+{
+
+// Frame ids may or may not have a leading slash
+inline std::string stripSlash(const std::string& frame_id)
+{
+    return (!frame_id.empty() && frame_id[0] == '/') ? frame_id.substr(1) : frame_id;
+}
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+LocalizationPlugin::LocalizationPlugin() : artifacts_save_done_(false), artifacts_save_ok_(true), have_previous_pose_(false), global_search_revision_(0),
+    global_localization_requested_(false), global_search_done_(false), global_search_rebuild_(false), global_search_artifacts_(0), global_search_duration_(0),
+    particles_publish_rate_(0), max_published_particles_(0),
+    laser_offset_initialized_(false), max_scan_buffer_size_(0), update_min_d_(0), update_min_a_(0), update_every_n_scans_(0),
+    num_skipped_scans_(0), force_update_(true), have_map_to_odom_(false),
+    async_(false), stop_localization_thread_(false), cross_section_snapshot_revision_(0),
+    laser_height_known_(false), laser_height_(0), have_async_pose_(false), diagnostics_period_(1),
     tf_listener_(0), tf_broadcaster_(0)
 {
+    laser_model_.setProfiler(&profiler_);
 }
 
 // ----------------------------------------------------------------------------------------------------
 
 LocalizationPlugin::~LocalizationPlugin()
 {
+    stopLocalizationThread();
+    stopGlobalLocalization();
+
+    // Artifacts that were added after the last save (or during it) are stored now
+    if (finishArtifactsSave() && !artifacts_file_.empty() && artifacts_.modified())
+        saveArtifacts();
 
     // Get transform between map and odom frame
     try
@@ -64,6 +94,10 @@ void LocalizationPlugin::configure(tue::Configuration config)
     if (!tf_broadcaster_)
         tf_broadcaster_ = new tf::TransformBroadcaster;
 
+    // The filter and models are (re)configured below, so make sure the localization and search threads are not running
+    stopLocalizationThread();
+    stopGlobalLocalization();
+
     std::string laser_topic;
 
     if (config.readGroup("odom_model", tue::config::REQUIRED))
@@ -81,21 +115,179 @@ void LocalizationPlugin::configure(tue::Configuration config)
         config.value("topic", laser_topic);
         laser_model_.configure(config);
         config.endGroup();
+
+        if (!laser_model_.backendError().empty())
+            ROS_WARN_STREAM("[ED Localization] Laser model backend not available (" << laser_model_.backendError()
+                            << "), using the CPU");
+    }
+
+    // Each additional laser has the same configuration as the main laser model, so it has its own beam
+    // selection and number of beams
+    additional_lasers_.clear();
+    if (config.readArray("additional_laser_models", tue::config::OPTIONAL))
+    {
+        while(config.nextArrayItem())
+        {
+            std::unique_ptr<AdditionalLaser> laser(new AdditionalLaser);
+            config.value("topic", laser->topic);
+            config.value("max_time_difference", laser->max_time_difference, tue::config::OPTIONAL);
+            laser->model.configure(config);
+
+            if (!laser->model.backendError().empty())
+                ROS_WARN_STREAM("[ED Localization] Laser model backend of '" << laser->topic << "' not available ("
+                                << laser->model.backendError() << "), using the CPU");
+
+            additional_lasers_.push_back(std::move(laser));
+        }
+        config.endArray();
+    }
+
+    // Precomputed map artifacts (cross section and likelihood fields), such that they do not have to be
+    // rebuilt on every startup. New artifacts are written to the file after the filter updates.
+    finishArtifactsSave();
+    artifacts_file_.clear();
+    MapArtifacts* artifacts = 0;
+    if (config.value("map_artifacts_file", artifacts_file_, tue::config::OPTIONAL))
+    {
+        std::string error;
+        if (artifacts_.load(artifacts_file_, error))
+            ROS_INFO_STREAM("[ED Localization] Loaded map artifacts from '" << artifacts_file_ << "'");
+        else
+            ROS_INFO_STREAM("[ED Localization] No map artifacts loaded (" << error << "), they will be rebuilt");
+
+        artifacts = &artifacts_;
+    }
+
+    cross_section_.setArtifacts(artifacts);
+    laser_model_.setArtifacts(artifacts);
+    for(unsigned int i = 0; i < additional_lasers_.size(); ++i)
+        additional_lasers_[i]->model.setArtifacts(artifacts, "laser_model:" + additional_lasers_[i]->topic);
+
+    int max_particles = 0;
+    if (config.value("max_particles", max_particles, tue::config::OPTIONAL))
+    {
+        // KLD-sampling: the number of particles adapts between min_particles and max_particles
+        int min_particles = 100;
+        double kld_err = 0.01;
+        double kld_z = 2.33;
+        double kld_bin_size = 0.5;
+        double kld_bin_size_rotation = 0.17;
+        config.value("min_particles", min_particles, tue::config::OPTIONAL);
+        config.value("kld_err", kld_err, tue::config::OPTIONAL);
+        config.value("kld_z", kld_z, tue::config::OPTIONAL);
+        config.value("kld_bin_size", kld_bin_size, tue::config::OPTIONAL);
+        config.value("kld_bin_size_rotation", kld_bin_size_rotation, tue::config::OPTIONAL);
+
+        particle_filter_.enableKLDSampling(std::max(1, min_particles), std::max(1, max_particles), kld_err, kld_z,
+                                           kld_bin_size, kld_bin_size_rotation);
+
+        num_particles_ = max_particles;
+    }
+    else
+    {
+        config.value("num_particles", num_particles_);
+        particle_filter_.disableKLDSampling();
     }
 
-    config.value("num_particles", num_particles_);
+    // Seed of the random number generator of the particle filter (used for the motion noise and resampling)
+    int seed = 0;
+    config.value("seed", seed, tue::config::OPTIONAL);
+    particle_filter_.setSeed(seed);
+
+    std::string resample_method = "deterministic";
+    config.value("resample_method", resample_method, tue::config::OPTIONAL);
+    if (resample_method == "deterministic")
+        particle_filter_.setResampleMethod(ParticleFilter::RESAMPLE_DETERMINISTIC);
+    else if (resample_method == "systematic")
+        particle_filter_.setResampleMethod(ParticleFilter::RESAMPLE_SYSTEMATIC);
+    else if (resample_method == "stratified")
+        particle_filter_.setResampleMethod(ParticleFilter::RESAMPLE_STRATIFIED);
+    else if (resample_method == "residual")
+        particle_filter_.setResampleMethod(ParticleFilter::RESAMPLE_RESIDUAL);
+    else
+        config.addError("Unknown resample method: '" + resample_method + "' (options: 'deterministic', 'systematic', 'stratified', 'residual')");
+
+    // Size of the (x, y, rotation) bins used to cluster the particles. Particles in neighboring bins
+    // belong to the same cluster.
+    double cluster_bin_size = 0.25;
+    double cluster_bin_size_rotation = 0.2;
+    config.value("cluster_bin_size", cluster_bin_size, tue::config::OPTIONAL);
+    config.value("cluster_bin_size_rotation", cluster_bin_size_rotation, tue::config::OPTIONAL);
+    if (cluster_bin_size <= 0 || cluster_bin_size_rotation <= 0)
+        config.addError("cluster_bin_size and cluster_bin_size_rotation must be positive");
+    else
+        particle_filter_.setClusterBinSize(cluster_bin_size, cluster_bin_size_rotation);
+
+    // Scan buffering and update policy
+    int scan_buffer_size = 0;
+    config.value("scan_buffer_size", scan_buffer_size, tue::config::OPTIONAL);
+    max_scan_buffer_size_ = std::max(0, scan_buffer_size);
+
+    update_min_d_ = 0;
+    update_min_a_ = 0;
+    config.value("update_min_d", update_min_d_, tue::config::OPTIONAL);
+    config.value("update_min_a", update_min_a_, tue::config::OPTIONAL);
+
+    int update_every_n_scans = 0;
+    config.value("update_every_n_scans", update_every_n_scans, tue::config::OPTIONAL);
+    update_every_n_scans_ = std::max(0, update_every_n_scans);
+
+    // Only resample if the effective sample size drops below this ratio of the number of particles (1 = always)
+    double resample_threshold = 1;
+    config.value("resample_threshold", resample_threshold, tue::config::OPTIONAL);
+    particle_filter_.setResampleThreshold(resample_threshold);
+
+    // If async is set, the filter is updated on a separate thread instead of in ED's process() call
+    int async = 0;
+    config.value("async", async, tue::config::OPTIONAL);
+    async_ = (async != 0);
+
+    int async_queue_size = 4;
+    config.value("async_queue_size", async_queue_size, tue::config::OPTIONAL);
+    async_scan_queue_.setCapacity(std::max(1, async_queue_size));
+
+    // In async mode, the scans are buffered in the async queue, so the only buffer option is to skip to the newest scan
+    if (async_ && max_scan_buffer_size_ > 1)
+        config.addError("In async mode, scan_buffer_size must be 0 or 1 (use async_queue_size to size the queue)");
 
     if (config.hasError())
         return;
 
+    // Odometry buffer: odom -> base_link transforms taken directly from /tf, such that the odometry at a
+    // scan stamp can be looked up without tf (0 = always use tf)
+    int odom_buffer_size = 1000;
+    config.value("odom_buffer_size", odom_buffer_size, tue::config::OPTIONAL);
+    odom_buffer_.setCapacity(std::max(0, odom_buffer_size));
+
     ros::NodeHandle nh;
 
+    if (odom_buffer_.capacity() > 0)
+    {
+        ros::SubscribeOptions tf_sub_options =
+                ros::SubscribeOptions::create<tf2_msgs::TFMessage>(
+                    "/tf", 100, boost::bind(&LocalizationPlugin::tfCallback, this, _1), ros::VoidPtr(), &cb_queue_);
+        sub_tf_ = nh.subscribe(tf_sub_options);
+    }
+    else
+    {
+        sub_tf_.shutdown();
+    }
+
     // Subscribe to laser topic
     ros::SubscribeOptions sub_options =
             ros::SubscribeOptions::create<sensor_msgs::LaserScan>(
                 laser_topic, 1, boost::bind(&LocalizationPlugin::laserCallback, this, _1), ros::VoidPtr(), &cb_queue_);
     sub_laser_ = nh.subscribe(sub_options);
 
+    for(unsigned int i = 0; i < additional_lasers_.size(); ++i)
+    {
+        AdditionalLaser& laser = *additional_lasers_[i];
+        ros::SubscribeOptions additional_sub_options =
+                ros::SubscribeOptions::create<sensor_msgs::LaserScan>(
+                    laser.topic, 1, boost::bind(&LocalizationPlugin::additionalLaserCallback, this, _1, i), ros::VoidPtr(), &cb_queue_);
+        laser.sub = nh.subscribe(additional_sub_options);
+    }
+
     std::string initial_pose_topic;
     if (config.value("initial_pose_topic", initial_pose_topic, tue::config::OPTIONAL))
     {
@@ -162,9 +354,55 @@ void LocalizationPlugin::configure(tue::Configuration config)
     particle_filter_.initUniform(p - geo::Vec2(0.3, 0.3), p + geo::Vec2(0.3, 0.3), 0.05,
                                  yaw - 0.1, yaw + 0.1, 0.05);
 
+    if (config.readGroup("global_localization", tue::config::OPTIONAL))
+    {
+        global_search_.configure(config);
+
+        // Localize globally on the first scan, instead of around the initial pose
+        int on_startup = 0;
+        config.value("on_startup", on_startup, tue::config::OPTIONAL);
+        if (on_startup)
+            global_localization_requested_ = true;
+
+        config.endGroup();
+    }
+
+    ros::AdvertiseServiceOptions srv_opts = ros::AdvertiseServiceOptions::create<std_srvs::Empty>(
+                "ed/localization/global_localization", boost::bind(&LocalizationPlugin::globalLocalizationCallback, this, _1, _2),
+                ros::VoidPtr(), &cb_queue_);
+    srv_global_localization_ = nh.advertiseService(srv_opts);
+
     config.value("robot_name", robot_name_);
 
+    if (robot_name_.empty())
+    {
+        map_to_odom_channel_.reset();
+        odom_channel_.reset();
+    }
+    else
+    {
+        map_to_odom_channel_ = PoseChannel::mapToOdom(robot_name_);
+        odom_channel_ = PoseChannel::odometry(robot_name_);
+    }
+
     pub_particles_ = nh.advertise<geometry_msgs::PoseArray>("ed/localization/particles", 10);
+    pub_particle_set_ = nh.advertise<ed_localization::ParticleSet>("ed/localization/particle_set", 10);
+    pub_pose_ = nh.advertise<geometry_msgs::PoseWithCovarianceStamped>("ed/localization/pose", 10);
+
+    particles_publish_rate_ = 0;
+    config.value("particles_publish_rate", particles_publish_rate_, tue::config::OPTIONAL);
+
+    int max_published_particles = 0;
+    config.value("max_published_particles", max_published_particles, tue::config::OPTIONAL);
+    max_published_particles_ = std::max(0, max_published_particles);
+
+    diagnostics_period_ = 1;
+    config.value("diagnostics_period", diagnostics_period_, tue::config::OPTIONAL);
+    pub_diagnostics_ = nh.advertise<diagnostic_msgs::DiagnosticArray>("ed/localization/diagnostics", 1);
+    last_diagnostics_time_ = StageProfiler::Clock::now();
+
+    if (async_)
+        startLocalizationThread();
 }
 
 // ----------------------------------------------------------------------------------------------------
@@ -180,23 +418,64 @@ void LocalizationPlugin::process(const ed::WorldModel& world, ed::UpdateRequest&
     initial_pose_msg_.reset();
     cb_queue_.callAvailable();
 
-    if (initial_pose_msg_)
+    if (async_)
     {
-        // Set initial pose
+        processAsync(world, req);
+        return;
+    }
 
-        geo::Vec2 p(initial_pose_msg_->pose.pose.position.x, initial_pose_msg_->pose.pose.position.y);
+    if (initial_pose_msg_)
+        setInitialPose(*initial_pose_msg_);
 
-        double yaw = tf::getYaw(initial_pose_msg_->pose.pose.orientation);
+    if (scan_buffer_.empty())
+        return;
 
-        particle_filter_.initUniform(p - geo::Vec2(0.3, 0.3), p + geo::Vec2(0.3, 0.3), 0.05,
-                                     yaw - 0.1, yaw + 0.1, 0.05);
-    }
+    // Resolve the odometry at the stamps of all buffered scans at once
+    StageProfiler::Clock::time_point t_lookup = StageProfiler::Clock::now();
+
+    std::vector<ros::Time>& stamps = scan_stamps_;
+    stamps.resize(scan_buffer_.size());
+    for(unsigned int i = 0; i < scan_buffer_.size(); ++i)
+        stamps[i] = scan_buffer_[i]->header.stamp;
+
+    std::vector<geo::Pose3D>& odom_poses = scan_odom_poses_;
+    std::vector<TransformStatus>& odom_status = scan_odom_status_;
+    lookupOdom(stamps, odom_poses, odom_status);
+
+    profiler_.recordSince(StageProfiler::TF_LOOKUP, t_lookup);
 
-    while(!scan_buffer_.empty())
+    bool cross_section_updated = false;
+    for(unsigned int i = 0; !scan_buffer_.empty(); ++i)
     {
-        TransformStatus status = update(scan_buffer_.front(), world, req);
+        const sensor_msgs::LaserScanConstPtr& scan = scan_buffer_.front();
+
+        TransformStatus status = odom_status[i];
+        if (status == OK && !laser_offset_initialized_)
+        {
+            status = initializeLaserOffset(*scan, laser_model_);
+            laser_offset_initialized_ = (status == OK);
+        }
+
+        if (status == OK)
+        {
+            // The world model does not change during this call, so the cross section only has to be updated once
+            if (!cross_section_updated)
+            {
+                StageProfiler::Clock::time_point t = StageProfiler::Clock::now();
+                cross_section_.update(world, laser_model_.laser_height());
+                profiler_.recordSince(StageProfiler::CROSS_SECTION_UPDATE, t);
+                cross_section_updated = true;
+            }
+
+            geo::Pose3D map_to_base_link;
+            status = update(scan, odom_poses[i], cross_section_, map_to_base_link);
+
+            if (status == OK && !robot_name_.empty())
+                req.setPose(robot_name_, map_to_base_link);
+        }
+
         if (status == OK || status == TOO_OLD || status == UNKNOWN_ERROR)
-            scan_buffer_.pop();
+            scan_buffer_.pop_front();
         else
             break;
     }
@@ -204,47 +483,474 @@ void LocalizationPlugin::process(const ed::WorldModel& world, ed::UpdateRequest&
 
 // ----------------------------------------------------------------------------------------------------
 
-TransformStatus LocalizationPlugin::update(const sensor_msgs::LaserScanConstPtr& scan, const ed::WorldModel& world, ed::UpdateRequest& req)
+void LocalizationPlugin::processAsync(const ed::WorldModel& world, ed::UpdateRequest& req)
+{
+    if (initial_pose_msg_)
+    {
+        std::lock_guard<std::mutex> lock(async_mutex_);
+        async_initial_pose_msg_ = initial_pose_msg_;
+    }
+
+    // Only the ED thread reads the world model. Every time the cross section changes, a copy of it
+    // is handed to the localization thread (which can then use it without any locking).
+    if (laser_height_known_)
+    {
+        StageProfiler::Clock::time_point t = StageProfiler::Clock::now();
+        cross_section_.update(world, laser_height_);
+        profiler_.recordSince(StageProfiler::CROSS_SECTION_UPDATE, t);
+
+        if (!cross_section_snapshot_ || cross_section_.revision() != cross_section_snapshot_revision_)
+        {
+            std::shared_ptr<const CrossSectionCache> snapshot = std::make_shared<CrossSectionCache>(cross_section_);
+            cross_section_snapshot_revision_ = cross_section_.revision();
+
+            std::lock_guard<std::mutex> lock(cross_section_mutex_);
+            cross_section_snapshot_ = snapshot;
+        }
+    }
+
+    // Add the latest localization result to the update request
+    geo::Pose3D map_to_base_link;
+    bool have_pose;
+    {
+        std::lock_guard<std::mutex> lock(async_mutex_);
+        have_pose = have_async_pose_;
+        map_to_base_link = async_pose_;
+        have_async_pose_ = false;
+    }
+
+    if (have_pose && !robot_name_.empty())
+        req.setPose(robot_name_, map_to_base_link);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LocalizationPlugin::saveArtifactsInBackground()
+{
+    if (artifacts_save_thread_.joinable())
+    {
+        // Still saving: modified artifacts are saved after that
+        if (!artifacts_save_done_ || !finishArtifactsSave())
+            return;
+    }
+
+    if (artifacts_file_.empty() || !artifacts_.modified())
+        return;
+
+    artifacts_save_done_ = false;
+    artifacts_save_thread_ = std::thread(&LocalizationPlugin::artifactsSaveThread, this);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LocalizationPlugin::artifactsSaveThread()
+{
+    saveArtifacts();
+    artifacts_save_done_ = true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool LocalizationPlugin::finishArtifactsSave()
+{
+    if (artifacts_save_thread_.joinable())
+        artifacts_save_thread_.join();
+
+    if (artifacts_save_ok_)
+        return true;
+
+    artifacts_file_.clear();
+    artifacts_save_ok_ = true;
+    return false;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LocalizationPlugin::saveArtifacts()
+{
+    std::string error;
+    artifacts_save_ok_ = artifacts_.save(artifacts_file_, error);
+
+    if (artifacts_save_ok_)
+        ROS_INFO_STREAM("[ED Localization] Stored map artifacts in '" << artifacts_file_ << "'");
+    else
+        ROS_ERROR_STREAM("[ED Localization] " << error << ", map artifacts will not be stored");
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LocalizationPlugin::startLocalizationThread()
+{
+    stop_localization_thread_ = false;
+    localization_thread_ = std::thread(&LocalizationPlugin::localizationThread, this);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LocalizationPlugin::stopLocalizationThread()
+{
+    if (!localization_thread_.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex_);
+        stop_localization_thread_ = true;
+    }
+    wake_cv_.notify_one();
+
+    localization_thread_.join();
+
+    // Discard everything that was meant for the stopped thread
+    sensor_msgs::LaserScanConstPtr scan;
+    while(async_scan_queue_.pop(scan)) {}
+
+    std::lock_guard<std::mutex> lock(cross_section_mutex_);
+    cross_section_snapshot_.reset();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LocalizationPlugin::localizationThread()
 {
-    if (!laser_offset_initialized_)
+    sensor_msgs::LaserScanConstPtr scan;
+
+    while(!stop_localization_thread_)
     {
-        tf::StampedTransform p_laser;
-        TransformStatus ts = this->transform(base_link_frame_id_, scan->header.frame_id, scan->header.stamp, p_laser);
+        geometry_msgs::PoseWithCovarianceStampedConstPtr initial_pose_msg;
+        {
+            std::lock_guard<std::mutex> lock(async_mutex_);
+            initial_pose_msg.swap(async_initial_pose_msg_);
+        }
 
-        if (ts != OK)
-            return ts;
+        if (initial_pose_msg)
+            setInitialPose(*initial_pose_msg);
 
-        geo::Transform2 offset(geo::Mat2(p_laser.getBasis()[0][0], p_laser.getBasis()[0][1],
-                                         p_laser.getBasis()[1][0], p_laser.getBasis()[1][1]),
-                               geo::Vec2(p_laser.getOrigin().getX(), p_laser.getOrigin().getY()));
+        if (!scan && !async_scan_queue_.pop(scan))
+        {
+            // Wait for the next scan
+            std::unique_lock<std::mutex> lock(wake_mutex_);
+            if (!stop_localization_thread_ && async_scan_queue_.empty())
+                wake_cv_.wait_for(lock, std::chrono::milliseconds(50));
+            continue;
+        }
 
-        bool upside_down = p_laser.getBasis()[2][2] < 0;
-        if (upside_down)
+        if (max_scan_buffer_size_ == 1)
         {
-            offset.R.yx = -offset.R.yx;
-            offset.R.yy = -offset.R.yy;
+            // Only keep the latest scan
+            sensor_msgs::LaserScanConstPtr newer_scan;
+            while(async_scan_queue_.pop(newer_scan))
+                scan = newer_scan;
         }
 
-        double laser_height = p_laser.getOrigin().getZ();
+        StageProfiler::Clock::time_point t_lookup = StageProfiler::Clock::now();
 
-        laser_model_.setLaserOffset(offset, laser_height, upside_down);
+        geo::Pose3D odom_to_base_link;
+        TransformStatus status = lookupOdom(scan->header.stamp, odom_to_base_link);
 
-        laser_offset_initialized_ = true;
+        profiler_.recordSince(StageProfiler::TF_LOOKUP, t_lookup);
+
+        if (status == OK && !laser_offset_initialized_)
+        {
+            status = initializeLaserOffset(*scan, laser_model_);
+            if (status == OK)
+            {
+                laser_offset_initialized_ = true;
+                laser_height_ = laser_model_.laser_height();
+                laser_height_known_ = true;
+            }
+        }
+
+        if (status == OK)
+        {
+            std::shared_ptr<const CrossSectionCache> cross_section;
+            {
+                std::lock_guard<std::mutex> lock(cross_section_mutex_);
+                cross_section = cross_section_snapshot_;
+            }
+
+            if (!cross_section || cross_section->height() != laser_model_.laser_height())
+            {
+                // The ED thread did not yet provide a cross section at the right height
+                status = TOO_RECENT;
+            }
+            else
+            {
+                geo::Pose3D map_to_base_link;
+                status = update(scan, odom_to_base_link, *cross_section, map_to_base_link);
+
+                if (status == OK)
+                {
+                    std::lock_guard<std::mutex> lock(async_mutex_);
+                    async_pose_ = map_to_base_link;
+                    have_async_pose_ = true;
+                }
+            }
+        }
+
+        if (status == TOO_RECENT && !async_scan_queue_.full())
+        {
+            // Try the same scan again a bit later. Newer scans are queued behind it in the meantime.
+            std::unique_lock<std::mutex> lock(wake_mutex_);
+            if (!stop_localization_thread_)
+                wake_cv_.wait_for(lock, std::chrono::milliseconds(5));
+        }
+        else
+        {
+            // If the queue filled up while waiting, this is the oldest scan: drop it instead of the newest
+            if (status == TOO_RECENT)
+                ROS_WARN_THROTTLE(5, "[ED Localization] No odometry for the oldest laser scan yet: dropping it");
+
+            scan.reset();
+        }
     }
+}
 
-    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-    // -     Calculate delta movement based on odom (fetched from TF)
-    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// ----------------------------------------------------------------------------------------------------
 
-    geo::Pose3D odom_to_base_link;
-    Transform movement;
+void LocalizationPlugin::setInitialPose(const geometry_msgs::PoseWithCovarianceStamped& msg)
+{
+    geo::Vec2 p(msg.pose.pose.position.x, msg.pose.pose.position.y);
+
+    double yaw = tf::getYaw(msg.pose.pose.orientation);
+
+    particle_filter_.initUniform(p - geo::Vec2(0.3, 0.3), p + geo::Vec2(0.3, 0.3), 0.05,
+                                 yaw - 0.1, yaw + 0.1, 0.05);
+
+    force_update_ = true;
+
+    // An explicit initial pose overrides a pending global localization
+    global_localization_requested_ = false;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool LocalizationPlugin::globalLocalizationCallback(std_srvs::Empty::Request& /*req*/, std_srvs::Empty::Response& /*res*/)
+{
+    ROS_INFO("[ED Localization] Global localization requested");
+    global_localization_requested_ = true;
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LocalizationPlugin::startGlobalLocalization(const sensor_msgs::LaserScan& scan, const geo::Pose3D& odom_to_base_link,
+                                                 const CrossSectionCache& cross_section)
+{
+    // The search pyramid only needs to be rebuilt if the world model cross section changed. The thread gets
+    // copies of the lines and scan points, since the cross section and laser model change during the search.
+    global_search_lines_start_.clear();
+    global_search_lines_end_.clear();
+    global_search_artifacts_ = 0;
+    global_search_rebuild_ = global_search_.empty() || cross_section.revision() != global_search_revision_;
+    if (global_search_rebuild_)
+    {
+        cross_section.getLines(global_search_lines_start_, global_search_lines_end_);
+        if (!artifacts_file_.empty() && cross_section.isStartupRevision())
+            global_search_artifacts_ = &artifacts_;
+        global_search_revision_ = cross_section.revision();
+    }
+
+    laser_model_.calculateScanPoints(scan, global_search_points_);
+    global_search_odom_pose_ = odom_to_base_link;
+
+    global_search_done_ = false;
+    global_search_thread_ = std::thread(&LocalizationPlugin::globalSearchThread, this);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LocalizationPlugin::globalSearchThread()
+{
+    StageProfiler::Clock::time_point t_start = StageProfiler::Clock::now();
+
+    if (global_search_rebuild_)
+        global_search_.build(global_search_lines_start_, global_search_lines_end_, global_search_artifacts_);
+
+    global_search_.search(global_search_points_, global_search_candidates_);
+
+    global_search_duration_ = std::chrono::duration<double>(StageProfiler::Clock::now() - t_start).count();
+    global_search_done_ = true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool LocalizationPlugin::finishGlobalLocalization(const geo::Pose3D& odom_to_base_link, geo::Transform2& movement)
+{
+    global_search_thread_.join();
+    global_search_done_ = false;
+
+    profiler_.record(StageProfiler::GLOBAL_LOCALIZATION, global_search_duration_);
+
+    // An initial pose may have been set during the search
+    if (!global_localization_requested_)
+        return false;
+
+    const std::vector<GlobalSearch::Candidate>& candidates = global_search_candidates_;
+    if (candidates.empty())
+    {
+        // Stays requested, so a new search is started
+        ROS_WARN_THROTTLE(5, "[ED Localization] Global localization did not find any candidate pose");
+        return false;
+    }
+
+    // Spread the samples around the candidates, with about the accuracy of the search
+    std::vector<geo::Transform2> poses;
+    for(std::vector<GlobalSearch::Candidate>::const_iterator it = candidates.begin(); it != candidates.end(); ++it)
+        poses.push_back(it->pose);
+
+    particle_filter_.initGaussian(poses, global_search_.resolution(), 2 * global_search_.rotationStep(), num_particles_);
+    global_localization_requested_ = false;
+
+    // The new samples are at the pose of the searched scan, so they still have to follow the odometry since then
+    geo::Pose3D delta = global_search_odom_pose_.inverse() * odom_to_base_link;
+    movement = geo::Transform2(geo::Mat2(delta.R.xx, delta.R.xy,
+                                         delta.R.yx, delta.R.yy),
+                               geo::Vec2(delta.t.x, delta.t.y));
+
+    const GlobalSearch::Candidate& best = candidates.front();
+    ROS_INFO("[ED Localization] Global localization: %d candidates, best: (%.2f, %.2f, %.2f) with score %.2f (%.3f s)",
+             (int)candidates.size(), best.pose.t.x, best.pose.t.y, best.rotation, best.score, global_search_duration_);
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LocalizationPlugin::stopGlobalLocalization()
+{
+    if (!global_search_thread_.joinable())
+        return;
+
+    global_search_thread_.join();
+    global_search_done_ = false;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool LocalizationPlugin::updateRequired(const geo::Transform2& movement) const
+{
+    if (update_min_d_ <= 0 && update_min_a_ <= 0 && update_every_n_scans_ == 0)
+        return true;
+
+    if (update_min_d_ > 0 && movement.t.length() >= update_min_d_)
+        return true;
+
+    if (update_min_a_ > 0 && std::abs(atan2(movement.R.yx, movement.R.xx)) >= update_min_a_)
+        return true;
+
+    if (update_every_n_scans_ > 0 && num_skipped_scans_ + 1 >= update_every_n_scans_)
+        return true;
+
+    return false;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LocalizationPlugin::publishMapToOdom(const geo::Pose3D& map_to_odom, const ros::Time& stamp)
+{
+    // Convert to TF transform
+    tf::StampedTransform map_to_odom_tf;
+    geo::convert(map_to_odom, map_to_odom_tf);
+
+    // Set frame id's and time stamp
+    map_to_odom_tf.frame_id_ = map_frame_id_;
+    map_to_odom_tf.child_frame_id_ = odom_frame_id_;
+    map_to_odom_tf.stamp_ = stamp;
+
+    // Publish TF
+    tf_broadcaster_->sendTransform(map_to_odom_tf);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+TransformStatus LocalizationPlugin::initializeLaserOffset(const sensor_msgs::LaserScan& scan, LaserModel& laser_model)
+{
+    tf::StampedTransform p_laser;
+    TransformStatus ts = this->transform(base_link_frame_id_, scan.header.frame_id, scan.header.stamp, p_laser);
 
-    tf::StampedTransform odom_to_base_link_tf;
-    TransformStatus ts = transform(odom_frame_id_, base_link_frame_id_, scan->header.stamp, odom_to_base_link_tf);
     if (ts != OK)
         return ts;
 
-    geo::convert(odom_to_base_link_tf, odom_to_base_link);
+    geo::Transform2 offset(geo::Mat2(p_laser.getBasis()[0][0], p_laser.getBasis()[0][1],
+                                     p_laser.getBasis()[1][0], p_laser.getBasis()[1][1]),
+                           geo::Vec2(p_laser.getOrigin().getX(), p_laser.getOrigin().getY()));
+
+    bool upside_down = p_laser.getBasis()[2][2] < 0;
+    if (upside_down)
+    {
+        offset.R.yx = -offset.R.yx;
+        offset.R.yy = -offset.R.yy;
+    }
+
+    double laser_height = p_laser.getOrigin().getZ();
+
+    laser_model.setLaserOffset(offset, laser_height, upside_down);
+
+    return OK;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LocalizationPlugin::addAdditionalScans(const ros::Time& stamp, const geo::Pose3D& odom_to_base_link,
+                                            std::vector<LaserModel*>& models, std::vector<sensor_msgs::LaserScanConstPtr>& scans)
+{
+    for(unsigned int i = 0; i < additional_lasers_.size(); ++i)
+    {
+        AdditionalLaser& laser = *additional_lasers_[i];
+
+        sensor_msgs::LaserScanConstPtr scan;
+        {
+            std::lock_guard<std::mutex> lock(additional_scans_mutex_);
+            scan.swap(laser.scan);
+        }
+
+        if (!scan || std::abs((scan->header.stamp - stamp).toSec()) > laser.max_time_difference)
+            continue;
+
+        geo::Pose3D odom_to_scan_base_link;
+        TransformStatus status = lookupOdom(scan->header.stamp, odom_to_scan_base_link);
+
+        if (status == OK && !laser.offset_initialized)
+        {
+            status = initializeLaserOffset(*scan, laser.model);
+            laser.offset_initialized = (status == OK);
+        }
+
+        if (status == TOO_RECENT)
+        {
+            // Try again in the next update (unless a newer scan arrives)
+            std::lock_guard<std::mutex> lock(additional_scans_mutex_);
+            if (!laser.scan)
+                laser.scan = scan;
+            continue;
+        }
+
+        if (status != OK)
+            continue;
+
+        // Motion of the robot between the stamp of the update and of the scan
+        geo::Pose3D delta = odom_to_base_link.inverse() * odom_to_scan_base_link;
+        laser.model.setScanMotion(geo::Transform2(geo::Mat2(delta.R.xx, delta.R.xy, delta.R.yx, delta.R.yy),
+                                                  geo::Vec2(delta.t.x, delta.t.y)));
+
+        models.push_back(&laser.model);
+        scans.push_back(scan);
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+TransformStatus LocalizationPlugin::update(const sensor_msgs::LaserScanConstPtr& scan, const geo::Pose3D& odom_to_base_link,
+                                           const CrossSectionCache& cross_section, geo::Pose3D& map_to_base_link)
+{
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Calculate delta movement based on odom (fetched from TF)
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+    StageProfiler::Clock::time_point t_start = StageProfiler::Clock::now();
+    StageProfiler::Clock::time_point t = t_start;
+
+    Transform movement;
 
     if (have_previous_pose_)
     {
@@ -255,6 +961,22 @@ TransformStatus LocalizationPlugin::update(const sensor_msgs::LaserScanConstPtr&
                                            delta.R.yx, delta.R.yy),
                                  geo::Vec2(delta.t.x, delta.t.y));
 
+        // Scans are not skipped if a global search has to be started or finished (but they are during the search)
+        bool global_localization_pending = global_search_done_ || (global_localization_requested_ && !global_search_thread_.joinable());
+
+        if (have_map_to_odom_ && !force_update_ && !global_localization_pending && !updateRequired(delta_2d))
+        {
+            // Skip this scan. Since previous_pose_ is kept, the odometry since the last filter update
+            // is integrated in one motion update as soon as the filter is updated again
+            ++num_skipped_scans_;
+
+            map_to_base_link = map_to_odom_ * odom_to_base_link;
+            publishMapToOdom(map_to_odom_, scan->header.stamp);
+            if (map_to_odom_channel_)
+                map_to_odom_channel_->write(map_to_odom_, scan->header.stamp);
+            return OK;
+        }
+
         movement.set(delta_2d);
     }
     else
@@ -264,12 +986,32 @@ TransformStatus LocalizationPlugin::update(const sensor_msgs::LaserScanConstPtr&
 
     previous_pose_ = odom_to_base_link;
     have_previous_pose_ = true;
+    num_skipped_scans_ = 0;
+    force_update_ = false;
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Global localization (if requested)
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+    if (global_search_done_)
+    {
+        geo::Transform2 movement_since_search;
+        if (finishGlobalLocalization(odom_to_base_link, movement_since_search))
+            movement.set(movement_since_search);
+    }
+
+    // Until the search finished, the filter keeps tracking
+    if (global_localization_requested_ && !global_search_thread_.joinable())
+        startGlobalLocalization(*scan, odom_to_base_link, cross_section);
+
+    t = StageProfiler::Clock::now();
 
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
     // -     Check if particle filter is initialized
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-    if (particle_filter_.samples().empty())
+    // Read-only access goes through the const sampleSet(), which keeps the clusters valid
+    if (static_cast<const ParticleFilter&>(particle_filter_).sampleSet().empty())
         return UNKNOWN_ERROR;
 
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -278,19 +1020,31 @@ TransformStatus LocalizationPlugin::update(const sensor_msgs::LaserScanConstPtr&
 
     odom_model_.updatePoses(movement, 0, particle_filter_);
 
+    t = profiler_.recordSince(StageProfiler::MOTION_UPDATE, t);
+    profiler_.record(StageProfiler::NUM_SAMPLES, static_cast<const ParticleFilter&>(particle_filter_).sampleSet().size());
+
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
     // -     Update sensor
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-//    tue::Timer timer;
-//    timer.start();
+    std::vector<LaserModel*>& laser_models = update_laser_models_;
+    std::vector<sensor_msgs::LaserScanConstPtr>& scans = update_scans_;
+    laser_models.assign(1, &laser_model_);
+    scans.assign(1, scan);
+    addAdditionalScans(scan->header.stamp, odom_to_base_link, laser_models, scans);
+
+    std::vector<const sensor_msgs::LaserScan*>& scan_ptrs = update_scan_ptrs_;
+    scan_ptrs.resize(scans.size());
+    for(unsigned int i = 0; i < scans.size(); ++i)
+        scan_ptrs[i] = scans[i].get();
 
-    laser_model_.updateWeights(world, *scan, particle_filter_);
+    // (records the unique sample, cross section selection and weight update stages)
+    LaserModel::updateWeights(laser_models, scan_ptrs, cross_section, particle_filter_);
 
-//    std::cout << "----------" << std::endl;
-//    std::cout << "Number of lines = " << laser_model_.lines_start().size() << std::endl;
-//    std::cout << "Total time = " << timer.getElapsedTimeInMilliSec() << " ms" << std::endl;
-//    std::cout << "Time per sample = " << timer.getElapsedTimeInMilliSec() / particle_filter_.samples().size() << " ms" << std::endl;
+    // Do not keep the scans alive until the next update
+    scans.clear();
+
+    t = StageProfiler::Clock::now();
 
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
     // -     (Re)sample
@@ -298,61 +1052,48 @@ TransformStatus LocalizationPlugin::update(const sensor_msgs::LaserScanConstPtr&
 
     particle_filter_.resample(num_particles_);
 
+    t = profiler_.recordSince(StageProfiler::RESAMPLE, t);
+
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
     // -     Publish result
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-    // Get the best pose (2D)
-    geo::Transform2 mean_pose = particle_filter_.calculateMeanPose();
+    // Get the best pose (2D): the mean of the cluster with the highest weight (the clusters are
+    // calculated during resampling, so this does not need another pass over the samples)
+    const PoseCluster& best_cluster = particle_filter_.bestCluster();
+    geo::Transform2 mean_pose = best_cluster.mean;
 
     // Convert best pose to 3D
-    geo::Pose3D map_to_base_link;
     map_to_base_link.t = geo::Vector3(mean_pose.t.x, mean_pose.t.y, 0);
     map_to_base_link.R = geo::Matrix3(mean_pose.R.xx, mean_pose.R.xy, 0,
                                       mean_pose.R.yx, mean_pose.R.yy, 0,
                                       0     , 0     , 1);
 
-    geo::Pose3D map_to_odom = map_to_base_link * odom_to_base_link.inverse();
+    map_to_odom_ = map_to_base_link * odom_to_base_link.inverse();
+    have_map_to_odom_ = true;
 
-    // Convert to TF transform
-    tf::StampedTransform map_to_odom_tf;
-    geo::convert(map_to_odom, map_to_odom_tf);
-
-    // Set frame id's and time stamp
-    map_to_odom_tf.frame_id_ = map_frame_id_;
-    map_to_odom_tf.child_frame_id_ = odom_frame_id_;
-    map_to_odom_tf.stamp_ = scan->header.stamp;
+    t = profiler_.recordSince(StageProfiler::MEAN_POSE, t);
 
-    // Publish TF
-    tf_broadcaster_->sendTransform(map_to_odom_tf);
+    publishMapToOdom(map_to_odom_, scan->header.stamp);
+    publishPose(best_cluster, scan->header.stamp);
 
-    if (!robot_name_.empty())
-        req.setPose(robot_name_, map_to_base_link);
+    if (map_to_odom_channel_)
+        map_to_odom_channel_->write(map_to_odom_, scan->header.stamp);
 
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
     // -     Publish particles
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-    const std::vector<Sample>& samples = particle_filter_.samples();
-    geometry_msgs::PoseArray particles_msg;
-    particles_msg.poses.resize(samples.size());
-    for(unsigned int i = 0; i < samples.size(); ++i)
-    {
-        const geo::Transform2& p = samples[i].pose.matrix();
+    publishParticles(scan->header.stamp);
 
-        geo::Pose3D pose_3d;
-        pose_3d.t = geo::Vector3(p.t.x, p.t.y, 0);
-        pose_3d.R = geo::Matrix3(p.R.xx, p.R.xy, 0,
-                                 p.R.yx, p.R.yy, 0,
-                                 0     , 0     , 1);
+    profiler_.recordSince(StageProfiler::PUBLISH, t);
+    profiler_.recordSince(StageProfiler::TOTAL, t_start);
 
-        geo::convert(pose_3d, particles_msg.poses[i]);
-    }
+    if (diagnostics_period_ > 0 && std::chrono::duration<double>(StageProfiler::Clock::now() - last_diagnostics_time_).count() >= diagnostics_period_)
+        publishDiagnostics();
 
-    particles_msg.header.frame_id = "/map";
-    particles_msg.header.stamp = scan->header.stamp;
-
-    pub_particles_.publish(particles_msg);
+    // Store the artifacts that were built during this update (this only happens for the startup world model)
+    saveArtifactsInBackground();
 
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
     // -     Visualization
@@ -366,15 +1107,15 @@ TransformStatus LocalizationPlugin::update(const sensor_msgs::LaserScanConstPtr&
 
         cv::Mat rgb_image(grid_size, grid_size, CV_8UC3, cv::Scalar(10, 10, 10));
 
-        std::vector<geo::Vector3> sensor_points;
-        laser_model_.renderer().rangesToPoints(laser_model_.sensor_ranges(), sensor_points);
+        const std::vector<double>& sensor_ranges = laser_model_.sensor_ranges();
+        const std::vector<geo::Vec2>& beam_dirs = laser_model_.beam_dirs();
 
         geo::Transform2 best_pose = mean_pose;
 
         geo::Transform2 laser_pose = best_pose * laser_model_.laser_offset();
-        for(unsigned int i = 0; i < sensor_points.size(); ++i)
+        for(unsigned int i = 0; i < sensor_ranges.size(); ++i)
         {
-            const geo::Vec2& p = laser_pose * geo::Vec2(sensor_points[i].x, sensor_points[i].y);
+            const geo::Vec2& p = laser_pose * (beam_dirs[i] * sensor_ranges[i]);
             int mx = -(p.y - best_pose.t.y) / grid_resolution + grid_size / 2;
             int my = -(p.x - best_pose.t.x) / grid_resolution + grid_size / 2;
 
@@ -400,10 +1141,10 @@ TransformStatus LocalizationPlugin::update(const sensor_msgs::LaserScanConstPtr&
             cv::line(rgb_image, cv::Point(mx1, my1), cv::Point(mx2, my2), cv::Scalar(255, 255, 255), 1);
         }
 
-        const std::vector<Sample>& samples = particle_filter_.samples();
-        for(std::vector<Sample>::const_iterator it = samples.begin(); it != samples.end(); ++it)
+        const SampleSet& samples = static_cast<const ParticleFilter&>(particle_filter_).sampleSet();
+        for(unsigned int i = 0; i < samples.size(); ++i)
         {
-            const geo::Transform2& pose = it->pose.matrix();
+            geo::Transform2 pose = samples.transform(i);
 
             // Visualize sensor
             int lmx = -(pose.t.y - best_pose.t.y) / grid_resolution + grid_size / 2;
@@ -425,6 +1166,244 @@ TransformStatus LocalizationPlugin::update(const sensor_msgs::LaserScanConstPtr&
 
 // ----------------------------------------------------------------------------------------------------
 
+void LocalizationPlugin::publishParticles(const ros::Time& stamp)
+{
+    bool publish_pose_array = pub_particles_.getNumSubscribers() > 0;
+    bool publish_particle_set = pub_particle_set_.getNumSubscribers() > 0;
+
+    if (!publish_pose_array && !publish_particle_set)
+        return;
+
+    if (particles_publish_rate_ > 0 && !last_particles_publish_time_.isZero() && stamp >= last_particles_publish_time_
+            && (stamp - last_particles_publish_time_).toSec() < 1.0 / particles_publish_rate_)
+        return;
+
+    last_particles_publish_time_ = stamp;
+
+    const SampleSet& samples = static_cast<const ParticleFilter&>(particle_filter_).sampleSet();
+
+    unsigned int num_published = samples.size();
+    if (max_published_particles_ > 0)
+        num_published = std::min(num_published, max_published_particles_);
+
+    if (publish_pose_array)
+    {
+        // Published as shared pointer, such that intra-process subscribers do not need a copy. The message
+        // (and its pose buffer) is reused once no subscriber holds on to it anymore.
+        if (!particles_msg_ || !particles_msg_.unique())
+            particles_msg_.reset(new geometry_msgs::PoseArray);
+
+        geometry_msgs::PoseArray* particles_msg = particles_msg_.get();
+        particles_msg->poses.resize(num_published);
+        for(unsigned int k = 0; k < num_published; ++k)
+        {
+            unsigned int i = (unsigned long)k * samples.size() / num_published;
+
+            // Rotation around the z-axis only, so the quaternion follows directly from theta
+            geometry_msgs::Pose& pose = particles_msg->poses[k];
+            pose.position.x = samples.x[i];
+            pose.position.y = samples.y[i];
+            pose.position.z = 0;
+            pose.orientation.x = 0;
+            pose.orientation.y = 0;
+            pose.orientation.z = std::sin(samples.theta[i] / 2);
+            pose.orientation.w = std::cos(samples.theta[i] / 2);
+        }
+
+        particles_msg->header.frame_id = map_frame_id_;
+        particles_msg->header.stamp = stamp;
+
+        pub_particles_.publish(particles_msg_);
+    }
+
+    if (publish_particle_set)
+    {
+        if (!particle_set_msg_ || !particle_set_msg_.unique())
+            particle_set_msg_.reset(new ed_localization::ParticleSet);
+
+        ed_localization::ParticleSet* particle_set_msg = particle_set_msg_.get();
+        particle_set_msg->x.resize(num_published);
+        particle_set_msg->y.resize(num_published);
+        particle_set_msg->theta.resize(num_published);
+        particle_set_msg->weight.resize(num_published);
+        for(unsigned int k = 0; k < num_published; ++k)
+        {
+            unsigned int i = (unsigned long)k * samples.size() / num_published;
+            particle_set_msg->x[k] = samples.x[i];
+            particle_set_msg->y[k] = samples.y[i];
+            particle_set_msg->theta[k] = samples.theta[i];
+            particle_set_msg->weight[k] = samples.weight[i];
+        }
+
+        particle_set_msg->header.frame_id = map_frame_id_;
+        particle_set_msg->header.stamp = stamp;
+
+        pub_particle_set_.publish(particle_set_msg_);
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LocalizationPlugin::publishPose(const PoseCluster& cluster, const ros::Time& stamp)
+{
+    if (pub_pose_.getNumSubscribers() == 0)
+        return;
+
+    if (!pose_msg_ || !pose_msg_.unique())
+        pose_msg_.reset(new geometry_msgs::PoseWithCovarianceStamped);
+
+    geometry_msgs::PoseWithCovarianceStamped* pose_msg = pose_msg_.get();
+    pose_msg->header.frame_id = map_frame_id_;
+    pose_msg->header.stamp = stamp;
+
+    geometry_msgs::Pose& pose = pose_msg->pose.pose;
+    pose.position.x = cluster.mean.t.x;
+    pose.position.y = cluster.mean.t.y;
+    pose.position.z = 0;
+    pose.orientation.x = 0;
+    pose.orientation.y = 0;
+    pose.orientation.z = std::sin(cluster.mean_rotation / 2);
+    pose.orientation.w = std::cos(cluster.mean_rotation / 2);
+
+    // Row-major 6x6 covariance of (x, y, z, roll, pitch, yaw)
+    std::fill(pose_msg->pose.covariance.begin(), pose_msg->pose.covariance.end(), 0);
+    pose_msg->pose.covariance[0] = cluster.cov_xx;
+    pose_msg->pose.covariance[1] = cluster.cov_xy;
+    pose_msg->pose.covariance[6] = cluster.cov_xy;
+    pose_msg->pose.covariance[7] = cluster.cov_yy;
+    pose_msg->pose.covariance[35] = cluster.cov_rotation;
+
+    pub_pose_.publish(pose_msg_);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LocalizationPlugin::publishDiagnostics()
+{
+    StageProfiler::Clock::time_point now = StageProfiler::Clock::now();
+    double period = std::chrono::duration<double>(now - last_diagnostics_time_).count();
+    last_diagnostics_time_ = now;
+
+    std::vector<DurationHistogram> stages;
+    std::vector<CounterStatistics> counters;
+    profiler_.takeSnapshot(stages, counters);
+
+    if (pub_diagnostics_.getNumSubscribers() == 0)
+        return;
+
+    diagnostic_msgs::DiagnosticArrayPtr msg(new diagnostic_msgs::DiagnosticArray);
+    msg->header.stamp = ros::Time::now();
+
+    msg->status.resize(1);
+    diagnostic_msgs::DiagnosticStatus& status = msg->status.back();
+    status.level = diagnostic_msgs::DiagnosticStatus::OK;
+    status.name = "ed_localization: pipeline";
+    status.hardware_id = robot_name_;
+
+    std::stringstream s_message;
+    s_message << stages[StageProfiler::TOTAL].count() << " updates in " << period << " s";
+    status.message = s_message.str();
+
+    // Durations in milliseconds
+    for(unsigned int i = 0; i < StageProfiler::NUM_STAGES; ++i)
+    {
+        const DurationHistogram& h = stages[i];
+        if (h.count() == 0)
+            continue;
+
+        std::string name = StageProfiler::stageName((StageProfiler::Stage)i);
+
+        std::stringstream s;
+        s << "p50: " << h.percentile(50) * 1000 << ", p99: " << h.percentile(99) * 1000
+          << ", mean: " << h.mean() * 1000 << ", max: " << h.max() * 1000 << ", n: " << h.count();
+
+        diagnostic_msgs::KeyValue kv;
+        kv.key = name + " [ms]";
+        kv.value = s.str();
+        status.values.push_back(kv);
+    }
+
+    for(unsigned int i = 0; i < StageProfiler::NUM_COUNTERS; ++i)
+    {
+        const CounterStatistics& c = counters[i];
+        if (c.count == 0)
+            continue;
+
+        std::stringstream s;
+        s << "mean: " << c.mean() << ", max: " << c.max;
+
+        diagnostic_msgs::KeyValue kv;
+        kv.key = StageProfiler::counterName((StageProfiler::Counter)i);
+        kv.value = s.str();
+        status.values.push_back(kv);
+    }
+
+    // Also shows if the OpenCL backend failed during an update
+    diagnostic_msgs::KeyValue kv_backend;
+    kv_backend.key = "laser_model_backend";
+    if (laser_model_.usesOpenCL())
+        kv_backend.value = "opencl";
+    else if (laser_model_.backendError().empty())
+        kv_backend.value = "cpu";
+    else
+        kv_backend.value = "cpu (" + laser_model_.backendError() + ")";
+    status.values.push_back(kv_backend);
+
+    pub_diagnostics_.publish(msg);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+TransformStatus LocalizationPlugin::lookupOdom(const ros::Time& stamp, geo::Pose3D& odom_to_base_link)
+{
+    TransformStatus status;
+
+    if (!odom_buffer_.empty())
+    {
+        tf::Transform odom_to_base_link_tf;
+        status = odom_buffer_.lookup(stamp, odom_to_base_link_tf);
+        if (status == OK)
+            geo::convert(odom_to_base_link_tf, odom_to_base_link);
+    }
+    else
+    {
+        // Nothing buffered (e.g., odom -> base_link is not a single transform on /tf): use tf
+        tf::StampedTransform odom_to_base_link_tf;
+        status = transform(odom_frame_id_, base_link_frame_id_, stamp, odom_to_base_link_tf);
+        if (status == OK)
+            geo::convert(odom_to_base_link_tf, odom_to_base_link);
+    }
+
+    return status;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LocalizationPlugin::lookupOdom(const std::vector<ros::Time>& stamps, std::vector<geo::Pose3D>& odom_to_base_link,
+                                    std::vector<TransformStatus>& status)
+{
+    odom_to_base_link.resize(stamps.size());
+
+    if (odom_buffer_.empty())
+    {
+        status.resize(stamps.size());
+        for(unsigned int i = 0; i < stamps.size(); ++i)
+            status[i] = lookupOdom(stamps[i], odom_to_base_link[i]);
+        return;
+    }
+
+    std::vector<tf::Transform>& transforms = odom_transforms_;
+    odom_buffer_.lookup(stamps, transforms, status);
+
+    for(unsigned int i = 0; i < stamps.size(); ++i)
+    {
+        if (status[i] == OK)
+            geo::convert(transforms[i], odom_to_base_link[i]);
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
 TransformStatus LocalizationPlugin::transform(const std::string& target_frame, const std::string& source_frame,
                                               const ros::Time& time, tf::StampedTransform& transform)
 {
@@ -443,7 +1422,7 @@ TransformStatus LocalizationPlugin::transform(const std::string& target_frame, c
             tf::StampedTransform latest_transform;
             tf_listener_->lookupTransform(target_frame, source_frame, ros::Time(0), latest_transform);
 
-            if (scan_buffer_.front()->header.stamp > latest_transform.stamp_)
+            if (time > latest_transform.stamp_)
             {
                 // Scan is too new
                 return TOO_RECENT;
@@ -469,7 +1448,57 @@ TransformStatus LocalizationPlugin::transform(const std::string& target_frame, c
 
 void LocalizationPlugin::laserCallback(const sensor_msgs::LaserScanConstPtr& msg)
 {
-    scan_buffer_.push(msg);
+    if (!async_)
+    {
+        scan_buffer_.push_back(msg);
+
+        // Drop the oldest scans, such that a TF hiccup does not result in a large backlog
+        while(max_scan_buffer_size_ > 0 && scan_buffer_.size() > max_scan_buffer_size_)
+            scan_buffer_.pop_front();
+
+        return;
+    }
+
+    // If the localization thread can not keep up with the updates, the newest scan is dropped. (A scan that
+    // waits for its odometry is dropped by the localization thread once the queue is full.)
+    if (!async_scan_queue_.push(msg))
+        ROS_WARN_THROTTLE(5, "[ED Localization] Localization can not keep up: dropping laser scans");
+
+    std::lock_guard<std::mutex> lock(wake_mutex_);
+    wake_cv_.notify_one();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LocalizationPlugin::additionalLaserCallback(const sensor_msgs::LaserScanConstPtr& msg, unsigned int laser_index)
+{
+    // Only the latest scan is kept
+    std::lock_guard<std::mutex> lock(additional_scans_mutex_);
+    if (laser_index < additional_lasers_.size())
+        additional_lasers_[laser_index]->scan = msg;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LocalizationPlugin::tfCallback(const tf2_msgs::TFMessageConstPtr& msg)
+{
+    for(std::vector<geometry_msgs::TransformStamped>::const_iterator it = msg->transforms.begin(); it != msg->transforms.end(); ++it)
+    {
+        if (stripSlash(it->header.frame_id) != stripSlash(odom_frame_id_)
+                || stripSlash(it->child_frame_id) != stripSlash(base_link_frame_id_))
+            continue;
+
+        tf::StampedTransform transform;
+        tf::transformStampedMsgToTF(*it, transform);
+        odom_buffer_.add(transform.stamp_, transform);
+
+        if (odom_channel_)
+        {
+            geo::Pose3D odom_to_base_link;
+            geo::convert(transform, odom_to_base_link);
+            odom_channel_->write(odom_to_base_link, transform.stamp_);
+        }
+    }
 }
 
 // ----------------------------------------------------------------------------------------------------
@@ -10,28 +10,39 @@
 #include <ros/subscriber.h>
 #include <ros/publisher.h>
 #include <ros/callback_queue.h>
+#include <ros/service_server.h>
 #include <sensor_msgs/LaserScan.h>
+#include <geometry_msgs/PoseArray.h>
 #include <geometry_msgs/PoseWithCovarianceStamped.h>
+#include <ed_localization/ParticleSet.h>
+#include <tf2_msgs/TFMessage.h>
+#include <std_srvs/Empty.h>
 
 // SCAN BUFFER
-#include <queue>
+#include <deque>
+
+// ASYNCHRONOUS MODE
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "spsc_queue.h"
 
 // TF
 #include <tf/transform_listener.h>
 #include <tf/transform_broadcaster.h>
+#include "odom_buffer.h"
 
 // MODELS
 #include "particle_filter.h"
 #include "odom_model.h"
 #include "laser_model.h"
-
-enum TransformStatus
-{
-    TOO_RECENT,
-    TOO_OLD,
-    OK,
-    UNKNOWN_ERROR
-};
+#include "global_search.h"
+#include "cross_section_cache.h"
+#include "stage_profiler.h"
+#include "pose_channel.h"
 
 class LocalizationPlugin : public ed::Plugin
 {
@@ -65,6 +76,58 @@ private:
     LaserModel laser_model_;
     OdomModel odom_model_;
 
+    // ADDITIONAL LASERS (e.g., a rear laser): the latest scan of each additional laser is fused into the
+    // filter update of the next scan of the main laser (laser_model_), compensated for the odometry between
+    // both stamps. All lasers render the cross section at the height of the main laser.
+    struct AdditionalLaser
+    {
+        AdditionalLaser() : max_time_difference(0.5), offset_initialized(false) {}
+
+        std::string topic;
+        LaserModel model;
+        ros::Subscriber sub;
+
+        // Scans that are further apart from the scan of the main laser (in seconds) are not used
+        double max_time_difference;
+
+        bool offset_initialized;
+
+        // Latest scan that was not yet used (guarded by additional_scans_mutex_)
+        sensor_msgs::LaserScanConstPtr scan;
+    };
+
+    std::vector<std::unique_ptr<AdditionalLaser> > additional_lasers_;
+    std::mutex additional_scans_mutex_;
+
+    void additionalLaserCallback(const sensor_msgs::LaserScanConstPtr& msg, unsigned int laser_index);
+
+    // Adds the models and unused scans of the additional lasers that can be fused into the update at 'stamp'
+    void addAdditionalScans(const ros::Time& stamp, const geo::Pose3D& odom_to_base_link, std::vector<LaserModel*>& models,
+                            std::vector<sensor_msgs::LaserScanConstPtr>& scans);
+
+    // World model cross section (only updated from the ED thread)
+    CrossSectionCache cross_section_;
+
+    // Persistent precomputed artifacts (cross section, likelihood fields). Not used if the file name is empty.
+    MapArtifacts artifacts_;
+    std::string artifacts_file_;
+
+    // New artifacts are saved on a separate thread, such that the update does not wait for the disk. Whatever
+    // is still modified on shutdown is saved by the destructor.
+    std::thread artifacts_save_thread_;
+    std::atomic<bool> artifacts_save_done_;
+    bool artifacts_save_ok_;  // Result of the last save (only read once artifacts_save_done_ is set)
+
+    // Starts saving the artifacts if they were modified (and the previous save finished)
+    void saveArtifactsInBackground();
+
+    // Waits for the save thread. Returns false if the save failed, in which case saving is disabled.
+    bool finishArtifactsSave();
+
+    void artifactsSaveThread();
+
+    void saveArtifacts();
+
 
     // ROS
 
@@ -83,13 +146,179 @@ private:
 
     void initialPoseCallback(const geometry_msgs::PoseWithCovarianceStampedConstPtr& msg);
 
+    void setInitialPose(const geometry_msgs::PoseWithCovarianceStamped& msg);
+
+    // GLOBAL LOCALIZATION: if requested (on startup or via the service), a global search for the next scan
+    // is started on a separate thread, since it can take seconds. The filter keeps tracking in the meantime,
+    // and is re-initialized around the best poses of the search on the first update after it finished.
+
+    // Only used by the search thread while it runs
+    GlobalSearch global_search_;
+
+    // Cross section revision of which the search pyramid was (or is being) built
+    unsigned long global_search_revision_;
+
+    // Set from the ED thread (service), read by the thread that updates the filter
+    std::atomic<bool> global_localization_requested_;
+
+    std::thread global_search_thread_;
+    std::atomic<bool> global_search_done_;
+
+    // Input and result of the search thread (only accessed by that thread until global_search_done_ is set)
+    std::vector<geo::Vec2> global_search_points_;
+    bool global_search_rebuild_;
+    std::vector<geo::Vec2> global_search_lines_start_, global_search_lines_end_;  // Only if the pyramid is rebuilt
+    MapArtifacts* global_search_artifacts_;
+    std::vector<GlobalSearch::Candidate> global_search_candidates_;
+    double global_search_duration_;
+
+    // Odom pose of the scan that is searched
+    geo::Pose3D global_search_odom_pose_;
+
+    ros::ServiceServer srv_global_localization_;
+
+    bool globalLocalizationCallback(std_srvs::Empty::Request& req, std_srvs::Empty::Response& res);
+
+    void startGlobalLocalization(const sensor_msgs::LaserScan& scan, const geo::Pose3D& odom_to_base_link,
+                                 const CrossSectionCache& cross_section);
+
+    // Re-initializes the filter around the candidates of the finished search. Returns true if it did, with the
+    // odom movement since the searched scan, which still has to be applied to the new samples.
+    bool finishGlobalLocalization(const geo::Pose3D& odom_to_base_link, geo::Transform2& movement);
+
+    // Waits for a running search and discards its result
+    void stopGlobalLocalization();
+
+    void globalSearchThread();
+
+    // PARTICLE PUBLISHING
+
+    // PoseArray (for visualization) and compact particle set
     ros::Publisher pub_particles_;
+    ros::Publisher pub_particle_set_;
+
+    // Maximum publish rate in Hz (0: publish every update) and maximum number of published
+    // particles (0: all). If there are more particles, an evenly spaced subset is published.
+    double particles_publish_rate_;
+    unsigned int max_published_particles_;
+
+    ros::Time last_particles_publish_time_;
+
+    // Messages of the previous publish, reused if no subscriber holds on to them anymore
+    geometry_msgs::PoseArrayPtr particles_msg_;
+    ed_localization::ParticleSetPtr particle_set_msg_;
+
+    void publishParticles(const ros::Time& stamp);
+
+    // POSE PUBLISHING
+
+    // Mean and covariance of the best cluster of particles
+    ros::Publisher pub_pose_;
+    geometry_msgs::PoseWithCovarianceStampedPtr pose_msg_;
+
+    void publishPose(const PoseCluster& cluster, const ros::Time& stamp);
+
+    // Latest map -> odom and odometry, for the TF plugin (or any other plugin) in the same process. Null if there is
+    // no robot name. The odometry is only written if the odometry buffer is enabled (it is taken from the same
+    // /tf messages).
+    std::shared_ptr<PoseChannel> map_to_odom_channel_;
+    std::shared_ptr<PoseChannel> odom_channel_;
 
     bool laser_offset_initialized_;
 
 
     // Scan buffer
-    std::queue<sensor_msgs::LaserScanConstPtr> scan_buffer_;
+    std::deque<sensor_msgs::LaserScanConstPtr> scan_buffer_;
+
+    // Maximum number of buffered scans (0 = unbounded). If exceeded, the oldest scans are dropped:
+    // their odometry is still taken into account by the next filter update.
+    unsigned int max_scan_buffer_size_;
+
+    // Stamps and odometry of the buffered scans
+    std::vector<ros::Time> scan_stamps_;
+    std::vector<geo::Pose3D> scan_odom_poses_;
+    std::vector<TransformStatus> scan_odom_status_;
+
+    // Models and scans of a filter update. Like all buffers of the update path, these are kept between updates,
+    // such that an update does not allocate once the buffers have grown to their working size.
+    std::vector<LaserModel*> update_laser_models_;
+    std::vector<sensor_msgs::LaserScanConstPtr> update_scans_;
+    std::vector<const sensor_msgs::LaserScan*> update_scan_ptrs_;
+
+
+    // UPDATE POLICY: the filter is only updated if the robot moved at least update_min_d_ meters or
+    // update_min_a_ radians since the last filter update, or if update_every_n_scans_ scans were skipped.
+    // If all are zero, every scan updates the filter.
+
+    double update_min_d_;
+    double update_min_a_;
+    unsigned int update_every_n_scans_;
+
+    unsigned int num_skipped_scans_;
+
+    // Forces a filter update on the next scan (e.g., after a new initial pose)
+    bool force_update_;
+
+    // Correction of the last filter update. Scans are only skipped (which republishes it) once it is known.
+    bool have_map_to_odom_;
+    geo::Pose3D map_to_odom_;
+
+    bool updateRequired(const geo::Transform2& movement) const;
+
+    void publishMapToOdom(const geo::Pose3D& map_to_odom, const ros::Time& stamp);
+
+
+    // ASYNCHRONOUS MODE: the filter is updated on a separate localization thread, such that
+    // ED's update rate does not depend on the localization
+
+    bool async_;
+
+    // Scans from the ED thread (producer) to the localization thread (consumer)
+    SPSCQueue<sensor_msgs::LaserScanConstPtr> async_scan_queue_;
+
+    std::thread localization_thread_;
+    std::atomic<bool> stop_localization_thread_;
+
+    // Used to wake up the localization thread if a new scan arrives
+    std::mutex wake_mutex_;
+    std::condition_variable wake_cv_;
+
+    // Snapshot of the cross section, published by the ED thread
+    std::mutex cross_section_mutex_;
+    std::shared_ptr<const CrossSectionCache> cross_section_snapshot_;
+    unsigned long cross_section_snapshot_revision_;
+
+    // Laser height, known as soon as the localization thread determined the laser offset
+    std::atomic<bool> laser_height_known_;
+    std::atomic<double> laser_height_;
+
+    // Exchange between the ED thread and the localization thread
+    std::mutex async_mutex_;
+    bool have_async_pose_;
+    geo::Pose3D async_pose_;
+    geometry_msgs::PoseWithCovarianceStampedConstPtr async_initial_pose_msg_;
+
+    void startLocalizationThread();
+
+    void stopLocalizationThread();
+
+    void localizationThread();
+
+    void processAsync(const ed::WorldModel& world, ed::UpdateRequest& req);
+
+
+    // INSTRUMENTATION
+
+    StageProfiler profiler_;
+
+    // Period (in seconds) of publishing the stage durations and counters (0 = never)
+    double diagnostics_period_;
+
+    StageProfiler::Clock::time_point last_diagnostics_time_;
+
+    ros::Publisher pub_diagnostics_;
+
+    void publishDiagnostics();
 
 
     // TF
@@ -101,7 +330,24 @@ private:
     tf::TransformListener* tf_listener_;
     tf::TransformBroadcaster* tf_broadcaster_;
 
-    TransformStatus update(const sensor_msgs::LaserScanConstPtr& laser_msg_, const ed::WorldModel& world, ed::UpdateRequest& req);
+    // odom -> base_link transforms from /tf, used instead of tf lookups for the odometry of the scans
+    OdomBuffer odom_buffer_;
+    std::vector<tf::Transform> odom_transforms_;
+    ros::Subscriber sub_tf_;
+
+    void tfCallback(const tf2_msgs::TFMessageConstPtr& msg);
+
+    // Odometry at the given stamp(s), from the odometry buffer or otherwise from tf
+    TransformStatus lookupOdom(const ros::Time& stamp, geo::Pose3D& odom_to_base_link);
+
+    void lookupOdom(const std::vector<ros::Time>& stamps, std::vector<geo::Pose3D>& odom_to_base_link,
+                    std::vector<TransformStatus>& status);
+
+    TransformStatus initializeLaserOffset(const sensor_msgs::LaserScan& scan, LaserModel& laser_model);
+
+    // Updates the filter with the scan and the odometry at its stamp, and returns the estimated pose of the robot
+    TransformStatus update(const sensor_msgs::LaserScanConstPtr& scan, const geo::Pose3D& odom_to_base_link,
+                           const CrossSectionCache& cross_section, geo::Pose3D& map_to_base_link);
 
     TransformStatus transform(const std::string& target_frame, const std::string& source_frame,
                               const ros::Time& time, tf::StampedTransform& transform);
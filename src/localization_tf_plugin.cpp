@@ -19,7 +19,7 @@
 
 // ----------------------------------------------------------------------------------------------------
 
-LocalizationTFPlugin::LocalizationTFPlugin() : tf_listener_()
+LocalizationTFPlugin::LocalizationTFPlugin() : max_pose_age_(0.5), max_odom_age_(0.2), tf_listener_()
 {
 }
 
@@ -27,6 +27,7 @@ LocalizationTFPlugin::LocalizationTFPlugin() : tf_listener_()
 
 LocalizationTFPlugin::~LocalizationTFPlugin()
 {
+    delete tf_listener_;
 }
 
 // ----------------------------------------------------------------------------------------------------
@@ -35,8 +36,13 @@ void LocalizationTFPlugin::configure(tue::Configuration config)
 {
     config.value("robot_name", robot_name_);
 
+    map_to_odom_channel_ = PoseChannel::mapToOdom(robot_name_);
+    odom_channel_ = PoseChannel::odometry(robot_name_);
+    config.value("max_pose_age", max_pose_age_, tue::config::OPTIONAL);
+    config.value("max_odom_age", max_odom_age_, tue::config::OPTIONAL);
+
     delete tf_listener_;
-    tf_listener_ = new tf::TransformListener;
+    tf_listener_ = 0;
 }
 
 // ----------------------------------------------------------------------------------------------------
@@ -49,6 +55,29 @@ void LocalizationTFPlugin::initialize()
 
 void LocalizationTFPlugin::process(const ed::WorldModel& world, ed::UpdateRequest& req)
 {
+    // If the localization plugin runs in this process, combine its latest map -> odom with the latest odometry
+    // without going through tf (as long as both are recent)
+    geo::Pose3D map_to_odom, odom_to_base_link;
+    ros::Time map_to_odom_stamp, odom_stamp;
+    if (map_to_odom_channel_->read(map_to_odom, map_to_odom_stamp) && odom_channel_->read(odom_to_base_link, odom_stamp))
+    {
+        ros::Time now = ros::Time::now();
+        double map_to_odom_age = (now - map_to_odom_stamp).toSec();
+        double odom_age = (now - odom_stamp).toSec();
+
+        if (map_to_odom_age <= max_pose_age_ && odom_age <= max_odom_age_)
+        {
+            req.setPose(robot_name_, map_to_odom * odom_to_base_link);
+            return;
+        }
+
+        ROS_WARN_STREAM_THROTTLE(5, "ED LocalizationTFPlugin: map -> odom of the localization plugin is "
+                                 << map_to_odom_age << " s old and its odometry " << odom_age << " s old, using tf instead");
+    }
+
+    if (!tf_listener_)
+        tf_listener_ = new tf::TransformListener;
+
     try
     {
         tf::StampedTransform t_pose;
@@ -61,7 +90,7 @@ void LocalizationTFPlugin::process(const ed::WorldModel& world, ed::UpdateReques
     }
     catch(tf::TransformException& exc)
     {
-        ROS_ERROR_STREAM("ED LocalizationTFPlugin: " << exc.what());
+        ROS_ERROR_STREAM_THROTTLE(5, "ED LocalizationTFPlugin: " << exc.what());
     }
 }
 
@@ -9,6 +9,8 @@
 // TF
 #include <tf/transform_listener.h>
 
+#include "pose_channel.h"
+
 class LocalizationTFPlugin : public ed::Plugin
 {
 
@@ -27,6 +29,21 @@ public:
 private:
 
     std::string robot_name_;
+
+    // Map -> odom and odometry written by the localization plugin, if it runs in the same process. The pose is their
+    // product, so it follows the odometry between scans instead of lagging behind by a scan period plus the
+    // processing time.
+    std::shared_ptr<PoseChannel> map_to_odom_channel_;
+    std::shared_ptr<PoseChannel> odom_channel_;
+
+    // Map -> odom is written after every scan (also if the filter skips it), so while the localization runs, its
+    // age is at most a scan period plus the processing time. If it is older than this (in seconds), e.g., because
+    // the localization plugin stopped, or the odometry is older than max_odom_age_, the pose is taken from tf
+    // instead. max_pose_age_ must be larger than the scan period.
+    double max_pose_age_;
+    double max_odom_age_;
+
+    // Only created if the pose is not available from the channel
     tf::TransformListener* tf_listener_;
 
 };
@@ -0,0 +1,468 @@
+#include "map_artifacts.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+// Increase the version if the layout of the file or of any of the sections changes
+const char FILE_MAGIC[8] = { 'E', 'D', 'L', 'O', 'C', 'M', 'A', 'P' };
+const uint32_t FILE_VERSION = 1;
+
+struct FileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t num_sections;
+};
+
+// Followed by the slot name and the data, both padded to a multiple of 8 bytes
+struct SectionHeader
+{
+    uint64_t key;
+    uint32_t type;
+    uint32_t slot_size;
+    uint64_t size;
+};
+
+// Entity lines: number of lines, followed by (x1, y1, x2, y2) per line
+struct EntityLinesHeader
+{
+    uint64_t num_lines;
+};
+
+// Likelihood field: followed by width * height cell values (row-major)
+struct LikelihoodFieldHeader
+{
+    double origin_x;
+    double origin_y;
+    double resolution;
+    int32_t width;
+    int32_t height;
+    float outside_value;
+    uint32_t padding;
+};
+
+inline uint64_t padded(uint64_t size)
+{
+    return (size + 7) & ~(uint64_t)7;
+}
+
+// Writes all bytes (write() may write less than requested)
+bool writeAll(int fd, const void* data, std::size_t size)
+{
+    const char* p = static_cast<const char*>(data);
+    while (size > 0)
+    {
+        ssize_t n = write(fd, p, size);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+template<typename T>
+void append(std::vector<unsigned char>& data, const T& value)
+{
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&value);
+    data.insert(data.end(), bytes, bytes + sizeof(T));
+}
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+MapArtifacts::MapArtifacts() : modified_(false), mapping_size_(0)
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+MapArtifacts::~MapArtifacts()
+{
+    unmap();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void MapArtifacts::unmap()
+{
+    mapping_.reset();
+    mapping_size_ = 0;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool MapArtifacts::load(const std::string& filename, std::string& error)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    sections_.clear();
+    modified_ = false;
+    unmap();
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        error = "Could not open '" + filename + "': " + std::strerror(errno);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(FileHeader))
+    {
+        close(fd);
+        error = "'" + filename + "' is not a map artifacts file";
+        return false;
+    }
+
+    // The mapping stays valid after closing the file (and if the file is replaced by save())
+    void* mapping = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED)
+    {
+        error = "Could not map '" + filename + "': " + std::strerror(errno);
+        return false;
+    }
+
+    std::size_t mapping_size = st.st_size;
+    mapping_ = std::shared_ptr<const void>(mapping, [mapping_size](const void* p) { munmap(const_cast<void*>(p), mapping_size); });
+    mapping_size_ = mapping_size;
+
+    const unsigned char* data = static_cast<const unsigned char*>(mapping);
+
+    FileHeader header;
+    std::memcpy(&header, data, sizeof(header));
+
+    if (std::memcmp(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC)) != 0)
+    {
+        unmap();
+        error = "'" + filename + "' is not a map artifacts file";
+        return false;
+    }
+
+    if (header.version != FILE_VERSION)
+    {
+        unmap();
+        error = "'" + filename + "' has version " + std::to_string(header.version) + ", expected version "
+                + std::to_string(FILE_VERSION);
+        return false;
+    }
+
+    // Index the sections. Their data is only read (and paged in) when they are looked up.
+    uint64_t offset = sizeof(FileHeader);
+    for(uint32_t i = 0; i < header.num_sections; ++i)
+    {
+        SectionHeader section_header;
+        if (offset + sizeof(section_header) > mapping_size_)
+            break;
+
+        std::memcpy(&section_header, data + offset, sizeof(section_header));
+        offset += sizeof(section_header);
+
+        uint64_t slot_offset = offset;
+        offset += padded(section_header.slot_size);
+
+        if (offset + section_header.size > mapping_size_)
+            break;
+
+        Section& section = sections_[section_header.key];
+        section.type = section_header.type;
+        section.slot.assign(reinterpret_cast<const char*>(data + slot_offset), section_header.slot_size);
+        section.data = data + offset;
+        section.size = section_header.size;
+        section.owner = mapping_;
+
+        offset += padded(section_header.size);
+    }
+
+    if (sections_.size() != header.num_sections || offset != mapping_size_)
+    {
+        sections_.clear();
+        unmap();
+        error = "'" + filename + "' is truncated or corrupt";
+        return false;
+    }
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool MapArtifacts::save(const std::string& filename, std::string& error)
+{
+    // Write to a temporary file first, and only replace the file once the data is on disk (fsync), such that a
+    // crash leaves either the old or the new file behind. The rename itself is made durable by syncing the directory.
+    std::string tmp_filename = filename + ".tmp";
+
+    int fd = open(tmp_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        error = "Could not write '" + tmp_filename + "': " + std::strerror(errno);
+        return false;
+    }
+
+    // Snapshot of the sections. The copies share the data with the sections (which stays alive if a section is
+    // replaced meanwhile), so the lookups and additions do not wait for the disk.
+    std::vector<std::pair<uint64_t, Section> > sections;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        sections.assign(sections_.begin(), sections_.end());
+
+        // Artifacts that are added from now on are only in the next save (every failure below marks them modified again)
+        modified_ = false;
+    }
+
+    FileHeader header;
+    std::memcpy(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC));
+    header.version = FILE_VERSION;
+    header.num_sections = sections.size();
+    bool ok = writeAll(fd, &header, sizeof(header));
+
+    const char zeros[8] = { 0 };
+    for(std::vector<std::pair<uint64_t, Section> >::const_iterator it = sections.begin(); ok && it != sections.end(); ++it)
+    {
+        const Section& section = it->second;
+
+        SectionHeader section_header;
+        section_header.key = it->first;
+        section_header.type = section.type;
+        section_header.slot_size = section.slot.size();
+        section_header.size = section.size;
+
+        ok = writeAll(fd, &section_header, sizeof(section_header))
+                && writeAll(fd, section.slot.data(), section.slot.size())
+                && writeAll(fd, zeros, padded(section.slot.size()) - section.slot.size())
+                && writeAll(fd, section.data, section.size)
+                && writeAll(fd, zeros, padded(section.size) - section.size);
+    }
+
+    if (!ok || fsync(fd) != 0)
+    {
+        error = "Could not write '" + tmp_filename + "': " + std::strerror(errno);
+        close(fd);
+        unlink(tmp_filename.c_str());
+        markModified();
+        return false;
+    }
+
+    close(fd);
+
+    if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0)
+    {
+        error = "Could not replace '" + filename + "': " + std::strerror(errno);
+        unlink(tmp_filename.c_str());
+        markModified();
+        return false;
+    }
+
+    std::string::size_type i_slash = filename.rfind('/');
+    std::string dirname = (i_slash == std::string::npos) ? "." : (i_slash == 0 ? "/" : filename.substr(0, i_slash));
+
+    int dir_fd = open(dirname.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0 || fsync(dir_fd) != 0)
+    {
+        error = "Could not sync directory '" + dirname + "': " + std::strerror(errno);
+        if (dir_fd >= 0)
+            close(dir_fd);
+        markModified();
+        return false;
+    }
+
+    close(dir_fd);
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void MapArtifacts::markModified()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    modified_ = true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool MapArtifacts::modified() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return modified_;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+MapArtifacts::Section* MapArtifacts::findSection(uint64_t key, SectionType type)
+{
+    std::unordered_map<uint64_t, Section>::iterator it = sections_.find(key);
+    if (it == sections_.end() || it->second.type != type)
+        return 0;
+
+    return &it->second;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void MapArtifacts::addSection(uint64_t key, SectionType type, const std::string& slot, std::vector<unsigned char>& data)
+{
+    // Remove the (outdated) artifact in the same slot
+    for(std::unordered_map<uint64_t, Section>::iterator it = sections_.begin(); it != sections_.end();)
+    {
+        if (it->second.type == (uint32_t)type && it->second.slot == slot)
+            it = sections_.erase(it);
+        else
+            ++it;
+    }
+
+    std::shared_ptr<std::vector<unsigned char> > owned_data = std::make_shared<std::vector<unsigned char> >();
+    owned_data->swap(data);
+
+    Section& section = sections_[key];
+    section.type = type;
+    section.slot = slot;
+    section.data = owned_data->data();
+    section.size = owned_data->size();
+    section.owner = owned_data;
+
+    modified_ = true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool MapArtifacts::findEntityLines(uint64_t key, std::vector<geo::Vec2>& lines_start, std::vector<geo::Vec2>& lines_end)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    const Section* section = findSection(key, ENTITY_LINES);
+    if (!section || section->size < sizeof(EntityLinesHeader))
+        return false;
+
+    EntityLinesHeader header;
+    std::memcpy(&header, section->data, sizeof(header));
+
+    if (section->size != sizeof(header) + header.num_lines * 4 * sizeof(double))
+        return false;
+
+    std::vector<double> coordinates(header.num_lines * 4);
+    std::memcpy(coordinates.data(), section->data + sizeof(header), coordinates.size() * sizeof(double));
+
+    lines_start.resize(header.num_lines);
+    lines_end.resize(header.num_lines);
+    for(uint64_t i = 0; i < header.num_lines; ++i)
+    {
+        lines_start[i] = geo::Vec2(coordinates[4 * i], coordinates[4 * i + 1]);
+        lines_end[i] = geo::Vec2(coordinates[4 * i + 2], coordinates[4 * i + 3]);
+    }
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void MapArtifacts::addEntityLines(uint64_t key, const std::string& id, const std::vector<geo::Vec2>& lines_start,
+                                  const std::vector<geo::Vec2>& lines_end)
+{
+    std::vector<unsigned char> data;
+    data.reserve(sizeof(EntityLinesHeader) + lines_start.size() * 4 * sizeof(double));
+
+    EntityLinesHeader header;
+    header.num_lines = lines_start.size();
+    append(data, header);
+
+    for(unsigned int i = 0; i < lines_start.size(); ++i)
+    {
+        append(data, lines_start[i].x);
+        append(data, lines_start[i].y);
+        append(data, lines_end[i].x);
+        append(data, lines_end[i].y);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    addSection(key, ENTITY_LINES, id, data);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void MapArtifacts::getLikelihoodField(const std::string& slot, const std::vector<geo::Vec2>& lines_start,
+                                      const std::vector<geo::Vec2>& lines_end, double resolution, double max_distance,
+                                      double z_hit, double sigma_hit, double z_rand, LikelihoodField& field)
+{
+    // The order of the lines depends on the order of the entities, so combine the line hashes in an
+    // order-independent way
+    uint64_t lines_hash = 0;
+    for(unsigned int i = 0; i < lines_start.size(); ++i)
+    {
+        ArtifactHash h;
+        h.add(lines_start[i].x);
+        h.add(lines_start[i].y);
+        h.add(lines_end[i].x);
+        h.add(lines_end[i].y);
+        lines_hash += h.value();
+    }
+
+    ArtifactHash h;
+    h.add(&lines_hash, sizeof(lines_hash));
+    h.add(resolution);
+    h.add(max_distance);
+    h.add(z_hit);
+    h.add(sigma_hit);
+    h.add(z_rand);
+    uint64_t key = h.value();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        const Section* section = findSection(key, LIKELIHOOD_FIELD);
+        if (section && section->size >= sizeof(LikelihoodFieldHeader))
+        {
+            LikelihoodFieldHeader header;
+            std::memcpy(&header, section->data, sizeof(header));
+
+            if (header.width >= 0 && header.height >= 0
+                    && section->size == sizeof(header) + (uint64_t)header.width * header.height * sizeof(float))
+            {
+                field.assign(geo::Vec2(header.origin_x, header.origin_y), header.resolution, header.width, header.height,
+                             header.outside_value, reinterpret_cast<const float*>(section->data + sizeof(header)));
+                return;
+            }
+        }
+    }
+
+    // Not available: build it (without holding the lock) and store it
+    field.build(lines_start, lines_end, resolution, max_distance, z_hit, sigma_hit, z_rand);
+
+    std::vector<unsigned char> data;
+    data.reserve(sizeof(LikelihoodFieldHeader) + field.width() * field.height() * sizeof(float));
+
+    LikelihoodFieldHeader header;
+    header.origin_x = field.origin().x;
+    header.origin_y = field.origin().y;
+    header.resolution = field.resolution();
+    header.width = field.width();
+    header.height = field.height();
+    header.outside_value = field.outsideValue();
+    header.padding = 0;
+    append(data, header);
+
+    const unsigned char* cells = reinterpret_cast<const unsigned char*>(field.data());
+    data.insert(data.end(), cells, cells + field.width() * field.height() * sizeof(float));
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    addSection(key, LIKELIHOOD_FIELD, slot, data);
+}
@@ -0,0 +1,126 @@
+#ifndef ED_LOCALIZATION_MAP_ARTIFACTS_H_
+#define ED_LOCALIZATION_MAP_ARTIFACTS_H_
+
+#include "likelihood_field.h"
+
+#include <geolib/datatypes.h>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// ----------------------------------------------------------------------------------------------------
+
+// 64-bit FNV-1a hash, used to key the artifacts on the data they were derived from
+class ArtifactHash
+{
+
+public:
+
+    ArtifactHash() : value_(14695981039346656037ull) {}
+
+    void add(const void* data, std::size_t size)
+    {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for(std::size_t i = 0; i < size; ++i)
+            value_ = (value_ ^ bytes[i]) * 1099511628211ull;
+    }
+
+    void add(double v) { add(&v, sizeof(v)); }
+
+    void add(const std::string& s) { add(s.data(), s.size()); }
+
+    uint64_t value() const { return value_; }
+
+private:
+
+    uint64_t value_;
+
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Precomputed map artifacts (the cross section lines of the entities and likelihood fields), stored in
+// a versioned binary file such that they do not have to be rebuilt on startup. Every artifact is keyed
+// on a hash of the data and parameters it was derived from, so stale artifacts are never used. The file
+// is memory-mapped: only the artifacts that are looked up are read from disk.
+//
+// Every artifact also has a slot (the entity id, or the user of the likelihood field). Adding an artifact
+// replaces the artifact in the same slot, such that the file does not grow if the map changes. Thread-safe.
+class MapArtifacts
+{
+
+public:
+
+    MapArtifacts();
+
+    ~MapArtifacts();
+
+    // Memory-maps the file. Returns false if it does not exist or can not be used (e.g., another version)
+    bool load(const std::string& filename, std::string& error);
+
+    // Writes the artifacts to a temporary file, which then replaces 'filename' once it is synced to disk. Can be
+    // called while artifacts are added from other threads: the lock is only held to take a snapshot of the
+    // sections, not while writing.
+    bool save(const std::string& filename, std::string& error);
+
+    // True if artifacts were added since loading or saving
+    bool modified() const;
+
+    // Cross section lines (in the map frame) of an entity
+    bool findEntityLines(uint64_t key, std::vector<geo::Vec2>& lines_start, std::vector<geo::Vec2>& lines_end);
+
+    void addEntityLines(uint64_t key, const std::string& id, const std::vector<geo::Vec2>& lines_start,
+                        const std::vector<geo::Vec2>& lines_end);
+
+    // Loads the likelihood field of the lines and parameters if available. Otherwise, builds it and adds it
+    // to the given slot.
+    void getLikelihoodField(const std::string& slot, const std::vector<geo::Vec2>& lines_start, const std::vector<geo::Vec2>& lines_end,
+                            double resolution, double max_distance, double z_hit, double sigma_hit, double z_rand,
+                            LikelihoodField& field);
+
+private:
+
+    enum SectionType
+    {
+        ENTITY_LINES = 1,
+        LIKELIHOOD_FIELD = 2
+    };
+
+    struct Section
+    {
+        uint32_t type;
+        std::string slot;
+        const unsigned char* data;  // Points into the mapping, or into data owned by the section
+        uint64_t size;
+
+        // The mapping or the owned data. Shared, such that a copy of the section (see save()) keeps the data alive
+        // after the section is replaced or the file is unmapped.
+        std::shared_ptr<const void> owner;
+    };
+
+    mutable std::mutex mutex_;
+
+    std::unordered_map<uint64_t, Section> sections_;
+
+    bool modified_;
+
+    // Memory mapping of the loaded file (unmapped once no section refers to it anymore)
+    std::shared_ptr<const void> mapping_;
+    std::size_t mapping_size_;
+
+    void unmap();
+
+    // Locks the mutex
+    void markModified();
+
+    Section* findSection(uint64_t key, SectionType type);
+
+    void addSection(uint64_t key, SectionType type, const std::string& slot, std::vector<unsigned char>& data);
+
+};
+
+#endif
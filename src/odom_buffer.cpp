@@ -0,0 +1,168 @@
+#include "odom_buffer.h"
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+// If a transform is this much older than the newest one, time jumped back (s)
+const double MAX_TIME_JUMP_BACK = 1.0;
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+OdomBuffer::OdomBuffer() : begin_(0), size_(0)
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+OdomBuffer::~OdomBuffer()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void OdomBuffer::setCapacity(unsigned int capacity)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    samples_.resize(capacity);
+    begin_ = 0;
+    size_ = 0;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void OdomBuffer::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    begin_ = 0;
+    size_ = 0;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool OdomBuffer::empty() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return size_ == 0;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void OdomBuffer::add(const ros::Time& stamp, const tf::Transform& transform)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (samples_.empty())
+        return;
+
+    if (size_ > 0)
+    {
+        const ros::Time& newest = at(size_ - 1).stamp;
+        if (stamp <= newest)
+        {
+            if ((newest - stamp).toSec() <= MAX_TIME_JUMP_BACK)
+                return;
+
+            begin_ = 0;
+            size_ = 0;
+        }
+    }
+
+    Sample* sample;
+    if (size_ < samples_.size())
+    {
+        sample = &samples_[(begin_ + size_) % samples_.size()];
+        ++size_;
+    }
+    else
+    {
+        // Overwrite the oldest sample
+        sample = &samples_[begin_];
+        begin_ = (begin_ + 1) % samples_.size();
+    }
+
+    sample->stamp = stamp;
+    sample->origin = transform.getOrigin();
+    sample->rotation = transform.getRotation();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+TransformStatus OdomBuffer::interpolate(const ros::Time& stamp, unsigned int& hint, tf::Transform& transform) const
+{
+    if (size_ == 0)
+        return UNKNOWN_ERROR;
+
+    if (stamp > at(size_ - 1).stamp)
+        return TOO_RECENT;
+
+    if (stamp < at(0).stamp)
+        return TOO_OLD;
+
+    // Find the first sample that is not older than the stamp. Starting from the hint, this is a forward
+    // scan if the stamps increase. Otherwise, fall back to a binary search.
+    unsigned int i;
+    if (hint < size_ && at(hint).stamp <= stamp)
+    {
+        i = hint;
+        while (at(i).stamp < stamp)
+            ++i;
+    }
+    else
+    {
+        unsigned int lo = 0;
+        unsigned int hi = size_ - 1;
+        while (lo < hi)
+        {
+            unsigned int mid = (lo + hi) / 2;
+            if (at(mid).stamp < stamp)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        i = lo;
+    }
+
+    hint = i;
+
+    const Sample& s2 = at(i);
+    if (i == 0 || s2.stamp == stamp)
+    {
+        transform = tf::Transform(s2.rotation, s2.origin);
+        return OK;
+    }
+
+    const Sample& s1 = at(i - 1);
+    double t = (stamp - s1.stamp).toSec() / (s2.stamp - s1.stamp).toSec();
+
+    transform = tf::Transform(s1.rotation.slerp(s2.rotation, t), s1.origin.lerp(s2.origin, t));
+    return OK;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+TransformStatus OdomBuffer::lookup(const ros::Time& stamp, tf::Transform& transform) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    unsigned int hint = size_;
+    return interpolate(stamp, hint, transform);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void OdomBuffer::lookup(const std::vector<ros::Time>& stamps, std::vector<tf::Transform>& transforms,
+                        std::vector<TransformStatus>& status) const
+{
+    transforms.resize(stamps.size());
+    status.resize(stamps.size());
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    unsigned int hint = size_;
+    for(unsigned int i = 0; i < stamps.size(); ++i)
+        status[i] = interpolate(stamps[i], hint, transforms[i]);
+}
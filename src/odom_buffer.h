@@ -0,0 +1,79 @@
+#ifndef ED_LOCALIZATION_ODOM_BUFFER_H_
+#define ED_LOCALIZATION_ODOM_BUFFER_H_
+
+#include <ros/time.h>
+#include <tf/transform_datatypes.h>
+
+#include <mutex>
+#include <vector>
+
+// ----------------------------------------------------------------------------------------------------
+
+enum TransformStatus
+{
+    TOO_RECENT,
+    TOO_OLD,
+    OK,
+    UNKNOWN_ERROR
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Ring buffer of the latest odom -> base_link transforms (e.g., taken from /tf), of which the transform at
+// any buffered time is interpolated like tf does (linear in position, slerp in rotation). Unlike a tf
+// lookup, this does not throw if the time is outside the buffer, but returns why. Thread-safe.
+class OdomBuffer
+{
+
+public:
+
+    OdomBuffer();
+
+    ~OdomBuffer();
+
+    // Sets the maximum number of buffered transforms (0 = disabled). Clears the buffer.
+    void setCapacity(unsigned int capacity);
+
+    unsigned int capacity() const { return samples_.size(); }
+
+    void clear();
+
+    bool empty() const;
+
+    // Adds a transform. Transforms must be added in time order: older ones are ignored, unless time
+    // jumped back more than a second (e.g., a restarted simulation or bag), which clears the buffer.
+    void add(const ros::Time& stamp, const tf::Transform& transform);
+
+    TransformStatus lookup(const ros::Time& stamp, tf::Transform& transform) const;
+
+    // Looks up the transforms at all stamps at once. If the stamps are increasing (e.g., the stamps of
+    // buffered scans), this takes a single pass over the buffer.
+    void lookup(const std::vector<ros::Time>& stamps, std::vector<tf::Transform>& transforms,
+                std::vector<TransformStatus>& status) const;
+
+private:
+
+    struct Sample
+    {
+        ros::Time stamp;
+        tf::Vector3 origin;
+        tf::Quaternion rotation;
+    };
+
+    mutable std::mutex mutex_;
+
+    std::vector<Sample> samples_;
+
+    // Index of the oldest sample, and number of samples
+    unsigned int begin_;
+    unsigned int size_;
+
+    const Sample& at(unsigned int i) const { return samples_[(begin_ + i) % samples_.size()]; }
+
+    // Interpolates the transform at 'stamp'. 'hint' is the index of the first sample that is not older
+    // than the previous stamp, and is updated. Must be called with the mutex locked.
+    TransformStatus interpolate(const ros::Time& stamp, unsigned int& hint, tf::Transform& transform) const;
+
+};
+
+#endif
@@ -2,28 +2,6 @@
 
 // ----------------------------------------------------------------------------------------------------
 
-// Draw randomly from a zero-mean Gaussian distribution, with standard
-// deviation sigma.
-// We use the polar form of the Box-Muller transformation, explained here:
-//   http://www.taygeta.com/random/gaussian.html
-double generateRandomGaussian(double sigma)
-{
-    double x1, x2, w, r;
-
-    do
-    {
-        do { r = drand48(); } while (r==0.0);
-        x1 = 2.0 * r - 1.0;
-        do { r = drand48(); } while (r==0.0);
-        x2 = 2.0 * r - 1.0;
-        w = x1*x1 + x2*x2;
-    } while(w > 1.0 || w==0.0);
-
-    return(sigma * x2 * sqrt(-2.0*log(w)/w));
-}
-
-// ----------------------------------------------------------------------------------------------------
-
 OdomModel::OdomModel()
 {
     alpha1 = 0.2;
@@ -64,19 +42,63 @@ void OdomModel::updatePoses(const Transform& movement, double dt, ParticleFilter
     double rot_hat_stddev = sqrt(alpha4 * delta_rot_sq + alpha2 * delta_trans_sq);
     double strafe_hat_stddev = sqrt(alpha1 * delta_rot_sq + alpha5 * delta_trans_sq);
 
-    for(std::vector<Sample>::iterator it = pf.samples().begin(); it != pf.samples().end(); ++it)
-    {
-        Sample& sample = *it;
+    // If the robot did not move, the noise is zero as well, so the samples do not change
+    if (delta_trans_sq < 1e-18 && std::abs(delta_rot) < 1e-9)
+        return;
 
-        // Sample pose differences
-        double delta_trans_hat = generateRandomGaussian(trans_hat_stddev);
-        double delta_rot_hat = generateRandomGaussian(rot_hat_stddev);
-        double delta_strafe_hat = generateRandomGaussian(strafe_hat_stddev);
+    SampleSet& samples = pf.sampleSet();
+
+    // Draw the (standard normal) noise for all samples at once
+    noise_.resize(3 * samples.size());
+    pf.rng().fillGaussian(noise_.data(), noise_.size());
+
+    // Composition of each sample pose with the movement and noise (pose * movement * noise), worked out
+    // directly on (x, y, theta). The rotation matrix of the sample is taken from the cached cos / sin, so
+    // the only trigonometry per sample is the sin / cos of the new rotation.
+    const double m_x = movement.translation().x;
+    const double m_y = movement.translation().y;
+    const double m_cos = movement.matrix().R.xx;
+    const double m_sin = movement.matrix().R.yx;
 
-        geo::Transform2 noise;
-        noise.t = geo::Vec2(delta_trans_hat, delta_strafe_hat);
-        noise.setRotation(delta_rot_hat);
+    double* x = samples.x.data();
+    double* y = samples.y.data();
+    double* theta = samples.theta.data();
+    double* cos_theta = samples.cos_theta.data();
+    double* sin_theta = samples.sin_theta.data();
+    const double* noise = noise_.data();
 
-        sample.pose.set(sample.pose.matrix() * movement.matrix() * noise);
+    for(unsigned int i = 0; i < samples.size(); ++i)
+    {
+        // Sample pose differences
+        double delta_trans_hat = trans_hat_stddev * noise[3 * i];
+        double delta_rot_hat = rot_hat_stddev * noise[3 * i + 1];
+        double delta_strafe_hat = strafe_hat_stddev * noise[3 * i + 2];
+
+        double c = cos_theta[i];
+        double s = sin_theta[i];
+
+        // Apply movement
+        double x1 = x[i] + c * m_x - s * m_y;
+        double y1 = y[i] + s * m_x + c * m_y;
+        double c1 = c * m_cos - s * m_sin;
+        double s1 = s * m_cos + c * m_sin;
+
+        // Apply noise
+        x[i] = x1 + c1 * delta_trans_hat - s1 * delta_strafe_hat;
+        y[i] = y1 + s1 * delta_trans_hat + c1 * delta_strafe_hat;
+
+        // Keep the rotation in [-pi, pi] (the change per update is small)
+        double a = theta[i] + delta_rot + delta_rot_hat;
+        if (a > M_PI)
+            a -= 2 * M_PI;
+        else if (a < -M_PI)
+            a += 2 * M_PI;
+
+        theta[i] = a;
+        cos_theta[i] = std::cos(a);
+        sin_theta[i] = std::sin(a);
     }
+
+    // All samples moved the same, so the clusters can follow without clustering again
+    pf.moveClusters(movement.matrix());
 }
@@ -27,6 +27,9 @@ private:
     double alpha4;
     double alpha5;
 
+    // Buffer for the noise of all samples
+    std::vector<double> noise_;
+
 };
 
 #endif
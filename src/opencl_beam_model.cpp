@@ -0,0 +1,519 @@
+#include "opencl_beam_model.h"
+
+#include <cmath>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+// Single precision kernel arguments
+struct KernelInput
+{
+    std::vector<float> lines;        // 4 per line
+    std::vector<float> beam_angles;
+    std::vector<float> beam_dirs;    // 2 per beam
+    std::vector<float> sensor_ranges;
+    std::vector<float> poses;        // 8 per pose
+
+    unsigned int num_lines;
+    unsigned int num_beams;
+    unsigned int num_poses;
+
+    float range_min;
+    float render_range;
+    float range_max;
+    float z_hit;
+    float inv_two_sigma_hit_sq;
+    float z_short_lambda;
+    float lambda_short;
+    float z_max;
+    float z_rand_term;
+
+    void set(const std::vector<geo::Vec2>& lines_start, const std::vector<geo::Vec2>& lines_end,
+             const std::vector<double>& beam_angles_in, const std::vector<geo::Vec2>& beam_dirs_in,
+             const std::vector<double>& sensor_ranges_in, const geo::Transform2& laser_offset,
+             const std::vector<geo::Transform2>& sample_poses, const OpenCLBeamModelParams& params)
+    {
+        num_lines = lines_start.size();
+        num_beams = sensor_ranges_in.size();
+        num_poses = sample_poses.size();
+
+        lines.resize(4 * num_lines);
+        for(unsigned int i = 0; i < num_lines; ++i)
+        {
+            lines[4 * i] = lines_start[i].x;
+            lines[4 * i + 1] = lines_start[i].y;
+            lines[4 * i + 2] = lines_end[i].x;
+            lines[4 * i + 3] = lines_end[i].y;
+        }
+
+        beam_angles.assign(beam_angles_in.begin(), beam_angles_in.end());
+        sensor_ranges.assign(sensor_ranges_in.begin(), sensor_ranges_in.end());
+
+        beam_dirs.resize(2 * num_beams);
+        for(unsigned int i = 0; i < num_beams; ++i)
+        {
+            beam_dirs[2 * i] = beam_dirs_in[i].x;
+            beam_dirs[2 * i + 1] = beam_dirs_in[i].y;
+        }
+
+        // The kernel transforms the lines to the laser frame, so it needs the inverse laser poses
+        poses.resize(8 * num_poses);
+        for(unsigned int j = 0; j < num_poses; ++j)
+        {
+            geo::Transform2 pose_inv = (sample_poses[j] * laser_offset).inverse();
+
+            float* p = &poses[8 * j];
+            p[0] = pose_inv.R.xx;
+            p[1] = pose_inv.R.xy;
+            p[2] = pose_inv.R.yx;
+            p[3] = pose_inv.R.yy;
+            p[4] = pose_inv.t.x;
+            p[5] = pose_inv.t.y;
+            p[6] = p[7] = 0;
+        }
+
+        range_min = params.range_min;
+        render_range = params.render_range;
+        range_max = params.range_max;
+        z_hit = params.z_hit;
+        inv_two_sigma_hit_sq = 1.0 / (2 * params.sigma_hit * params.sigma_hit);
+        z_short_lambda = params.z_short * params.lambda_short;
+        lambda_short = params.lambda_short;
+        z_max = params.z_max;
+        z_rand_term = params.z_rand / params.range_max;
+    }
+};
+
+// Host build of the kernel: the OpenCL C types and built-ins it uses
+namespace host
+{
+
+struct float2 { float x, y; };
+struct float4 { float x, y, z, w; };
+struct float8 { float s0, s1, s2, s3, s4, s5, s6, s7; };
+
+const float M_PI_F = 3.14159265358979323846f;
+
+thread_local unsigned int global_id = 0;
+
+inline unsigned int get_global_id(unsigned int) { return global_id; }
+
+using std::atan2;
+using std::exp;
+using std::fabs;
+using std::floor;
+using std::fmin;
+using std::log;
+
+#define __kernel
+#define __global
+#define ED_LOCALIZATION_BEAM_MODEL_KERNEL(...) __VA_ARGS__
+#include "opencl_beam_model_kernel.h"
+#undef ED_LOCALIZATION_BEAM_MODEL_KERNEL
+#undef __global
+#undef __kernel
+
+} // end namespace host
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void OpenCLBeamModel::calculateLogLikelihoodsOnHost(const std::vector<geo::Vec2>& lines_start, const std::vector<geo::Vec2>& lines_end,
+                                                    const std::vector<double>& beam_angles, const std::vector<geo::Vec2>& beam_dirs,
+                                                    const std::vector<double>& sensor_ranges, const geo::Transform2& laser_offset,
+                                                    const std::vector<geo::Transform2>& sample_poses, const OpenCLBeamModelParams& params,
+                                                    std::vector<double>& log_likelihoods)
+{
+    if (sensor_ranges.empty() || sample_poses.empty())
+    {
+        log_likelihoods.assign(sample_poses.size(), 0);
+        return;
+    }
+
+    KernelInput in;
+    in.set(lines_start, lines_end, beam_angles, beam_dirs, sensor_ranges, laser_offset, sample_poses, params);
+
+    std::vector<float> model_ranges((size_t)in.num_poses * in.num_beams);
+    std::vector<float> result(in.num_poses);
+
+    // One 'work item' at a time
+    for(unsigned int j = 0; j < in.num_poses; ++j)
+    {
+        host::global_id = j;
+        host::beamModel(reinterpret_cast<const host::float4*>(in.lines.data()), in.num_lines,
+                        in.beam_angles.data(), reinterpret_cast<const host::float2*>(in.beam_dirs.data()),
+                        in.sensor_ranges.data(), in.num_beams,
+                        reinterpret_cast<const host::float8*>(in.poses.data()), in.num_poses,
+                        model_ranges.data(), in.range_min, in.render_range, in.range_max, in.z_hit,
+                        in.inv_two_sigma_hit_sq, in.z_short_lambda, in.lambda_short, in.z_max, in.z_rand_term,
+                        result.data());
+    }
+
+    log_likelihoods.assign(result.begin(), result.end());
+}
+
+#ifdef ED_LOCALIZATION_OPENCL
+
+#define CL_TARGET_OPENCL_VERSION 120
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include <algorithm>
+#include <sstream>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+// One work item per sample pose (see opencl_beam_model_kernel.h)
+#define ED_LOCALIZATION_BEAM_MODEL_KERNEL(...) #__VA_ARGS__
+const char* KERNEL_SOURCE =
+#include "opencl_beam_model_kernel.h"
+;
+#undef ED_LOCALIZATION_BEAM_MODEL_KERNEL
+
+std::string errorString(const std::string& what, cl_int err)
+{
+    std::stringstream s;
+    s << what << " failed (OpenCL error " << err << ")";
+    return s.str();
+}
+
+// Device buffer that only grows
+struct Buffer
+{
+    Buffer() : mem(0), size(0) {}
+
+    cl_mem mem;
+    size_t size;
+
+    void release()
+    {
+        if (mem)
+            clReleaseMemObject(mem);
+        mem = 0;
+        size = 0;
+    }
+
+    cl_int reserve(cl_context context, cl_mem_flags flags, size_t bytes)
+    {
+        // Zero-sized buffers are not allowed
+        bytes = std::max<size_t>(bytes, 16);
+        if (bytes <= size)
+            return CL_SUCCESS;
+
+        release();
+
+        cl_int err;
+        mem = clCreateBuffer(context, flags, bytes, 0, &err);
+        if (err == CL_SUCCESS)
+            size = bytes;
+        else
+            mem = 0;
+
+        return err;
+    }
+};
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+struct OpenCLBeamModel::Context
+{
+    Context() : context(0), queue(0), program(0), kernel(0) {}
+
+    ~Context()
+    {
+        lines.release();
+        beam_angles.release();
+        beam_dirs.release();
+        sensor_ranges.release();
+        poses.release();
+        model_ranges.release();
+        log_likelihoods.release();
+
+        if (kernel)
+            clReleaseKernel(kernel);
+        if (program)
+            clReleaseProgram(program);
+        if (queue)
+            clReleaseCommandQueue(queue);
+        if (context)
+            clReleaseContext(context);
+    }
+
+    cl_context context;
+    cl_command_queue queue;
+    cl_program program;
+    cl_kernel kernel;
+
+    Buffer lines, beam_angles, beam_dirs, sensor_ranges, poses, model_ranges, log_likelihoods;
+
+    // Single precision host copies of the uploaded data, and the result
+    KernelInput input;
+    std::vector<cl_float> log_likelihoods_data;
+
+    cl_int upload(Buffer& buffer, cl_mem_flags flags, const std::vector<float>& data)
+    {
+        cl_int err = buffer.reserve(context, flags, data.size() * sizeof(cl_float));
+        if (err != CL_SUCCESS || data.empty())
+            return err;
+
+        return clEnqueueWriteBuffer(queue, buffer.mem, CL_FALSE, 0, data.size() * sizeof(cl_float), data.data(), 0, 0, 0);
+    }
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+OpenCLBeamModel::OpenCLBeamModel() : context_(0)
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+OpenCLBeamModel::~OpenCLBeamModel()
+{
+    delete context_;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool OpenCLBeamModel::initialize(std::string& error)
+{
+    if (context_)
+        return true;
+
+    cl_uint num_platforms = 0;
+    if (clGetPlatformIDs(0, 0, &num_platforms) != CL_SUCCESS || num_platforms == 0)
+    {
+        error = "no OpenCL platform found";
+        return false;
+    }
+
+    std::vector<cl_platform_id> platforms(num_platforms);
+    clGetPlatformIDs(num_platforms, platforms.data(), 0);
+
+    // Prefer a GPU, but take any device otherwise
+    cl_device_id device = 0;
+    for(int pass = 0; pass < 2 && !device; ++pass)
+    {
+        cl_device_type type = (pass == 0) ? CL_DEVICE_TYPE_GPU : CL_DEVICE_TYPE_ALL;
+        for(unsigned int i = 0; i < platforms.size() && !device; ++i)
+        {
+            cl_uint num_devices = 0;
+            if (clGetDeviceIDs(platforms[i], type, 1, &device, &num_devices) != CL_SUCCESS || num_devices == 0)
+                device = 0;
+        }
+    }
+
+    if (!device)
+    {
+        error = "no OpenCL device found";
+        return false;
+    }
+
+    Context* c = new Context;
+
+    cl_int err;
+    c->context = clCreateContext(0, 1, &device, 0, 0, &err);
+    if (err != CL_SUCCESS)
+    {
+        error = errorString("Creating the OpenCL context", err);
+        delete c;
+        return false;
+    }
+
+    c->queue = clCreateCommandQueue(c->context, device, 0, &err);
+    if (err != CL_SUCCESS)
+    {
+        error = errorString("Creating the OpenCL command queue", err);
+        delete c;
+        return false;
+    }
+
+    c->program = clCreateProgramWithSource(c->context, 1, &KERNEL_SOURCE, 0, &err);
+    if (err == CL_SUCCESS)
+        err = clBuildProgram(c->program, 1, &device, "-cl-fast-relaxed-math", 0, 0);
+
+    if (err != CL_SUCCESS)
+    {
+        error = errorString("Building the OpenCL kernel", err);
+
+        size_t log_size = 0;
+        if (c->program && clGetProgramBuildInfo(c->program, device, CL_PROGRAM_BUILD_LOG, 0, 0, &log_size) == CL_SUCCESS && log_size > 1)
+        {
+            std::vector<char> log(log_size);
+            clGetProgramBuildInfo(c->program, device, CL_PROGRAM_BUILD_LOG, log_size, log.data(), 0);
+            error += ": " + std::string(log.data());
+        }
+
+        delete c;
+        return false;
+    }
+
+    c->kernel = clCreateKernel(c->program, "beamModel", &err);
+    if (err != CL_SUCCESS)
+    {
+        error = errorString("Creating the OpenCL kernel", err);
+        delete c;
+        return false;
+    }
+
+    size_t name_size = 0;
+    if (clGetDeviceInfo(device, CL_DEVICE_NAME, 0, 0, &name_size) == CL_SUCCESS && name_size > 1)
+    {
+        std::vector<char> name(name_size);
+        clGetDeviceInfo(device, CL_DEVICE_NAME, name_size, name.data(), 0);
+        device_name_ = name.data();
+    }
+
+    context_ = c;
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool OpenCLBeamModel::calculateLogLikelihoods(const std::vector<geo::Vec2>& lines_start, const std::vector<geo::Vec2>& lines_end,
+                                              const std::vector<double>& beam_angles, const std::vector<geo::Vec2>& beam_dirs,
+                                              const std::vector<double>& sensor_ranges, const geo::Transform2& laser_offset,
+                                              const std::vector<geo::Transform2>& sample_poses, const OpenCLBeamModelParams& params,
+                                              std::vector<double>& log_likelihoods, std::string& error)
+{
+    if (!context_)
+    {
+        error = "OpenCL is not initialized";
+        return false;
+    }
+
+    // Without beams, all samples are equally likely: log(1)
+    if (sensor_ranges.empty() || sample_poses.empty())
+    {
+        log_likelihoods.assign(sample_poses.size(), 0);
+        return true;
+    }
+
+    Context& c = *context_;
+    KernelInput& in = c.input;
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Upload the lines, beams and sample poses
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+    in.set(lines_start, lines_end, beam_angles, beam_dirs, sensor_ranges, laser_offset, sample_poses, params);
+
+    cl_int err = c.upload(c.lines, CL_MEM_READ_ONLY, in.lines);
+    if (err == CL_SUCCESS)
+        err = c.upload(c.beam_angles, CL_MEM_READ_ONLY, in.beam_angles);
+    if (err == CL_SUCCESS)
+        err = c.upload(c.beam_dirs, CL_MEM_READ_ONLY, in.beam_dirs);
+    if (err == CL_SUCCESS)
+        err = c.upload(c.sensor_ranges, CL_MEM_READ_ONLY, in.sensor_ranges);
+    if (err == CL_SUCCESS)
+        err = c.upload(c.poses, CL_MEM_READ_ONLY, in.poses);
+    if (err == CL_SUCCESS)
+        err = c.model_ranges.reserve(c.context, CL_MEM_READ_WRITE, (size_t)in.num_poses * in.num_beams * sizeof(cl_float));
+    if (err == CL_SUCCESS)
+        err = c.log_likelihoods.reserve(c.context, CL_MEM_WRITE_ONLY, in.num_poses * sizeof(cl_float));
+
+    if (err != CL_SUCCESS)
+    {
+        error = errorString("Uploading the beam model data", err);
+        return false;
+    }
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Run the kernel
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+    cl_uint arg = 0;
+    clSetKernelArg(c.kernel, arg++, sizeof(cl_mem), &c.lines.mem);
+    clSetKernelArg(c.kernel, arg++, sizeof(cl_uint), &in.num_lines);
+    clSetKernelArg(c.kernel, arg++, sizeof(cl_mem), &c.beam_angles.mem);
+    clSetKernelArg(c.kernel, arg++, sizeof(cl_mem), &c.beam_dirs.mem);
+    clSetKernelArg(c.kernel, arg++, sizeof(cl_mem), &c.sensor_ranges.mem);
+    clSetKernelArg(c.kernel, arg++, sizeof(cl_uint), &in.num_beams);
+    clSetKernelArg(c.kernel, arg++, sizeof(cl_mem), &c.poses.mem);
+    clSetKernelArg(c.kernel, arg++, sizeof(cl_uint), &in.num_poses);
+    clSetKernelArg(c.kernel, arg++, sizeof(cl_mem), &c.model_ranges.mem);
+    clSetKernelArg(c.kernel, arg++, sizeof(cl_float), &in.range_min);
+    clSetKernelArg(c.kernel, arg++, sizeof(cl_float), &in.render_range);
+    clSetKernelArg(c.kernel, arg++, sizeof(cl_float), &in.range_max);
+    clSetKernelArg(c.kernel, arg++, sizeof(cl_float), &in.z_hit);
+    clSetKernelArg(c.kernel, arg++, sizeof(cl_float), &in.inv_two_sigma_hit_sq);
+    clSetKernelArg(c.kernel, arg++, sizeof(cl_float), &in.z_short_lambda);
+    clSetKernelArg(c.kernel, arg++, sizeof(cl_float), &in.lambda_short);
+    clSetKernelArg(c.kernel, arg++, sizeof(cl_float), &in.z_max);
+    clSetKernelArg(c.kernel, arg++, sizeof(cl_float), &in.z_rand_term);
+    err = clSetKernelArg(c.kernel, arg++, sizeof(cl_mem), &c.log_likelihoods.mem);
+
+    // The work group size is left to the implementation
+    size_t global_size = in.num_poses;
+    if (err == CL_SUCCESS)
+        err = clEnqueueNDRangeKernel(c.queue, c.kernel, 1, 0, &global_size, 0, 0, 0, 0);
+
+    // Blocking read: also waits for the uploads and the kernel
+    c.log_likelihoods_data.resize(in.num_poses);
+    if (err == CL_SUCCESS)
+        err = clEnqueueReadBuffer(c.queue, c.log_likelihoods.mem, CL_TRUE, 0, in.num_poses * sizeof(cl_float),
+                                  c.log_likelihoods_data.data(), 0, 0, 0);
+
+    if (err != CL_SUCCESS)
+    {
+        error = errorString("Running the beam model kernel", err);
+        return false;
+    }
+
+    log_likelihoods.assign(c.log_likelihoods_data.begin(), c.log_likelihoods_data.end());
+    return true;
+}
+
+#else
+
+// ----------------------------------------------------------------------------------------------------
+
+struct OpenCLBeamModel::Context
+{
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+OpenCLBeamModel::OpenCLBeamModel() : context_(0)
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+OpenCLBeamModel::~OpenCLBeamModel()
+{
+    delete context_;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool OpenCLBeamModel::initialize(std::string& error)
+{
+    error = "built without OpenCL support (see the ED_LOCALIZATION_OPENCL CMake option)";
+    return false;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool OpenCLBeamModel::calculateLogLikelihoods(const std::vector<geo::Vec2>&, const std::vector<geo::Vec2>&,
+                                              const std::vector<double>&, const std::vector<geo::Vec2>&,
+                                              const std::vector<double>&, const geo::Transform2&,
+                                              const std::vector<geo::Transform2>&, const OpenCLBeamModelParams&,
+                                              std::vector<double>&, std::string& error)
+{
+    error = "built without OpenCL support";
+    return false;
+}
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef ED_LOCALIZATION_OPENCL_BEAM_MODEL_H_
+#define ED_LOCALIZATION_OPENCL_BEAM_MODEL_H_
+
+#include <geolib/datatypes.h>
+
+#include <string>
+#include <vector>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Parameters of the beam model mixture (see LaserModel)
+struct OpenCLBeamModelParams
+{
+    double z_hit;
+    double sigma_hit;
+    double z_short;
+    double lambda_short;
+    double z_max;
+    double z_rand;
+    double range_max;
+
+    // Lines closer than range_min or further away than render_range are not rendered
+    double range_min;
+    double render_range;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Beam model weight update on an OpenCL device (e.g., a GPU), for large sample sets. The lines and the beams
+// are uploaded once per update, after which one work item per sample pose renders the expected ranges and
+// scores the beams. This is the same model as the CPU version, but in single precision, with the exponentials
+// calculated directly instead of taken from the lookup tables, and without the segment grid (every work item
+// renders all selected lines). benchmark/opencl_check.cpp compares it with the CPU version.
+//
+// Only available if built with the ED_LOCALIZATION_OPENCL CMake option; otherwise initialize() fails.
+class OpenCLBeamModel
+{
+
+public:
+
+    OpenCLBeamModel();
+
+    ~OpenCLBeamModel();
+
+    OpenCLBeamModel(const OpenCLBeamModel&) = delete;
+    OpenCLBeamModel& operator=(const OpenCLBeamModel&) = delete;
+
+    // Selects a device (a GPU if there is one) and builds the kernel. Returns false, with the reason in
+    // 'error', if this is not possible.
+    bool initialize(std::string& error);
+
+    bool initialized() const { return context_ != 0; }
+
+    // Name of the selected device (empty if not initialized)
+    const std::string& deviceName() const { return device_name_; }
+
+    // Calculates the log likelihood of the beams for every sample pose. The lines are in the map frame, the
+    // beam angles (increasing) and directions in the laser frame, and the laser offset is the pose of the laser
+    // relative to the sample pose. Returns false, with the reason in 'error', if the device failed.
+    bool calculateLogLikelihoods(const std::vector<geo::Vec2>& lines_start, const std::vector<geo::Vec2>& lines_end,
+                                 const std::vector<double>& beam_angles, const std::vector<geo::Vec2>& beam_dirs,
+                                 const std::vector<double>& sensor_ranges, const geo::Transform2& laser_offset,
+                                 const std::vector<geo::Transform2>& sample_poses, const OpenCLBeamModelParams& params,
+                                 std::vector<double>& log_likelihoods, std::string& error);
+
+    // Runs the same kernel on the host, one work item at a time, with the same arguments. Available without
+    // OpenCL, to check the kernel against the CPU model. Unlike on the device, the math is not relaxed
+    // (-cl-fast-relaxed-math), so this does not show the error of the device itself.
+    static void calculateLogLikelihoodsOnHost(const std::vector<geo::Vec2>& lines_start, const std::vector<geo::Vec2>& lines_end,
+                                              const std::vector<double>& beam_angles, const std::vector<geo::Vec2>& beam_dirs,
+                                              const std::vector<double>& sensor_ranges, const geo::Transform2& laser_offset,
+                                              const std::vector<geo::Transform2>& sample_poses, const OpenCLBeamModelParams& params,
+                                              std::vector<double>& log_likelihoods);
+
+private:
+
+    // OpenCL objects and device buffers (only defined if built with OpenCL)
+    struct Context;
+    Context* context_;
+
+    std::string device_name_;
+
+};
+
+#endif
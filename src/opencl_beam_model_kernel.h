@@ -0,0 +1,152 @@
+// Beam model kernel of OpenCLBeamModel: one work item per sample pose. The expected ranges are rendered like
+// LaserModel::renderLine and scored like calculateBeamLikelihoodScalar.
+//
+// The kernel is written in the common subset of OpenCL C and C++ (no vector literals or vector arithmetic),
+// such that the same source is built for the device (as a string) and compiled for the host, to check the
+// device against the CPU (see OpenCLBeamModel::calculateLogLikelihoodsOnHost). The includer defines
+// ED_LOCALIZATION_BEAM_MODEL_KERNEL to either stringify or expand its argument, so there is no include guard.
+
+ED_LOCALIZATION_BEAM_MODEL_KERNEL(
+
+// Normalizes an angle to [-pi, pi)
+inline float normalizeAngle(float a)
+{
+    return a - 2 * M_PI_F * floor((a + M_PI_F) / (2 * M_PI_F));
+}
+
+// Index of the first beam angle that is not less than a (lower_bound), or greater than a (upper_bound)
+inline unsigned int lowerBound(__global const float* angles, unsigned int n, float a)
+{
+    unsigned int lo = 0;
+    while (lo < n)
+    {
+        unsigned int mid = (lo + n) / 2;
+        if (angles[mid] < a)
+            lo = mid + 1;
+        else
+            n = mid;
+    }
+    return lo;
+}
+
+inline unsigned int upperBound(__global const float* angles, unsigned int n, float a)
+{
+    unsigned int lo = 0;
+    while (lo < n)
+    {
+        unsigned int mid = (lo + n) / 2;
+        if (angles[mid] <= a)
+            lo = mid + 1;
+        else
+            n = mid;
+    }
+    return lo;
+}
+
+__kernel void beamModel(__global const float4* lines,        // (x1, y1, x2, y2) in the map frame
+                        const unsigned int num_lines,
+                        __global const float* beam_angles,
+                        __global const float2* beam_dirs,
+                        __global const float* sensor_ranges,
+                        const unsigned int num_beams,
+                        __global const float8* poses,        // Inverse laser poses: (R.xx, R.xy, R.yx, R.yy, t.x, t.y, -, -)
+                        const unsigned int num_poses,
+                        __global float* model_ranges,        // num_poses x num_beams
+                        const float range_min,
+                        const float render_range,
+                        const float range_max,
+                        const float z_hit,
+                        const float inv_two_sigma_hit_sq,
+                        const float z_short_lambda,
+                        const float lambda_short,
+                        const float z_max,
+                        const float z_rand_term,
+                        __global float* log_likelihoods)
+{
+    unsigned int j = get_global_id(0);
+    if (j >= num_poses)
+        return;
+
+    float8 pose = poses[j];
+    __global float* ranges = model_ranges + (size_t)j * num_beams;
+
+    for(unsigned int i = 0; i < num_beams; ++i)
+        ranges[i] = 0;
+
+    float beam_angle_min = beam_angles[0];
+    float beam_angle_max = beam_angles[num_beams - 1];
+
+    for(unsigned int l = 0; l < num_lines; ++l)
+    {
+        float4 line = lines[l];
+
+        float2 p1;
+        p1.x = pose.s0 * line.x + pose.s1 * line.y + pose.s4;
+        p1.y = pose.s2 * line.x + pose.s3 * line.y + pose.s5;
+
+        float2 p2;
+        p2.x = pose.s0 * line.z + pose.s1 * line.w + pose.s4;
+        p2.y = pose.s2 * line.z + pose.s3 * line.w + pose.s5;
+
+        float2 e;
+        e.x = p2.x - p1.x;
+        e.y = p2.y - p1.y;
+
+        float a1 = atan2(p1.y, p1.x);
+        float a_span = normalizeAngle(atan2(p2.y, p2.x) - a1);
+        float a_start = a1;
+        if (a_span < 0)
+        {
+            a_start += a_span;
+            a_span = -a_span;
+        }
+
+        float p1_cross_e = p1.x * e.y - p1.y * e.x;
+
+        for(int k = -1; k <= 1; ++k)
+        {
+            float a_min = a_start + k * 2 * M_PI_F;
+            float a_max = a_min + a_span;
+
+            if (a_max < beam_angle_min || a_min > beam_angle_max)
+                continue;
+
+            unsigned int i_max = upperBound(beam_angles, num_beams, a_max);
+            for(unsigned int i = lowerBound(beam_angles, num_beams, a_min); i < i_max; ++i)
+            {
+                float2 d = beam_dirs[i];
+
+                float den = d.x * e.y - d.y * e.x;
+                if (den == 0)
+                    continue;
+
+                float r = p1_cross_e / den;
+                if (r <= 0 || r < range_min || r > render_range)
+                    continue;
+
+                float model_range = ranges[i];
+                if (model_range == 0 || r < model_range)
+                    ranges[i] = r;
+            }
+        }
+    }
+
+    float p = 1;
+    for(unsigned int i = 0; i < num_beams; ++i)
+    {
+        float obs_range = sensor_ranges[i];
+        float z = obs_range - ranges[i];
+        float z_abs = fmin(fabs(z), range_max);
+
+        float pz = z_hit * exp(-z_abs * z_abs * inv_two_sigma_hit_sq);
+        if (z < 0)
+            pz += z_short_lambda * exp(-lambda_short * fmin(obs_range, range_max));
+        pz += obs_range >= range_max ? z_max : z_rand_term;
+
+        p += pz * pz * pz;
+    }
+
+    log_likelihoods[j] = log(p);
+}
+
+)
@@ -1,8 +1,58 @@
 #include "particle_filter.h"
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+// Hashes a (x, y, theta) histogram bin to a single key
+inline long binKey(int x, int y, int a)
+{
+    return ((long)(x & 0xFFFFF) << 40) | ((long)(y & 0xFFFFF) << 20) | (long)(a & 0xFFFFF);
+}
+
+// Normalizes an angle to [-pi, pi)
+inline double normalizeAngle(double a)
+{
+    a = std::fmod(a + M_PI, 2 * M_PI);
+    if (a < 0)
+        a += 2 * M_PI;
+    return a - M_PI;
+}
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void SampleSet::resize(unsigned int n)
+{
+    x.resize(n);
+    y.resize(n);
+    theta.resize(n);
+    cos_theta.resize(n);
+    sin_theta.resize(n);
+    weight.resize(n);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void SampleSet::clear()
+{
+    resize(0);
+}
+
 // ----------------------------------------------------------------------------------------------------
 
-ParticleFilter::ParticleFilter() : i_current_(0)
+ParticleFilter::ParticleFilter() : i_current_(0), resample_method_(RESAMPLE_DETERMINISTIC), resample_threshold_(1),
+    ess_(0), ess_valid_(false), kld_enabled_(false),
+    kld_min_samples_(0), kld_max_samples_(0), kld_err_(0.01), kld_z_(2.33), kld_bin_size_xy_(0.5), kld_bin_size_theta_(0.17),
+    samples_valid_(true), samples_modified_(false),
+    cluster_bin_size_xy_(0.25), cluster_bin_size_theta_(0.2), clusters_valid_(false), clusters_movable_(false),
+    cluster_num_rot_bins_(1), cluster_rot_bin_size_(2 * M_PI)
 {
 }
 
@@ -17,121 +67,404 @@ ParticleFilter::~ParticleFilter()
 void ParticleFilter::initUniform(const geo::Vec2& min, const geo::Vec2& max, double t_step,
                                  double a_min, double a_max, double a_step)
 {
-    std::vector<Sample>& smpls = samples();
+    SampleSet& smpls = sampleSet();
 
     smpls.clear();
     for(double x = min.x; x < max.x; x += t_step)
         for(double y = min.y; y < max.y; y += t_step)
             for(double a = a_min; a < a_max; a += a_step)
-                smpls.push_back(Sample(geo::Transform2(x, y, a)));
+            {
+                // Go through Transform2 to keep the rotation normalized (as before the SoA storage)
+                geo::Transform2 t(x, y, a);
+
+                unsigned int i = smpls.size();
+                smpls.resize(i + 1);
+                smpls.setPose(i, t.t.x, t.t.y, t.rotation());
+            }
 
     setUniformWeights();
 }
 
 // ----------------------------------------------------------------------------------------------------
 
-bool compareSamples(const Sample& a, const Sample& b)
+void ParticleFilter::initGaussian(const std::vector<geo::Transform2>& poses, double sigma_xy, double sigma_theta,
+                                  unsigned int num_samples)
 {
-    return a.weight > b.weight;
+    SampleSet& smpls = sampleSet();
+
+    smpls.clear();
+    if (poses.empty())
+        return;
+
+    smpls.resize(std::max<unsigned int>(num_samples, poses.size()));
+    for(unsigned int i = 0; i < smpls.size(); ++i)
+    {
+        const geo::Transform2& p = poses[(unsigned long)i * poses.size() / smpls.size()];
+        smpls.setPose(i, p.t.x + sigma_xy * rng_.gaussian(), p.t.y + sigma_xy * rng_.gaussian(),
+                      p.rotation() + sigma_theta * rng_.gaussian());
+    }
+
+    setUniformWeights();
 }
 
 // ----------------------------------------------------------------------------------------------------
 
 void ParticleFilter::resample(unsigned int num_samples)
 {
-    std::vector<Sample>& old_samples = samples_[i_current_];
-    std::vector<Sample>& new_samples = samples_[1 - i_current_];
+    // Read-only: a skipped resample keeps the effective sample size of the last weight update, and the clusters
+    const SampleSet& old_samples = static_cast<const ParticleFilter&>(*this).sampleSet();
 
     if (old_samples.empty())
         return;
 
+    // Resampling only adds noise if the weights are still well-balanced. Only skip it if that does
+    // not change the requested number of samples.
+    if (resample_threshold_ < 1 && (kld_enabled_ || num_samples == 0 || num_samples == old_samples.size())
+            && effectiveSampleSize() >= resample_threshold_ * old_samples.size())
+        return;
+
+    SampleSet& new_samples = sample_sets_[1 - i_current_];
+
+    // The new samples are clustered while they are drawn: there are never more occupied bins than old samples
+    beginClusters(old_samples.size());
+
+    if (kld_enabled_)
+    {
+        resampleKLD(old_samples, new_samples);
+
+        i_current_ = 1 - i_current_;
+        samples_valid_ = false;
+        setUniformWeights();
+        finishClusters();
+        return;
+    }
+
     if (num_samples == 0)
         num_samples = old_samples.size();
 
+    new_samples.resize(num_samples);
+
+    switch (resample_method_)
+    {
+    case RESAMPLE_SYSTEMATIC:
+        resampleLowVariance(old_samples, old_samples.weight, new_samples, 0, num_samples, false);
+        break;
+    case RESAMPLE_STRATIFIED:
+        resampleLowVariance(old_samples, old_samples.weight, new_samples, 0, num_samples, true);
+        break;
+    case RESAMPLE_RESIDUAL:
+        resampleResidual(old_samples, new_samples, num_samples);
+        break;
+    default:
+        resampleDeterministic(old_samples, new_samples, num_samples);
+    }
+
+    i_current_ = 1 - i_current_;
+    samples_valid_ = false;
+
+    if (resample_method_ == RESAMPLE_DETERMINISTIC)
+        normalize();
+    else
+        setUniformWeights();  // Samples are drawn proportional to their weight, so all new samples are equally likely
+
+    finishClusters();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void ParticleFilter::resampleDeterministic(const SampleSet& old_samples, SampleSet& new_samples, unsigned int num_samples)
+{
     // Sort all samples (decreasing weight)
-    std::sort(old_samples.begin(), old_samples.end(), compareSamples);
+    std::vector<unsigned int>& order = order_;
+    order.resize(old_samples.size());
+    for(unsigned int i = 0; i < order.size(); ++i)
+        order[i] = i;
+
+    const std::vector<double>& old_weights = old_samples.weight;
+    std::sort(order.begin(), order.end(), [&old_weights](unsigned int a, unsigned int b) { return old_weights[a] > old_weights[b]; });
 
     int k = 0;
-    new_samples.resize(num_samples);
-    for(std::vector<Sample>::const_iterator it = old_samples.begin(); it != old_samples.end(); ++it)
+    for(std::vector<unsigned int>::const_iterator it = order.begin(); it != order.end(); ++it)
     {
-        const Sample& old_sample = *it;
+        unsigned int i_old = *it;
 
-        int l = std::min<int>(k + 1 + old_sample.weight * num_samples, num_samples - 1);
+        int l = std::min<int>(k + 1 + old_weights[i_old] * num_samples, num_samples - 1);
 
         for(int i = k; i <= l; ++i)
-            new_samples[i] = old_sample;
+            new_samples.copy(i, old_samples, i_old);
+
+        // The copies keep the weight of the original (the new samples are normalized afterwards)
+        addToClusters(old_samples, i_old, l - k + 1, old_weights[i_old]);
 
         k = l + 1;
 
         if (k >= num_samples)
             break;
     }
+}
 
-//    // Build up cumulative probability table for resampling.
-//    std::vector<double> cum_weights(old_samples.size());
-//    cum_weights[0] = old_samples[0].weight;
-//    for(unsigned int i = 1; i < old_samples.size(); ++i)
-//        cum_weights[i] = cum_weights[i - 1] + old_samples[i].weight;
+// ----------------------------------------------------------------------------------------------------
+
+void ParticleFilter::resampleLowVariance(const SampleSet& old_samples, const std::vector<double>& weights, SampleSet& new_samples,
+                                         unsigned int offset, unsigned int num_samples, bool stratified)
+{
+    if (num_samples == 0)
+        return;
 
-//    new_samples.resize(num_samples);
-//    for(std::vector<Sample>::iterator it = new_samples.begin(); it != new_samples.end(); ++it)
-//    {
-//        Sample& new_sample = *it;
+    double total_weight = 0;
+    for(std::vector<double>::const_iterator it = weights.begin(); it != weights.end(); ++it)
+        total_weight += *it;
 
-//        double r = ((double) rand() / (RAND_MAX));
+    // Without any weight, all samples are equally likely
+    bool uniform = !(total_weight > 0);
+    if (uniform)
+        total_weight = weights.size();
 
-//        unsigned int i_sample = 0;
-//        for(i_sample = 0; i_sample < old_samples.size(); ++i_sample)
-//        {
-//            if (r < cum_weights[i_sample])
-//                break;
-//        }
+    // Walk through the cumulative weights once, with pointers that are spaced total_weight / num_samples apart.
+    // For systematic resampling, all pointers share the same random offset, for stratified resampling every
+    // pointer gets its own random offset within its stratum.
+    double step = total_weight / num_samples;
+    double u0 = rng_.uniform();
 
-//        new_sample = old_samples[i_sample];
-//    }
+    unsigned int i_old = 0;
+    double cum_weight = uniform ? 1 : weights[0];
+    unsigned int num_copies = 0;  // Of the current old sample, added to the clusters once the walk moves past it
 
-//    new_samples[0] = best_sample;
+    for(unsigned int i = 0; i < num_samples; ++i)
+    {
+        double u = (i + (stratified ? rng_.uniform() : u0)) * step;
 
-    i_current_ = 1 - i_current_;
+        while (u > cum_weight && i_old + 1 < weights.size())
+        {
+            addToClusters(old_samples, i_old, num_copies, 1);
+            num_copies = 0;
 
-    normalize();
+            ++i_old;
+            cum_weight += uniform ? 1 : weights[i_old];
+        }
+
+        new_samples.copy(offset + i, old_samples, i_old);
+        ++num_copies;
+    }
+
+    addToClusters(old_samples, i_old, num_copies, 1);
 }
 
 // ----------------------------------------------------------------------------------------------------
 
-const Sample& ParticleFilter::bestSample() const
+void ParticleFilter::resampleResidual(const SampleSet& old_samples, SampleSet& new_samples, unsigned int num_samples)
+{
+    const std::vector<double>& weights = old_samples.weight;
+
+    double total_weight = 0;
+    for(std::vector<double>::const_iterator it = weights.begin(); it != weights.end(); ++it)
+        total_weight += *it;
+
+    if (!(total_weight > 0))
+    {
+        resampleLowVariance(old_samples, weights, new_samples, 0, num_samples, false);
+        return;
+    }
+
+    // Deterministically copy every sample floor(N * w) times, and keep the remaining fractions
+    residual_weights_.resize(weights.size());
+
+    unsigned int k = 0;
+    for(unsigned int i = 0; i < weights.size(); ++i)
+    {
+        double n_expected = num_samples * weights[i] / total_weight;
+        unsigned int n_copies = std::min<unsigned int>(n_expected, num_samples - k);
+
+        for(unsigned int j = 0; j < n_copies; ++j)
+            new_samples.copy(k + j, old_samples, i);
+
+        addToClusters(old_samples, i, n_copies, 1);
+
+        k += n_copies;
+        residual_weights_[i] = n_expected - n_copies;
+    }
+
+    // Draw the remaining samples based on the residual weights
+    resampleLowVariance(old_samples, residual_weights_, new_samples, k, num_samples - k, false);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void ParticleFilter::enableKLDSampling(unsigned int min_samples, unsigned int max_samples, double err, double z,
+                                       double bin_size_xy, double bin_size_theta)
+{
+    kld_enabled_ = true;
+    kld_min_samples_ = std::max(1u, min_samples);
+    kld_max_samples_ = std::max(kld_min_samples_, max_samples);
+    kld_err_ = err;
+    kld_z_ = z;
+    kld_bin_size_xy_ = bin_size_xy;
+    kld_bin_size_theta_ = bin_size_theta;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+unsigned int ParticleFilter::kldLimit(unsigned int num_bins) const
+{
+    if (num_bins <= 1)
+        return kld_max_samples_;
+
+    // Wilson-Hilferty approximation of the chi-square quantile (Fox, 2003)
+    double k = num_bins - 1;
+    double b = 2 / (9 * k);
+    double x = 1 - b + std::sqrt(b) * kld_z_;
+
+    double n = std::ceil(k / (2 * kld_err_) * x * x * x);
+
+    return std::min<double>(n, kld_max_samples_);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void ParticleFilter::resampleKLD(const SampleSet& old_samples, SampleSet& new_samples)
 {
-    const std::vector<Sample>& smpls = samples();
+    const std::vector<double>& weights = old_samples.weight;
+
+    // Build up cumulative probability table for resampling
+    cum_weights_.resize(weights.size());
+    double total_weight = 0;
+    for(unsigned int i = 0; i < weights.size(); ++i)
+    {
+        total_weight += weights[i];
+        cum_weights_[i] = total_weight;
+    }
+
+    bool uniform = !(total_weight > 0);
+    if (uniform)
+    {
+        for(unsigned int i = 0; i < cum_weights_.size(); ++i)
+            cum_weights_[i] = i + 1;
+        total_weight = cum_weights_.size();
+    }
+
+    // Keep drawing samples until there are enough to represent the occupied (x, y, theta) bins
+    kld_bins_.clear();
+    kld_bins_.reserve(kld_max_samples_);
 
-    const Sample* best_sample = &smpls.front();
-    for(std::vector<Sample>::const_iterator it = smpls.begin(); it != smpls.end(); ++it)
+    new_samples.resize(kld_max_samples_);
+
+    unsigned int n = 0;
+    while(n < kld_max_samples_)
     {
-        const Sample& s = *it;
-        if (s.weight > best_sample->weight)
-            best_sample = &s;
+        double r = rng_.uniform() * total_weight;
+        unsigned int i_old = std::min<std::size_t>(std::upper_bound(cum_weights_.begin(), cum_weights_.end(), r) - cum_weights_.begin(),
+                                                   cum_weights_.size() - 1);
+
+        new_samples.copy(n, old_samples, i_old);
+        addToClusters(old_samples, i_old, 1, 1);
+        ++n;
+
+        kld_bins_.insert(binKey(std::floor(old_samples.x[i_old] / kld_bin_size_xy_),
+                                std::floor(old_samples.y[i_old] / kld_bin_size_xy_),
+                                std::floor(old_samples.theta[i_old] / kld_bin_size_theta_)), true);
+
+        if (n >= kld_min_samples_ && n >= kldLimit(kld_bins_.size()))
+            break;
     }
 
-    return *best_sample;
+    new_samples.resize(n);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+SampleSet& ParticleFilter::sampleSet()
+{
+    syncSampleSet();
+
+    // The caller may change the sample set, so the AoS copy, effective sample size and clusters can no longer be trusted
+    // (unless the caller moves all samples at once, see moveClusters())
+    samples_valid_ = false;
+    ess_valid_ = false;
+    clusters_movable_ = clusters_valid_;
+    clusters_valid_ = false;
+
+    return sample_sets_[i_current_];
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+const SampleSet& ParticleFilter::sampleSet() const
+{
+    syncSampleSet();
+    return sample_sets_[i_current_];
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+std::vector<Sample>& ParticleFilter::samples()
+{
+    syncSamples();
+    samples_modified_ = true;
+    ess_valid_ = false;
+    clusters_valid_ = false;
+    clusters_movable_ = false;
+    return samples_;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+const std::vector<Sample>& ParticleFilter::samples() const
+{
+    syncSamples();
+    return samples_;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+unsigned int ParticleFilter::bestSampleIndex() const
+{
+    const SampleSet& smpls = sampleSet();
+
+    unsigned int i_best = 0;
+    for(unsigned int i = 1; i < smpls.size(); ++i)
+    {
+        if (smpls.weight[i] > smpls.weight[i_best])
+            i_best = i;
+    }
+
+    return i_best;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+const Sample& ParticleFilter::bestSample() const
+{
+    const SampleSet& smpls = sampleSet();
+
+    unsigned int i_best = bestSampleIndex();
+    best_sample_.pose.set(smpls.transform(i_best));
+    best_sample_.weight = smpls.weight[i_best];
+
+    return best_sample_;
 }
 
 // ----------------------------------------------------------------------------------------------------
 
-// TODO: deal with particle clusters (taking the average of multiple clusters of particles does not make sense)
 geo::Transform2 ParticleFilter::calculateMeanPose() const
 {
-    const std::vector<Sample>& smpls = samples();
+    const SampleSet& smpls = sampleSet();
 
     geo::Transform2 mean;
     mean.t = geo::Vec2(0, 0);
     geo::Vec2 rot_v(0, 0);
 
-    for(std::vector<Sample>::const_iterator it = smpls.begin(); it != smpls.end(); ++it)
+    const double* x = smpls.x.data();
+    const double* y = smpls.y.data();
+    const double* c = smpls.cos_theta.data();
+    const double* s = smpls.sin_theta.data();
+    const double* w = smpls.weight.data();
+
+    for(unsigned int i = 0; i < smpls.size(); ++i)
     {
-        const Sample& s = *it;
-        mean.t += s.weight * s.pose.matrix().t;
-        rot_v.x += s.weight * s.pose.matrix().R.xx;
-        rot_v.y += s.weight * s.pose.matrix().R.yx;
+        mean.t.x += w[i] * x[i];
+        mean.t.y += w[i] * y[i];
+        rot_v.x += w[i] * c[i];
+        rot_v.y += w[i] * s[i];
     }
 
     rot_v.normalize();
@@ -145,31 +478,423 @@ geo::Transform2 ParticleFilter::calculateMeanPose() const
 
 // ----------------------------------------------------------------------------------------------------
 
+void ParticleFilter::setClusterBinSize(double bin_size_xy, double bin_size_theta)
+{
+    cluster_bin_size_xy_ = bin_size_xy;
+    cluster_bin_size_theta_ = bin_size_theta;
+    clusters_valid_ = false;
+    clusters_movable_ = false;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+const std::vector<PoseCluster>& ParticleFilter::clusters() const
+{
+    if (!clusters_valid_)
+        updateClusters();
+
+    return clusters_;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void ParticleFilter::ClusterMoments::add(const ClusterMoments& other)
+{
+    w += other.w;
+    wx += other.wx;
+    wy += other.wy;
+    wxx += other.wxx;
+    wxy += other.wxy;
+    wyy += other.wyy;
+    wc += other.wc;
+    ws += other.ws;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void ParticleFilter::ClusterStatistics::add(const ClusterStatistics& other)
+{
+    num_samples += other.num_samples;
+    weighted.add(other.weighted);
+    unweighted.add(other.unweighted);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void ParticleFilter::beginClusters(unsigned int max_bins) const
+{
+    clusters_.clear();
+    cluster_bins_.clear();
+    cluster_bin_index_.clear();
+
+    // With a fixed sample count, these only grow once
+    clusters_.reserve(max_bins);
+    cluster_bins_.reserve(max_bins);
+    cluster_stats_.reserve(max_bins);
+
+    cluster_num_rot_bins_ = std::max<int>(1, 2 * M_PI / cluster_bin_size_theta_);
+    cluster_rot_bin_size_ = 2 * M_PI / cluster_num_rot_bins_;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void ParticleFilter::addToClusters(const SampleSet& samples, unsigned int i, unsigned int count, double weight) const
+{
+    if (count == 0)
+        return;
+
+    int bx = std::floor(samples.x[i] / cluster_bin_size_xy_);
+    int by = std::floor(samples.y[i] / cluster_bin_size_xy_);
+    int ba = (int)std::floor((normalizeAngle(samples.theta[i]) + M_PI) / cluster_rot_bin_size_) % cluster_num_rot_bins_;
+
+    std::pair<int*, bool> res = cluster_bin_index_.insert(binKey(bx, by, ba), (int)cluster_bins_.size());
+
+    if (res.second)
+    {
+        ClusterBin bin;
+        bin.x = bx;
+        bin.y = by;
+        bin.a = ba;
+        bin.parent = cluster_bins_.size();
+        cluster_bins_.push_back(bin);
+    }
+
+    ClusterStatistics& st = cluster_bins_[*res.first].stats;
+
+    double n = count;
+    double x = samples.x[i];
+    double y = samples.y[i];
+    double c = samples.cos_theta[i];
+    double s = samples.sin_theta[i];
+
+    ClusterMoments& u = st.unweighted;
+    u.w += n;
+    u.wx += n * x;
+    u.wy += n * y;
+    u.wxx += n * x * x;
+    u.wxy += n * x * y;
+    u.wyy += n * y * y;
+    u.wc += n * c;
+    u.ws += n * s;
+
+    st.num_samples += count;
+
+    double w = n * weight;
+    if (!(w > 0))
+        return;
+
+    ClusterMoments& m = st.weighted;
+    m.w += w;
+    m.wx += w * x;
+    m.wy += w * y;
+    m.wxx += w * x * x;
+    m.wxy += w * x * y;
+    m.wyy += w * y * y;
+    m.wc += w * c;
+    m.ws += w * s;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void ParticleFilter::finishClusters() const
+{
+    int num_rot_bins = cluster_num_rot_bins_;
+
+    // Merge neighboring bins (including diagonal neighbors, and wrapping around in rotation)
+    for(unsigned int i = 0; i < cluster_bins_.size(); ++i)
+    {
+        const ClusterBin& bin = cluster_bins_[i];
+
+        for(int dx = -1; dx <= 1; ++dx)
+            for(int dy = -1; dy <= 1; ++dy)
+                for(int da = -1; da <= 1; ++da)
+                {
+                    int a = (bin.a + da + num_rot_bins) % num_rot_bins;
+                    const int* j = cluster_bin_index_.find(binKey(bin.x + dx, bin.y + dy, a));
+                    if (!j)
+                        continue;
+
+                    int root_i = findRoot(cluster_bins_, i);
+                    int root_j = findRoot(cluster_bins_, *j);
+                    if (root_i != root_j)
+                        cluster_bins_[std::max(root_i, root_j)].parent = std::min(root_i, root_j);
+                }
+    }
+
+    // Sum the statistics per cluster
+    cluster_stats_.assign(cluster_bins_.size(), ClusterStatistics());
+    ClusterStatistics total;
+    for(unsigned int i = 0; i < cluster_bins_.size(); ++i)
+    {
+        cluster_stats_[findRoot(cluster_bins_, i)].add(cluster_bins_[i].stats);
+        total.add(cluster_bins_[i].stats);
+    }
+
+    for(unsigned int i = 0; i < cluster_stats_.size(); ++i)
+    {
+        const ClusterStatistics& st = cluster_stats_[i];
+        if (st.num_samples == 0)
+            continue;
+
+        PoseCluster c;
+        c.num_samples = st.num_samples;
+
+        // Without any weight in the whole filter, the cluster weight is its share of the samples
+        if (total.weighted.w > 0)
+            c.weight = st.weighted.w / total.weighted.w;
+        else
+            c.weight = (double)st.num_samples / total.num_samples;
+
+        // Without any weight in the cluster, all its samples count equally
+        const ClusterMoments& m = st.weighted.w > 0 ? st.weighted : st.unweighted;
+
+        double mx = m.wx / m.w;
+        double my = m.wy / m.w;
+
+        c.mean_rotation = std::atan2(m.ws, m.wc);
+        c.mean = geo::Transform2(mx, my, c.mean_rotation);
+
+        c.cov_xx = std::max(0.0, m.wxx / m.w - mx * mx);
+        c.cov_xy = m.wxy / m.w - mx * my;
+        c.cov_yy = std::max(0.0, m.wyy / m.w - my * my);
+
+        // Circular variance, based on the length of the mean rotation vector
+        double r = std::sqrt(m.wc * m.wc + m.ws * m.ws) / m.w;
+        c.cov_rotation = -2 * std::log(std::max(1e-9, std::min(1.0, r)));
+
+        clusters_.push_back(c);
+    }
+
+    std::sort(clusters_.begin(), clusters_.end(), [](const PoseCluster& a, const PoseCluster& b) { return a.weight > b.weight; });
+
+    clusters_valid_ = true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void ParticleFilter::updateClusters() const
+{
+    const SampleSet& smpls = sampleSet();
+
+    beginClusters(smpls.size());
+    for(unsigned int i = 0; i < smpls.size(); ++i)
+        addToClusters(smpls, i, 1, smpls.weight[i]);
+    finishClusters();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void ParticleFilter::moveClusters(const geo::Transform2& movement)
+{
+    if (!clusters_movable_)
+        return;
+
+    clusters_movable_ = false;
+
+    // Every sample moves by R(theta_i) * t, so the mean position moves by the mean of R(theta_i) * t, which is
+    // R(mean_rotation) * t scaled by the length of the mean rotation vector
+    for(std::vector<PoseCluster>::iterator it = clusters_.begin(); it != clusters_.end(); ++it)
+    {
+        PoseCluster& c = *it;
+
+        double r = std::exp(-c.cov_rotation / 2);
+        c.mean.t += c.mean.R * movement.t * r;
+        c.mean.R = c.mean.R * movement.R;
+        c.mean_rotation = c.mean.rotation();
+    }
+
+    clusters_valid_ = true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+int ParticleFilter::findRoot(std::vector<ClusterBin>& bins, int i)
+{
+    while (bins[i].parent != i)
+    {
+        // Path halving
+        bins[i].parent = bins[bins[i].parent].parent;
+        i = bins[i].parent;
+    }
+    return i;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
 void ParticleFilter::normalize()
 {
-    std::vector<Sample>& smpls = samples();
+    std::vector<double>& weights = sampleSet().weight;
 
     double total_weight = 0;
-    for(std::vector<Sample>::iterator it = smpls.begin(); it != smpls.end(); ++it)
-        total_weight += it->weight;
+    double total_weight_sq = 0;
+    for(std::vector<double>::const_iterator it = weights.begin(); it != weights.end(); ++it)
+    {
+        total_weight += *it;
+        total_weight_sq += *it * *it;
+    }
+
+    scaleWeights(total_weight, total_weight_sq);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void ParticleFilter::updateWeights(const std::vector<double>& log_weight_updates, const std::vector<unsigned int>& index)
+{
+    if (log_weight_updates.empty())
+        return;
+
+    // Since the current weights are normalized, shifting the (log) updates by their maximum keeps the
+    // largest new weight in the order of 1 / N. The exponents only have to be calculated once per update.
+    double max_log_update = *std::max_element(log_weight_updates.begin(), log_weight_updates.end());
+
+    exp_weight_updates_.resize(log_weight_updates.size());
+    for(unsigned int j = 0; j < log_weight_updates.size(); ++j)
+        exp_weight_updates_[j] = std::exp(log_weight_updates[j] - max_log_update);
+
+    // Single pass over the samples: update, and sum the weights and squared weights
+    std::vector<double>& weights = sampleSet().weight;
+    new_weights_.resize(weights.size());
+
+    double total_weight = 0;
+    double total_weight_sq = 0;
+    for(unsigned int i = 0; i < weights.size(); ++i)
+    {
+        double w = weights[i] * exp_weight_updates_[index[i]];
+        new_weights_[i] = w;
+        total_weight += w;
+        total_weight_sq += w * w;
+    }
+
+    if (!(total_weight > 0))
+    {
+        // All weights underflowed: the samples that are most likely now had a (nearly) zero weight
+        // before. Do the update fully in log space instead.
+        double max_log_weight = -std::numeric_limits<double>::infinity();
+        for(unsigned int i = 0; i < weights.size(); ++i)
+        {
+            new_weights_[i] = std::log(weights[i]) + log_weight_updates[index[i]];
+            max_log_weight = std::max(max_log_weight, new_weights_[i]);
+        }
+
+        total_weight = 0;
+        total_weight_sq = 0;
+        if (max_log_weight > -std::numeric_limits<double>::infinity())
+        {
+            for(unsigned int i = 0; i < weights.size(); ++i)
+            {
+                double w = std::exp(new_weights_[i] - max_log_weight);
+                new_weights_[i] = w;
+                total_weight += w;
+                total_weight_sq += w * w;
+            }
+        }
+    }
+
+    weights.swap(new_weights_);
+
+    scaleWeights(total_weight, total_weight_sq);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void ParticleFilter::scaleWeights(double total_weight, double total_weight_sq)
+{
+    std::vector<double>& weights = sampleSet().weight;
 
     if (total_weight > 0)
     {
-        for(std::vector<Sample>::iterator it = smpls.begin(); it != smpls.end(); ++it)
-            it->weight /= total_weight;
+        double f = 1.0 / total_weight;
+        for(std::vector<double>::iterator it = weights.begin(); it != weights.end(); ++it)
+            *it *= f;
+
+        ess_ = total_weight * total_weight / total_weight_sq;
     }
     else
     {
         setUniformWeights();
+        ess_ = weights.size();
     }
+
+    ess_valid_ = true;
 }
 
 // ----------------------------------------------------------------------------------------------------
 
-void ParticleFilter::setUniformWeights()
+double ParticleFilter::effectiveSampleSize() const
 {
-    double uni_weight = 1.0 / samples().size();
-    for(std::vector<Sample>::iterator it = samples().begin(); it != samples().end(); ++it)
-        it->weight = uni_weight;
+    if (ess_valid_)
+        return ess_;
+
+    const std::vector<double>& weights = sampleSet().weight;
+
+    double total_weight = 0;
+    double total_weight_sq = 0;
+    for(std::vector<double>::const_iterator it = weights.begin(); it != weights.end(); ++it)
+    {
+        total_weight += *it;
+        total_weight_sq += *it * *it;
+    }
+
+    ess_ = total_weight > 0 ? total_weight * total_weight / total_weight_sq : weights.size();
+    ess_valid_ = true;
+    return ess_;
 }
 
+// ----------------------------------------------------------------------------------------------------
+
+void ParticleFilter::syncSamples() const
+{
+    if (samples_valid_)
+        return;
+
+    const SampleSet& smpls = sample_sets_[i_current_];
+
+    samples_.resize(smpls.size());
+    for(unsigned int i = 0; i < smpls.size(); ++i)
+    {
+        Sample& s = samples_[i];
+        s.weight = smpls.weight[i];
+        s.pose.set(smpls.transform(i));
+    }
+
+    samples_valid_ = true;
+    samples_modified_ = false;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void ParticleFilter::syncSampleSet() const
+{
+    if (!samples_modified_)
+        return;
+
+    // The AoS copy is the most recent version: write it back. This only changes the representation
+    // of the samples, which is why it is allowed from const accessors
+    SampleSet& smpls = const_cast<SampleSet&>(sample_sets_[i_current_]);
+
+    smpls.resize(samples_.size());
+    for(unsigned int i = 0; i < samples_.size(); ++i)
+    {
+        const Sample& s = samples_[i];
+        const geo::Transform2& t = s.pose.matrix();
+        smpls.x[i] = t.t.x;
+        smpls.y[i] = t.t.y;
+        smpls.theta[i] = s.pose.rotation();
+        smpls.cos_theta[i] = t.R.xx;
+        smpls.sin_theta[i] = t.R.yx;
+        smpls.weight[i] = s.weight;
+    }
+
+    samples_modified_ = false;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void ParticleFilter::setUniformWeights()
+{
+    std::vector<double>& weights = sampleSet().weight;
+    std::fill(weights.begin(), weights.end(), 1.0 / weights.size());
+
+    ess_ = weights.size();
+    ess_valid_ = true;
+}
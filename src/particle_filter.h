@@ -1,8 +1,13 @@
 #ifndef ED_LOCALIZATION_PARTICLE_FILTER_H_
 #define ED_LOCALIZATION_PARTICLE_FILTER_H_
 
+#include "flat_hash_map.h"
+#include "random.h"
+
 #include <geolib/datatypes.h>
 
+#include <vector>
+
 // ----------------------------------------------------------------------------------------------------
 
 class Transform
@@ -51,11 +56,85 @@ struct Sample
 
 // ----------------------------------------------------------------------------------------------------
 
+// Structure-of-arrays storage of samples. Next to the pose (x, y, theta) and weight, the cosine and
+// sine of theta are stored, such that they do not have to be recalculated every time the rotation
+// matrix is needed.
+struct SampleSet
+{
+    std::vector<double> x;
+    std::vector<double> y;
+    std::vector<double> theta;
+    std::vector<double> cos_theta;
+    std::vector<double> sin_theta;
+    std::vector<double> weight;
+
+    inline unsigned int size() const { return x.size(); }
+
+    inline bool empty() const { return x.empty(); }
+
+    void resize(unsigned int n);
+
+    void clear();
+
+    inline void setPose(unsigned int i, double x_, double y_, double theta_)
+    {
+        x[i] = x_;
+        y[i] = y_;
+        theta[i] = theta_;
+        cos_theta[i] = std::cos(theta_);
+        sin_theta[i] = std::sin(theta_);
+    }
+
+    inline geo::Transform2 transform(unsigned int i) const
+    {
+        return geo::Transform2(geo::Mat2(cos_theta[i], -sin_theta[i], sin_theta[i], cos_theta[i]), geo::Vec2(x[i], y[i]));
+    }
+
+    // Copies sample i of 'other' to sample j of this set
+    inline void copy(unsigned int j, const SampleSet& other, unsigned int i)
+    {
+        x[j] = other.x[i];
+        y[j] = other.y[i];
+        theta[j] = other.theta[i];
+        cos_theta[j] = other.cos_theta[i];
+        sin_theta[j] = other.sin_theta[i];
+        weight[j] = other.weight[i];
+    }
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Cluster of samples (a mode of the posterior), with its weighted mean and covariance
+struct PoseCluster
+{
+    double weight;      // Sum of the (normalized) sample weights
+    unsigned int num_samples;
+
+    geo::Transform2 mean;
+    double mean_rotation;
+
+    double cov_xx, cov_xy, cov_yy;  // m^2
+    double cov_rotation;            // rad^2 (circular variance)
+};
+
+// ----------------------------------------------------------------------------------------------------
+
 class ParticleFilter
 {
 
 public:
 
+    enum ResampleMethod
+    {
+        // Sorts the samples by weight, and copies every sample at least twice until the buffer is full
+        RESAMPLE_DETERMINISTIC,
+
+        // O(N) methods that draw samples proportional to their weight (low variance)
+        RESAMPLE_SYSTEMATIC,
+        RESAMPLE_STRATIFIED,
+        RESAMPLE_RESIDUAL
+    };
+
     ParticleFilter();
 
     ~ParticleFilter();
@@ -63,25 +142,217 @@ public:
     void initUniform(const geo::Vec2& min, const geo::Vec2& max, double t_step,
                      double a_min, double a_max, double a_step);
 
+    // Initializes num_samples samples, evenly divided over the given poses, each with gaussian noise
+    void initGaussian(const std::vector<geo::Transform2>& poses, double sigma_xy, double sigma_theta,
+                      unsigned int num_samples);
+
+    // Resamples, unless a resample threshold is set and the effective sample size is still above it
     void resample(unsigned int num_samples = 0);
 
-    std::vector<Sample>& samples() { return samples_[i_current_]; }
+    // Only resample if the effective sample size drops below ratio * number of samples. With a
+    // ratio of 1 or more (default), the filter always resamples.
+    void setResampleThreshold(double ratio) { resample_threshold_ = ratio; }
+
+    void setResampleMethod(ResampleMethod method) { resample_method_ = method; }
+
+    ResampleMethod resampleMethod() const { return resample_method_; }
 
-    const std::vector<Sample>& samples() const { return samples_[i_current_]; }
+    // Enables KLD-sampling: during resampling, the number of samples is chosen such that, with probability
+    // given by quantile 'z', the error between the sample-based and true posterior is less than 'err'. The
+    // posterior is approximated by a histogram over (x, y, theta) bins. The number of samples argument of
+    // resample() is ignored if KLD-sampling is enabled.
+    void enableKLDSampling(unsigned int min_samples, unsigned int max_samples, double err, double z,
+                           double bin_size_xy, double bin_size_theta);
 
+    void disableKLDSampling() { kld_enabled_ = false; }
+
+    // Structure-of-arrays access to the current samples. This is the actual storage and should be
+    // preferred in performance critical code. The non-const version invalidates the effective sample size
+    // and the clusters, so code that only reads the samples should use the const version.
+    SampleSet& sampleSet();
+
+    const SampleSet& sampleSet() const;
+
+    // Array-of-structs access to the current samples. This is an adapter around the sample set: the
+    // vector is a copy that is only (re)created when it is requested after the sample set changed.
+    // Changes made to the returned vector are written back on the next sampleSet() call.
+    std::vector<Sample>& samples();
+
+    const std::vector<Sample>& samples() const;
+
+    unsigned int bestSampleIndex() const;
+
+    // Returns a copy of the best sample. The reference stays valid until the next call.
     const Sample& bestSample() const;
 
+    // Weighted mean of all samples. If the samples form multiple clusters, use bestCluster() instead.
     geo::Transform2 calculateMeanPose() const;
 
+    // Clusters of samples, sorted on decreasing weight. Samples are binned on a (x, y, rotation) grid,
+    // and neighboring occupied bins form one cluster. The clusters are accumulated while resampling (or
+    // calculated when requested after the samples changed otherwise).
+    const std::vector<PoseCluster>& clusters() const;
+
+    // Cluster with the highest weight. The filter must contain samples.
+    const PoseCluster& bestCluster() const { return clusters().front(); }
+
+    // Moves the clusters along with a motion that was applied to all samples through sampleSet() (e.g., by the
+    // motion model), such that they do not have to be recalculated until the next weight update. Only has an
+    // effect if the clusters were up to date before that sampleSet() call. The covariances are kept as they
+    // are (they do not include the motion noise).
+    void moveClusters(const geo::Transform2& movement);
+
+    void setClusterBinSize(double bin_size_xy, double bin_size_theta);
+
     void normalize();
 
+    // Multiplies the weight of every sample i by exp(log_weight_updates[index[i]]) and normalizes. The
+    // updates are shifted by their maximum before taking the exponent, so very small likelihoods do not
+    // underflow. Also computes the effective sample size, in the same pass. Only the update is done in log
+    // space: the stored weights stay linear (and normalized).
+    void updateWeights(const std::vector<double>& log_weight_updates, const std::vector<unsigned int>& index);
+
+    // 1 / sum(w_i^2) of the normalized weights
+    double effectiveSampleSize() const;
+
+    // True if the effective sample size and the clusters are cached, i.e., requesting them does not take a pass over
+    // the samples
+    bool effectiveSampleSizeCached() const { return ess_valid_; }
+    bool clustersCached() const { return clusters_valid_; }
+
+    // Random number generator of this filter, also used by the models that update it
+    Random& rng() { return rng_; }
+
+    void setSeed(uint64_t seed) { rng_.setSeed(seed); }
+
 private:
 
     int i_current_;
-    std::vector<Sample> samples_[2];
+    SampleSet sample_sets_[2];
+
+    ResampleMethod resample_method_;
+
+    Random rng_;
+
+    double resample_threshold_;
+
+    // Effective sample size, cached by the functions that already touch all weights
+    mutable double ess_;
+    mutable bool ess_valid_;
+
+    std::vector<double> exp_weight_updates_;
+    std::vector<double> new_weights_;
+
+    // Divides the weights by total_weight and stores the effective sample size (given the sum of squared weights)
+    void scaleWeights(double total_weight, double total_weight_sq);
+
+    // Weights that are left after taking the integer part (residual resampling)
+    std::vector<double> residual_weights_;
+
+    // KLD-SAMPLING
+    bool kld_enabled_;
+    unsigned int kld_min_samples_;
+    unsigned int kld_max_samples_;
+    double kld_err_;
+    double kld_z_;
+    double kld_bin_size_xy_;
+    double kld_bin_size_theta_;
+    std::vector<double> cum_weights_;
+    FlatHashMap<long, bool> kld_bins_;
+
+    // Number of samples needed for the KLD bound, given the number of occupied bins
+    unsigned int kldLimit(unsigned int num_bins) const;
+
+    void resampleKLD(const SampleSet& old_samples, SampleSet& new_samples);
+
+    // Sample indices sorted by weight (scratch space)
+    std::vector<unsigned int> order_;
+
+    void resampleDeterministic(const SampleSet& old_samples, SampleSet& new_samples, unsigned int num_samples);
+
+    // Draws 'num_samples' samples proportional to 'weights' in one pass, and stores them in new_samples,
+    // starting at index 'offset'. If stratified is false, systematic resampling is used.
+    void resampleLowVariance(const SampleSet& old_samples, const std::vector<double>& weights, SampleSet& new_samples,
+                             unsigned int offset, unsigned int num_samples, bool stratified);
+
+    void resampleResidual(const SampleSet& old_samples, SampleSet& new_samples, unsigned int num_samples);
+
+    // ARRAY-OF-STRUCTS ADAPTER
+    mutable std::vector<Sample> samples_;
+
+    // True if samples_ is equal to the current sample set
+    mutable bool samples_valid_;
+
+    // True if samples_ may have been changed through the non-const samples() accessor
+    mutable bool samples_modified_;
+
+    mutable Sample best_sample_;
+
+    void syncSamples() const;
+
+    void syncSampleSet() const;
 
     void setUniformWeights();
 
+    // CLUSTERING
+    struct ClusterMoments
+    {
+        ClusterMoments() : w(0), wx(0), wy(0), wxx(0), wxy(0), wyy(0), wc(0), ws(0) {}
+
+        void add(const ClusterMoments& other);
+
+        double w, wx, wy, wxx, wxy, wyy;  // Weighted sums of 1, x, y, x^2, xy, y^2
+        double wc, ws;                    // Weighted sums of cos(theta), sin(theta)
+    };
+
+    struct ClusterStatistics
+    {
+        ClusterStatistics() : num_samples(0) {}
+
+        void add(const ClusterStatistics& other);
+
+        unsigned int num_samples;
+        ClusterMoments weighted;    // Weighted by the sample weights
+        ClusterMoments unweighted;  // Every sample counts as 1 (used if all weights of a cluster are 0)
+    };
+
+    struct ClusterBin
+    {
+        int x, y, a;
+        int parent;  // Union-find over neighboring bins
+        ClusterStatistics stats;
+    };
+
+    double cluster_bin_size_xy_;
+    double cluster_bin_size_theta_;
+
+    mutable std::vector<PoseCluster> clusters_;
+    mutable bool clusters_valid_;
+
+    // True if the clusters were up to date before the last non-const sampleSet() call (see moveClusters())
+    bool clusters_movable_;
+
+    // Scratch space
+    mutable std::vector<ClusterBin> cluster_bins_;
+    mutable FlatHashMap<long, int> cluster_bin_index_;
+    mutable std::vector<ClusterStatistics> cluster_stats_;
+    mutable int cluster_num_rot_bins_;
+    mutable double cluster_rot_bin_size_;
+
+    // Clusters are built in three steps: beginClusters(), addToClusters() for every sample (or while resampling,
+    // for every sample that is copied 'count' times, with the given weight per copy), and finishClusters().
+    // The weights are normalized in the last step. max_bins is an upper bound of the number of occupied bins.
+    void beginClusters(unsigned int max_bins) const;
+
+    void addToClusters(const SampleSet& samples, unsigned int i, unsigned int count, double weight) const;
+
+    void finishClusters() const;
+
+    // Clusters the current samples
+    void updateClusters() const;
+
+    static int findRoot(std::vector<ClusterBin>& bins, int i);
+
 };
 
 #endif
@@ -0,0 +1,108 @@
+#include "pose_channel.h"
+
+#include <cstring>
+#include <map>
+#include <mutex>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+inline uint64_t toWord(double v)
+{
+    uint64_t w;
+    std::memcpy(&w, &v, sizeof(w));
+    return w;
+}
+
+inline double fromWord(uint64_t w)
+{
+    double v;
+    std::memcpy(&v, &w, sizeof(v));
+    return v;
+}
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+PoseChannel::PoseChannel() : sequence_(0)
+{
+    for(unsigned int i = 0; i < NUM_WORDS; ++i)
+        words_[i].store(0, std::memory_order_relaxed);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+std::shared_ptr<PoseChannel> PoseChannel::get(const std::string& name)
+{
+    // Only used when the plugins are configured, so a lock is fine here
+    static std::mutex mutex;
+    static std::map<std::string, std::shared_ptr<PoseChannel> > channels;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::shared_ptr<PoseChannel>& channel = channels[name];
+    if (!channel)
+        channel = std::make_shared<PoseChannel>();
+
+    return channel;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void PoseChannel::write(const geo::Pose3D& pose, const ros::Time& stamp)
+{
+    uint64_t words[NUM_WORDS] = {
+        toWord(pose.R.xx), toWord(pose.R.xy), toWord(pose.R.xz),
+        toWord(pose.R.yx), toWord(pose.R.yy), toWord(pose.R.yz),
+        toWord(pose.R.zx), toWord(pose.R.zy), toWord(pose.R.zz),
+        toWord(pose.t.x), toWord(pose.t.y), toWord(pose.t.z),
+        stamp.toNSec()
+    };
+
+    // Mark the pose as being written, and make sure the readers see that before any of the new words
+    uint64_t sequence = sequence_.load(std::memory_order_relaxed);
+    sequence_.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    for(unsigned int i = 0; i < NUM_WORDS; ++i)
+        words_[i].store(words[i], std::memory_order_relaxed);
+
+    sequence_.store(sequence + 2, std::memory_order_release);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool PoseChannel::read(geo::Pose3D& pose, ros::Time& stamp) const
+{
+    uint64_t words[NUM_WORDS];
+
+    uint64_t sequence;
+    while(true)
+    {
+        sequence = sequence_.load(std::memory_order_acquire);
+        if (sequence == 0)
+            return false;
+
+        if (sequence & 1)
+            continue;  // Being written: a write only takes a few stores
+
+        for(unsigned int i = 0; i < NUM_WORDS; ++i)
+            words[i] = words_[i].load(std::memory_order_relaxed);
+
+        // The words must be read before the sequence is checked again
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (sequence_.load(std::memory_order_relaxed) == sequence)
+            break;
+    }
+
+    pose.R = geo::Matrix3(fromWord(words[0]), fromWord(words[1]), fromWord(words[2]),
+                          fromWord(words[3]), fromWord(words[4]), fromWord(words[5]),
+                          fromWord(words[6]), fromWord(words[7]), fromWord(words[8]));
+    pose.t = geo::Vector3(fromWord(words[9]), fromWord(words[10]), fromWord(words[11]));
+    stamp.fromNSec(words[12]);
+
+    return true;
+}
@@ -0,0 +1,51 @@
+#ifndef ED_LOCALIZATION_POSE_CHANNEL_H_
+#define ED_LOCALIZATION_POSE_CHANNEL_H_
+
+#include <geolib/datatypes.h>
+#include <ros/time.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Latest pose (e.g., the localization result of a robot), shared between plugins in the same process (e.g., from the localization
+// plugin to the TF plugin) without locks or tf. A sequence lock: the writer never waits, and a reader retries
+// if the pose was written while it was reading. Only one thread may write.
+class PoseChannel
+{
+
+public:
+
+    PoseChannel();
+
+    // Returns the channel with the given name (e.g., the robot name), and creates it if it does not exist.
+    // The channels live in a shared library, such that all plugins of the process find the same channel.
+    static std::shared_ptr<PoseChannel> get(const std::string& name);
+
+    // Channels of the localization of a robot: the latest map -> odom correction (written after every scan), and
+    // the latest odometry (odom -> base_link, written as it comes in). Combined, they give the current pose.
+    static std::shared_ptr<PoseChannel> mapToOdom(const std::string& robot_name) { return get(robot_name + "/map_to_odom"); }
+    static std::shared_ptr<PoseChannel> odometry(const std::string& robot_name) { return get(robot_name + "/odom_to_base_link"); }
+
+    void write(const geo::Pose3D& pose, const ros::Time& stamp);
+
+    // Returns false if no pose was written yet
+    bool read(geo::Pose3D& pose, ros::Time& stamp) const;
+
+private:
+
+    // Rotation (row-major), translation and stamp (in nanoseconds)
+    static const unsigned int NUM_WORDS = 13;
+
+    // Odd while the writer is writing, zero if nothing was written yet
+    std::atomic<uint64_t> sequence_;
+
+    // The words are atomic (but relaxed), such that concurrent reads and writes are well-defined
+    std::atomic<uint64_t> words_[NUM_WORDS];
+
+};
+
+#endif
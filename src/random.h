@@ -0,0 +1,89 @@
+#ifndef ED_LOCALIZATION_RANDOM_H_
+#define ED_LOCALIZATION_RANDOM_H_
+
+#include <cmath>
+#include <stdint.h>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Fast, seedable pseudo random number generator (xoshiro256+, Blackman and Vigna). Not thread-safe:
+// every thread should use its own instance.
+class Random
+{
+
+public:
+
+    Random(uint64_t seed = 0) { setSeed(seed); }
+
+    // Initializes the state using splitmix64, as recommended by the authors of xoshiro
+    void setSeed(uint64_t seed)
+    {
+        for(int i = 0; i < 4; ++i)
+        {
+            uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            s_[i] = z ^ (z >> 31);
+        }
+    }
+
+    inline uint64_t next()
+    {
+        const uint64_t result = s_[0] + s_[3];
+        const uint64_t t = s_[1] << 17;
+
+        s_[2] ^= s_[0];
+        s_[3] ^= s_[1];
+        s_[1] ^= s_[2];
+        s_[0] ^= s_[3];
+
+        s_[2] ^= t;
+        s_[3] = rotl(s_[3], 45);
+
+        return result;
+    }
+
+    // Uniform in [0, 1)
+    inline double uniform()
+    {
+        return (next() >> 11) * (1.0 / 9007199254740992.0);  // 2^-53
+    }
+
+    // Standard normal distributed
+    inline double gaussian()
+    {
+        double n[2];
+        fillGaussian(n, 2);
+        return n[0];
+    }
+
+    // Fills 'values' with n standard normal distributed numbers, using the (basic, non-rejecting)
+    // Box-Muller transform. Every pair of uniform numbers gives two normal numbers.
+    void fillGaussian(double* values, unsigned int n)
+    {
+        unsigned int i = 0;
+        for(; i + 2 <= n; i += 2)
+        {
+            // 1 - uniform() is in (0, 1], so the log is always defined
+            double r = std::sqrt(-2.0 * std::log(1.0 - uniform()));
+            double a = 2 * M_PI * uniform();
+            values[i] = r * std::cos(a);
+            values[i + 1] = r * std::sin(a);
+        }
+
+        if (i < n)
+            values[i] = std::sqrt(-2.0 * std::log(1.0 - uniform())) * std::cos(2 * M_PI * uniform());
+    }
+
+private:
+
+    uint64_t s_[4];
+
+    static inline uint64_t rotl(const uint64_t x, int k)
+    {
+        return (x << k) | (x >> (64 - k));
+    }
+
+};
+
+#endif
@@ -0,0 +1,142 @@
+#include "segment_grid.h"
+
+#include <algorithm>
+#include <cmath>
+
+// ----------------------------------------------------------------------------------------------------
+
+SegmentGrid::SegmentGrid() : cell_size_(1), inv_cell_size_(1), width_(0), height_(0), num_segments_(0)
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+SegmentGrid::~SegmentGrid()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+template<typename F>
+void SegmentGrid::forEachCell(const geo::Vec2& p1, const geo::Vec2& p2, F f) const
+{
+    int mx_min = std::floor((std::min(p1.x, p2.x) - origin_.x) * inv_cell_size_);
+    int my_min = std::floor((std::min(p1.y, p2.y) - origin_.y) * inv_cell_size_);
+    int mx_max = std::floor((std::max(p1.x, p2.x) - origin_.x) * inv_cell_size_);
+    int my_max = std::floor((std::max(p1.y, p2.y) - origin_.y) * inv_cell_size_);
+
+    mx_min = std::max(0, mx_min);
+    my_min = std::max(0, my_min);
+    mx_max = std::min(width_ - 1, mx_max);
+    my_max = std::min(height_ - 1, my_max);
+
+    // Of the cells in the bounding box of the segment, only take the cells that are close enough to the
+    // line through the segment: the distance from the cell center to the line must be at most half the
+    // cell diagonal. This is conservative, but avoids filling the whole box for diagonal segments.
+    geo::Vec2 d = p2 - p1;
+    double length = d.length();
+    geo::Vec2 n = length > 0 ? geo::Vec2(-d.y / length, d.x / length) : geo::Vec2(0, 0);
+    double max_dist = 0.5 * std::sqrt(2.0) * cell_size_;
+
+    for(int my = my_min; my <= my_max; ++my)
+    {
+        for(int mx = mx_min; mx <= mx_max; ++mx)
+        {
+            geo::Vec2 c(origin_.x + (mx + 0.5) * cell_size_, origin_.y + (my + 0.5) * cell_size_);
+            if (std::abs((c - p1).dot(n)) <= max_dist)
+                f(my * width_ + mx);
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void SegmentGrid::build(const std::vector<geo::Vec2>& lines_start, const std::vector<geo::Vec2>& lines_end, double cell_size)
+{
+    num_segments_ = lines_start.size();
+    cell_size_ = cell_size;
+    inv_cell_size_ = 1.0 / cell_size;
+
+    if (lines_start.empty())
+    {
+        width_ = height_ = 0;
+        cell_start_.assign(1, 0);
+        cell_segments_.clear();
+        return;
+    }
+
+    geo::Vec2 min(1e9, 1e9);
+    geo::Vec2 max(-1e9, -1e9);
+    for(unsigned int i = 0; i < num_segments_; ++i)
+    {
+        const geo::Vec2& p1 = lines_start[i];
+        const geo::Vec2& p2 = lines_end[i];
+        min.x = std::min(min.x, std::min(p1.x, p2.x));
+        min.y = std::min(min.y, std::min(p1.y, p2.y));
+        max.x = std::max(max.x, std::max(p1.x, p2.x));
+        max.y = std::max(max.y, std::max(p1.y, p2.y));
+    }
+
+    origin_ = min;
+    width_ = (max.x - min.x) * inv_cell_size_ + 1;
+    height_ = (max.y - min.y) * inv_cell_size_ + 1;
+
+    // First pass: count the segments per cell
+    cell_start_.assign(width_ * height_ + 1, 0);
+    for(unsigned int i = 0; i < num_segments_; ++i)
+        forEachCell(lines_start[i], lines_end[i], [this](int c) { ++cell_start_[c + 1]; });
+
+    for(unsigned int c = 1; c < cell_start_.size(); ++c)
+        cell_start_[c] += cell_start_[c - 1];
+
+    // Second pass: fill the cell lists
+    cell_segments_.resize(cell_start_.back());
+    cell_fill_.assign(cell_start_.begin(), cell_start_.end() - 1);
+    for(unsigned int i = 0; i < num_segments_; ++i)
+        forEachCell(lines_start[i], lines_end[i], [this, i](int c) { cell_segments_[cell_fill_[c]++] = i; });
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void SegmentGrid::query(const geo::Vec2& min, const geo::Vec2& max, Query& q, std::vector<unsigned int>& indices) const
+{
+    indices.clear();
+
+    if (width_ == 0)
+        return;
+
+    int mx_min = std::max(0, (int)std::floor((min.x - origin_.x) * inv_cell_size_));
+    int my_min = std::max(0, (int)std::floor((min.y - origin_.y) * inv_cell_size_));
+    int mx_max = std::min(width_ - 1, (int)std::floor((max.x - origin_.x) * inv_cell_size_));
+    int my_max = std::min(height_ - 1, (int)std::floor((max.y - origin_.y) * inv_cell_size_));
+
+    if (q.visited.size() != num_segments_)
+    {
+        q.visited.assign(num_segments_, 0);
+        q.stamp = 0;
+    }
+
+    // Use a new stamp for every query, such that 'visited' does not have to be cleared
+    if (++q.stamp == 0)
+    {
+        std::fill(q.visited.begin(), q.visited.end(), 0);
+        q.stamp = 1;
+    }
+
+    for(int my = my_min; my <= my_max; ++my)
+    {
+        for(int mx = mx_min; mx <= mx_max; ++mx)
+        {
+            int c = my * width_ + mx;
+            for(unsigned int k = cell_start_[c]; k < cell_start_[c + 1]; ++k)
+            {
+                unsigned int i = cell_segments_[k];
+                if (q.visited[i] != q.stamp)
+                {
+                    q.visited[i] = q.stamp;
+                    indices.push_back(i);
+                }
+            }
+        }
+    }
+}
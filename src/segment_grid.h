@@ -0,0 +1,60 @@
+#ifndef ED_LOCALIZATION_SEGMENT_GRID_H_
+#define ED_LOCALIZATION_SEGMENT_GRID_H_
+
+#include <geolib/datatypes.h>
+
+#include <vector>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Uniform grid over a set of line segments, used to quickly find the segments that lie within an
+// axis-aligned box. Each cell stores the indices of the segments that pass through it.
+class SegmentGrid
+{
+
+public:
+
+    // Scratch space for queries. Keeps track of which segments were already returned, such that
+    // segments that span multiple cells are only returned once. Use one per thread.
+    struct Query
+    {
+        Query() : stamp(0) {}
+
+        std::vector<unsigned int> visited;
+        unsigned int stamp;
+    };
+
+    SegmentGrid();
+
+    ~SegmentGrid();
+
+    void build(const std::vector<geo::Vec2>& lines_start, const std::vector<geo::Vec2>& lines_end, double cell_size);
+
+    // Sets 'indices' to the segments that (may) intersect the box [min, max]
+    void query(const geo::Vec2& min, const geo::Vec2& max, Query& q, std::vector<unsigned int>& indices) const;
+
+    unsigned int numSegments() const { return num_segments_; }
+
+private:
+
+    geo::Vec2 origin_;
+    double cell_size_;
+    double inv_cell_size_;
+    int width_;
+    int height_;
+
+    unsigned int num_segments_;
+
+    // Compressed cell lists: the segments of cell i are cell_segments_[cell_start_[i] .. cell_start_[i + 1]]
+    std::vector<unsigned int> cell_start_;
+    std::vector<unsigned int> cell_segments_;
+
+    // Write position per cell while filling the cell lists (kept, such that rebuilding does not allocate)
+    std::vector<unsigned int> cell_fill_;
+
+    template<typename F>
+    void forEachCell(const geo::Vec2& p1, const geo::Vec2& p2, F f) const;
+
+};
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef ED_LOCALIZATION_SPSC_QUEUE_H_
+#define ED_LOCALIZATION_SPSC_QUEUE_H_
+
+#include <atomic>
+#include <vector>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Bounded lock-free queue for exactly one producer thread and one consumer thread
+template<typename T>
+class SPSCQueue
+{
+
+public:
+
+    SPSCQueue(unsigned int capacity = 16) : head_(0), tail_(0)
+    {
+        setCapacity(capacity);
+    }
+
+    // Not thread-safe: may only be called while no other thread uses the queue
+    void setCapacity(unsigned int capacity)
+    {
+        // One slot is always kept empty to distinguish a full from an empty queue
+        buffer_.clear();
+        buffer_.resize(capacity + 1);
+        head_.store(0);
+        tail_.store(0);
+    }
+
+    // Producer side. Returns false if the queue is full.
+    bool push(const T& item)
+    {
+        unsigned int tail = tail_.load(std::memory_order_relaxed);
+        unsigned int next = increment(tail);
+
+        if (next == head_.load(std::memory_order_acquire))
+            return false;
+
+        buffer_[tail] = item;
+        tail_.store(next, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side. Returns false if the queue is empty.
+    bool pop(T& item)
+    {
+        unsigned int head = head_.load(std::memory_order_relaxed);
+
+        if (head == tail_.load(std::memory_order_acquire))
+            return false;
+
+        item = buffer_[head];
+        buffer_[head] = T();  // Release the item (e.g. a shared pointer) as soon as possible
+        head_.store(increment(head), std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side
+    bool empty() const
+    {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    }
+
+    // Consumer side: true if the next push will fail
+    bool full() const
+    {
+        return increment(tail_.load(std::memory_order_acquire)) == head_.load(std::memory_order_acquire);
+    }
+
+private:
+
+    std::vector<T> buffer_;
+
+    // Next slot to read (only written by the consumer)
+    std::atomic<unsigned int> head_;
+
+    // Next slot to write (only written by the producer)
+    std::atomic<unsigned int> tail_;
+
+    inline unsigned int increment(unsigned int i) const
+    {
+        return (i + 1 == buffer_.size()) ? 0 : i + 1;
+    }
+
+};
+
+#endif
@@ -0,0 +1,153 @@
+#include "stage_profiler.h"
+
+#include <algorithm>
+#include <cmath>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+const double HISTOGRAM_MIN = 1e-6;  // s
+const double HISTOGRAM_LOG_RANGE = 7;  // Decades: 1 us - 10 s
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+DurationHistogram::DurationHistogram()
+{
+    clear();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void DurationHistogram::add(double seconds)
+{
+    int b = 0;
+    if (seconds > HISTOGRAM_MIN)
+        b = std::log10(seconds / HISTOGRAM_MIN) / HISTOGRAM_LOG_RANGE * NUM_BUCKETS;
+
+    ++buckets_[std::max(0, std::min<int>(NUM_BUCKETS - 1, b))];
+    ++count_;
+    sum_ += seconds;
+    max_ = std::max(max_, seconds);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void DurationHistogram::clear()
+{
+    std::fill(buckets_, buckets_ + NUM_BUCKETS, 0);
+    count_ = 0;
+    sum_ = 0;
+    max_ = 0;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+double DurationHistogram::percentile(double p) const
+{
+    if (count_ == 0)
+        return 0;
+
+    // Number of samples that must be at or below the percentile
+    unsigned int n = std::max<unsigned int>(1, std::ceil(p / 100 * count_));
+
+    unsigned int cum_count = 0;
+    for(unsigned int b = 0; b < NUM_BUCKETS; ++b)
+    {
+        cum_count += buckets_[b];
+        if (cum_count >= n)
+        {
+            // Upper bound of the bucket, but never more than the largest measured value
+            double upper = HISTOGRAM_MIN * std::pow(10.0, (b + 1) * HISTOGRAM_LOG_RANGE / NUM_BUCKETS);
+            return std::min(upper, max_);
+        }
+    }
+
+    return max_;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+StageProfiler::StageProfiler() : stages_(NUM_STAGES), counters_(NUM_COUNTERS)
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void StageProfiler::record(Stage stage, double seconds)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    stages_[stage].add(seconds);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void StageProfiler::record(Counter counter, double value)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    counters_[counter].add(value);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+StageProfiler::Clock::time_point StageProfiler::recordSince(Stage stage, const Clock::time_point& start)
+{
+    Clock::time_point now = Clock::now();
+    record(stage, std::chrono::duration<double>(now - start).count());
+    return now;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void StageProfiler::takeSnapshot(std::vector<DurationHistogram>& stages, std::vector<CounterStatistics>& counters)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    stages = stages_;
+    counters = counters_;
+
+    for(std::vector<DurationHistogram>::iterator it = stages_.begin(); it != stages_.end(); ++it)
+        it->clear();
+
+    for(std::vector<CounterStatistics>::iterator it = counters_.begin(); it != counters_.end(); ++it)
+        *it = CounterStatistics();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+const char* StageProfiler::stageName(Stage stage)
+{
+    switch (stage)
+    {
+    case TF_LOOKUP: return "tf_lookup";
+    case MOTION_UPDATE: return "motion_update";
+    case UNIQUE_SAMPLES: return "unique_samples";
+    case CROSS_SECTION_UPDATE: return "cross_section_update";
+    case CROSS_SECTION_SELECT: return "cross_section_select";
+    case WEIGHT_UPDATE: return "weight_update";
+    case RESAMPLE: return "resample";
+    case MEAN_POSE: return "mean_pose";
+    case PUBLISH: return "publish";
+    case GLOBAL_LOCALIZATION: return "global_localization";
+    case TOTAL: return "total";
+    default: return "unknown";
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+const char* StageProfiler::counterName(Counter counter)
+{
+    switch (counter)
+    {
+    case NUM_SAMPLES: return "samples";
+    case NUM_UNIQUE_SAMPLES: return "unique_samples";
+    case NUM_LINES: return "lines";
+    case NUM_BEAMS: return "beams";
+    case NUM_DYNAMIC_BEAMS: return "dynamic_beams";
+    default: return "unknown";
+    }
+}
@@ -0,0 +1,128 @@
+#ifndef ED_LOCALIZATION_STAGE_PROFILER_H_
+#define ED_LOCALIZATION_STAGE_PROFILER_H_
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Histogram of durations with logarithmically spaced buckets, from 1 us to 10 s (about 17% per bucket)
+class DurationHistogram
+{
+
+public:
+
+    DurationHistogram();
+
+    void add(double seconds);
+
+    void clear();
+
+    unsigned int count() const { return count_; }
+
+    double max() const { return max_; }
+
+    double mean() const { return count_ > 0 ? sum_ / count_ : 0; }
+
+    // Returns the (upper bound of the bucket of the) given percentile (0 - 100), in seconds
+    double percentile(double p) const;
+
+private:
+
+    static const unsigned int NUM_BUCKETS = 100;
+
+    unsigned int buckets_[NUM_BUCKETS];
+    unsigned int count_;
+    double sum_;
+    double max_;
+
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Mean and maximum of a counter (e.g., number of unique samples) over the current window
+struct CounterStatistics
+{
+    CounterStatistics() : count(0), sum(0), max(0) {}
+
+    void add(double v)
+    {
+        ++count;
+        sum += v;
+        max = std::max(max, v);
+    }
+
+    double mean() const { return count > 0 ? sum / count : 0; }
+
+    unsigned int count;
+    double sum;
+    double max;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Collects per-stage duration histograms and counters of the localization pipeline. Thread-safe:
+// stages may be recorded from both the ED thread and the localization thread.
+class StageProfiler
+{
+
+public:
+
+    enum Stage
+    {
+        TF_LOOKUP,
+        MOTION_UPDATE,
+        UNIQUE_SAMPLES,
+        CROSS_SECTION_UPDATE,   // Updating the cross section from the world model
+        CROSS_SECTION_SELECT,   // Selecting and indexing the lines for the current scan
+        WEIGHT_UPDATE,
+        RESAMPLE,
+        MEAN_POSE,
+        PUBLISH,
+        GLOBAL_LOCALIZATION,    // Global search (only when triggered)
+        TOTAL,
+        NUM_STAGES
+    };
+
+    enum Counter
+    {
+        NUM_SAMPLES,
+        NUM_UNIQUE_SAMPLES,
+        NUM_LINES,
+        NUM_BEAMS,
+        NUM_DYNAMIC_BEAMS,
+        NUM_COUNTERS
+    };
+
+    typedef std::chrono::steady_clock Clock;
+
+    StageProfiler();
+
+    void record(Stage stage, double seconds);
+
+    void record(Counter counter, double value);
+
+    // Records the time since 'start' for the given stage, and returns the current time (so that
+    // consecutive stages can be timed with one clock read each).
+    Clock::time_point recordSince(Stage stage, const Clock::time_point& start);
+
+    // Copies the histograms and counters collected since the last call, and clears them
+    void takeSnapshot(std::vector<DurationHistogram>& stages, std::vector<CounterStatistics>& counters);
+
+    static const char* stageName(Stage stage);
+
+    static const char* counterName(Counter counter);
+
+private:
+
+    std::mutex mutex_;
+
+    std::vector<DurationHistogram> stages_;
+    std::vector<CounterStatistics> counters_;
+
+};
+
+#endif
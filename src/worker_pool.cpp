@@ -0,0 +1,123 @@
+#include "worker_pool.h"
+
+// ----------------------------------------------------------------------------------------------------
+
+WorkerPool::WorkerPool() : task_function_(0), task_(0), n_(0), chunk_size_(1), next_(0), num_working_(0), job_id_(0), stop_(false)
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+WorkerPool::~WorkerPool()
+{
+    stopThreads();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void WorkerPool::setNumThreads(unsigned int num_threads)
+{
+    if (num_threads == 0)
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    if (num_threads == numThreads())
+        return;
+
+    stopThreads();
+
+    stop_ = false;
+    for(unsigned int i = 1; i < num_threads; ++i)
+        threads_.push_back(std::thread(&WorkerPool::workerLoop, this, i, job_id_));
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void WorkerPool::run(unsigned int n, TaskFunction task_function, const void* task)
+{
+    if (n == 0)
+        return;
+
+    if (threads_.empty())
+    {
+        task_function(task, 0, 0, n);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    // Use a few chunks per thread, such that threads that finish early can take over work
+    task_function_ = task_function;
+    task_ = task;
+    n_ = n;
+    chunk_size_ = std::max(1u, n / (4 * numThreads()));
+    next_ = 0;
+    num_working_ = threads_.size();
+    ++job_id_;
+
+    cv_start_.notify_all();
+
+    // The calling thread also takes part in the work
+    executeChunks(0, lock);
+
+    // Wait until all workers are done with this job
+    cv_done_.wait(lock, [this]() { return num_working_ == 0; });
+
+    task_function_ = 0;
+    task_ = 0;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void WorkerPool::stopThreads()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cv_start_.notify_all();
+
+    for(std::vector<std::thread>::iterator it = threads_.begin(); it != threads_.end(); ++it)
+        it->join();
+
+    threads_.clear();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void WorkerPool::workerLoop(unsigned int thread_idx, unsigned long last_job_id)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while(true)
+    {
+        cv_start_.wait(lock, [this, last_job_id]() { return stop_ || job_id_ != last_job_id; });
+
+        if (stop_)
+            return;
+
+        last_job_id = job_id_;
+
+        executeChunks(thread_idx, lock);
+
+        if (--num_working_ == 0)
+            cv_done_.notify_one();
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void WorkerPool::executeChunks(unsigned int thread_idx, std::unique_lock<std::mutex>& lock)
+{
+    while(next_ < n_)
+    {
+        unsigned int begin = next_;
+        unsigned int end = std::min(n_, begin + chunk_size_);
+        next_ = end;
+
+        // Execute the chunk without holding the lock
+        TaskFunction task_function = task_function_;
+        const void* task = task_;
+        lock.unlock();
+        task_function(task, thread_idx, begin, end);
+        lock.lock();
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef ED_LOCALIZATION_WORKER_POOL_H_
+#define ED_LOCALIZATION_WORKER_POOL_H_
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Fixed-size pool of worker threads that executes a range [0, n) in parallel. The calling thread
+// takes part in the work, so a pool with N threads only starts N - 1 additional threads.
+class WorkerPool
+{
+
+public:
+
+    WorkerPool();
+
+    ~WorkerPool();
+
+    // Sets the total number of threads (including the calling thread). 0 means: one thread per core
+    void setNumThreads(unsigned int num_threads);
+
+    unsigned int numThreads() const { return threads_.size() + 1; }
+
+    // Splits [0, n) into chunks and executes them on all threads. Blocks until all chunks are done. The task
+    // is called with the index of the executing thread (in [0, numThreads()) ) and the sub range [begin, end).
+    // It is passed by reference (not wrapped in a std::function), so running a job does not allocate.
+    template<typename F>
+    void run(unsigned int n, const F& task)
+    {
+        run(n, &invoke<F>, &task);
+    }
+
+private:
+
+    typedef void (*TaskFunction)(const void* task, unsigned int thread_idx, unsigned int begin, unsigned int end);
+
+    template<typename F>
+    static void invoke(const void* task, unsigned int thread_idx, unsigned int begin, unsigned int end)
+    {
+        (*static_cast<const F*>(task))(thread_idx, begin, end);
+    }
+
+    std::vector<std::thread> threads_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_start_;
+    std::condition_variable cv_done_;
+
+    // Current job (protected by mutex_)
+    TaskFunction task_function_;
+    const void* task_;
+    unsigned int n_;
+    unsigned int chunk_size_;
+    unsigned int next_;
+    unsigned int num_working_;
+    unsigned long job_id_;
+    bool stop_;
+
+    void run(unsigned int n, TaskFunction task_function, const void* task);
+
+    void stopThreads();
+
+    void workerLoop(unsigned int thread_idx, unsigned long last_job_id);
+
+    void executeChunks(unsigned int thread_idx, std::unique_lock<std::mutex>& lock);
+
+};
+
+#endif